@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "camera.hpp"
+#include "constants.hpp"
+#include "dual.hpp"
+#include "vector.hpp"
+
+namespace drt {
+
+// Running mean and variance of the samples of every pixel, updated one
+// sample at a time with Welford's algorithm. When `T` is a dual number,
+// variances are also tracked for each of the derivatives.
+template <typename T>
+class PixelEstimates {
+public:
+    // Values whose variance is tracked per channel: the radiance and its
+    // derivatives
+    static constexpr std::size_t components = 1 + num_tangents<T>;
+
+    // `min_radiance` bounds below the radiance by which errors are divided,
+    // so that dark pixels do not take all the samples.
+    explicit PixelEstimates(std::size_t size, double min_radiance = 1e-3)
+      : m_samples(size, 0)
+      , m_mean(size, Vector<T, 3>(0))
+      , m_m2(size * 3 * components, 0)
+      , m_min_radiance(min_radiance)
+    { }
+
+    std::size_t size() const
+    {
+        return m_samples.size();
+    }
+
+    std::size_t samples(std::size_t pixel) const
+    {
+        return m_samples[pixel];
+    }
+
+    const Vector<T, 3>& mean(std::size_t pixel) const
+    {
+        return m_mean[pixel];
+    }
+
+    void add(std::size_t pixel, const Vector<T, 3>& sample)
+    {
+        std::size_t n = ++m_samples[pixel];
+        Vector<T, 3> delta = sample - m_mean[pixel];
+        m_mean[pixel] += delta / double(n);
+        Vector<T, 3> delta2 = sample - m_mean[pixel];
+        double *m2 = &m_m2[pixel * 3 * components];
+        for (std::size_t c = 0; c < 3; ++c, m2 += components) {
+            m2[0] += real(delta[c]) * real(delta2[c]);
+            for (std::size_t k = 1; k < components; ++k)
+                m2[k] += tangent(delta[c], k-1) * tangent(delta2[c], k-1);
+        }
+    }
+
+    // Standard error of the mean of the pixel, relative to its radiance
+    // (both averaged over channels). With derivatives, this is the largest
+    // error among the radiance and the derivatives, all relative to the
+    // radiance. Pixels with less than two samples have an infinite error.
+    double error(std::size_t pixel) const
+    {
+        std::size_t n = m_samples[pixel];
+        if (n < 2)
+            return inf;
+        const double *m2 = &m_m2[pixel * 3 * components];
+        double variance = 0;
+        for (std::size_t k = 0; k < components; ++k) {
+            double sum = m2[k] + m2[components + k] + m2[2*components + k];
+            variance = std::max(variance, sum / (3 * (n-1)));
+        }
+        const Vector<T, 3>& mean = m_mean[pixel];
+        double radiance = (std::abs(real(mean[0])) + std::abs(real(mean[1]))
+                           + std::abs(real(mean[2]))) / 3;
+        return std::sqrt(variance / n) / std::max(radiance, m_min_radiance);
+    }
+
+private:
+    std::vector<std::size_t> m_samples;
+    std::vector<Vector<T, 3>> m_mean;
+    std::vector<double> m_m2;
+    double m_min_radiance;
+};
+
+struct AdaptiveSettings {
+    // Samples taken by every pixel before any is refined
+    std::size_t min_samples = 16;
+    // Budget, as an average number of samples per pixel
+    std::size_t samples = 64;
+    // Samples added to a pixel each time it is refined
+    std::size_t batch = 4;
+    // Error (see `PixelEstimates::error`) up to which pixels are left as
+    // they are. Rendering stops early once every pixel is below it.
+    double target_error = 0;
+};
+
+// Renders with samples spread adaptively among the pixels of `estimates`.
+// Every pixel first takes `min_samples` samples, then rounds of about one
+// sample per pixel on average go to the pixels of highest error, `batch` to
+// each, until the budget is spent or no pixel is above the target error.
+// As samples decide where further samples go, pixels whose first samples
+// missed rare bright paths are refined less, which biases them slightly
+// (towards darker values). A larger `min_samples` limits this.
+//
+// Samples are rendered in chunks of at most `chunk_size` by calling
+// `render(samples, count, values)`, which must store the estimate (radiance
+// over pdf) of `samples[j]` in `values[j]`. The samples of each pixel are
+// numbered consecutively from zero.
+template <typename T, typename Render>
+void render_adaptive(const AdaptiveSettings& settings,
+                     PixelEstimates<T>& estimates,
+                     Render&& render,
+                     std::size_t chunk_size = std::size_t(1) << 16)
+{
+    std::vector<PixelSample> chunk;
+    std::vector<Vector<T, 3>> values(chunk_size);
+    chunk.reserve(chunk_size);
+    auto flush = [&]() {
+        render(chunk.data(), chunk.size(), values.data());
+        for (std::size_t j = 0; j < chunk.size(); ++j)
+            estimates.add(chunk[j].pixel, values[j]);
+        chunk.clear();
+    };
+
+    std::size_t n = estimates.size();
+    std::size_t budget = settings.samples * n;
+    std::size_t spent = 0;
+    // Queues `count` more samples of `pixel`. A pixel must not be queued
+    // twice between flushes, as indices follow its current sample count.
+    auto queue = [&](std::size_t pixel, std::size_t count) {
+        std::size_t first = estimates.samples(pixel);
+        for (std::size_t i = 0; i < count; ++i) {
+            chunk.push_back({std::uint32_t(pixel), std::uint32_t(first + i)});
+            if (chunk.size() == chunk_size)
+                flush();
+        }
+        spent += count;
+    };
+
+    for (std::size_t pixel = 0; pixel < n; ++pixel)
+        queue(pixel, std::min(settings.min_samples, settings.samples));
+    flush();
+
+    std::size_t batch = std::max(settings.batch, std::size_t(1));
+    std::vector<double> errors(n);
+    std::vector<std::uint32_t> pixels;
+    while (spent < budget) {
+        pixels.clear();
+        for (std::size_t pixel = 0; pixel < n; ++pixel) {
+            errors[pixel] = estimates.error(pixel);
+            if (errors[pixel] > settings.target_error)
+                pixels.push_back(std::uint32_t(pixel));
+        }
+        if (pixels.empty())
+            break;
+        std::size_t round = std::min(n, budget - spent);
+        std::size_t count = std::min(pixels.size(),
+                                     std::max(round / batch, std::size_t(1)));
+        std::nth_element(pixels.begin(), pixels.begin() + (count - 1),
+                         pixels.end(), [&](std::uint32_t a, std::uint32_t b) {
+                             return errors[a] > errors[b];
+                         });
+        for (std::size_t i = 0; i < count; ++i)
+            queue(pixels[i], std::min(batch, budget - spent));
+        flush();
+    }
+}
+
+} // namespace drt
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+#include "camera.hpp"
+#include "gradient.hpp"
+#include "optimizer.hpp"
+#include "parallel.hpp"
+#include "pathtracer.hpp"
+#include "random.hpp"
+#include "tape.hpp"
+#include "vector.hpp"
+
+namespace drt {
+
+// Renders images of a scene, and backpropagates adjoint images (derivatives
+// of a loss w.r.t. every pixel, however the loss was computed) to the scene
+// parameters, on the threads of `pool`. No graph of the image is kept: every
+// sample is retraced with path replay and backpropagates the adjoint of its
+// pixel on its own. Samplers and gradient buffers are kept per thread and
+// reused across calls.
+//
+// When the work is split between processes, each renders only shard
+// `shard` of `shards` (every `shards`th tile), the gradients of all shards
+// adding up to that of the whole image.
+template <typename T, typename SceneT>
+class AdjointRenderer {
+public:
+    AdjointRenderer(ThreadPool& pool,
+                    const SceneT& scene,
+                    const Camera<T>& cam,
+                    const Pathtracer<T, SceneT>& tracer,
+                    const Sampler& sampler,
+                    std::size_t shard = 0,
+                    std::size_t shards = 1)
+      : m_pool(pool)
+      , m_scene(scene)
+      , m_cam(cam)
+      , m_tracer(tracer)
+      , m_samplers(pool.size(), sampler)
+      , m_buffers(pool.size())
+    {
+        std::vector<Tile> tiles = make_tiles(cam.width(), cam.height());
+        for (std::size_t i = shard; i < tiles.size(); i += shards)
+            m_tiles.push_back(tiles[i]);
+    }
+
+    // Renders samples `first` to `first + spp` of every pixel, storing the
+    // mean of each pixel in `image` (zero outside of the shard).
+    void render(std::size_t first, std::size_t spp, Vector<T, 3> *image)
+    {
+        std::fill(image, image + m_cam.width() * m_cam.height(),
+                  Vector<T, 3>(0));
+        sample(first, spp, [&](std::size_t, Sampler& sampler, std::size_t p,
+                               const Vector<T, 3>& dir, double pdf) {
+            Vector<T, 3, true> radiance = m_tracer.trace(
+                m_scene, m_cam.eye(), dir, sampler);
+            image[p] += radiance.detach() / (pdf * spp);
+        });
+    }
+
+    // Adds the gradient w.r.t. `params` of a loss whose derivative w.r.t. an
+    // image of `spp` samples per pixel is `adjoint` to `grads` (a flat array,
+    // see `ParameterSet`), estimated from samples `first` to `first + spp`
+    // of every pixel. These should not be the samples of the image, so that
+    // the gradient is unbiased. Every sample backpropagates the adjoint of
+    // its pixel over `spp` and over its pdf, pixels being the mean of their
+    // samples' radiance over pdf. Variables are left untouched.
+    void backward(std::size_t first,
+                  std::size_t spp,
+                  const Vector<T, 3> *adjoint,
+                  const ParameterSet<T, 3>& params,
+                  T *grads)
+    {
+        sample(first, spp, [&](std::size_t thread, Sampler& sampler,
+                               std::size_t p, const Vector<T, 3>& dir,
+                               double pdf) {
+            m_buffers[thread].bind();
+            m_tracer.trace_replay(m_scene, m_cam.eye(), dir, sampler,
+                                  adjoint[p] / (pdf * spp));
+            GradientBuffer<T, 3>::unbind();
+        });
+        // Summed in thread order, so that the gradient does not depend on
+        // how tiles were scheduled beyond rounding
+        for (auto& buffer : m_buffers) {
+            params.accumulate(buffer, grads);
+            buffer.clear();
+        }
+    }
+
+private:
+    // Takes samples `first` to `first + spp` of every pixel, calling
+    // `estimate(thread, sampler, pixel, dir, pdf)` for each
+    template <typename Estimate>
+    void sample(std::size_t first, std::size_t spp, Estimate&& estimate)
+    {
+        std::size_t width = m_cam.width();
+        m_pool.run(m_tiles.size(), [&](std::size_t thread, std::size_t i) {
+            Sampler& sampler = m_samplers[thread];
+            const Tile& tile = m_tiles[i];
+            for (std::size_t y = tile.y_begin; y < tile.y_end; ++y) {
+                for (std::size_t x = tile.x_begin; x < tile.x_end; ++x) {
+                    std::size_t p = y*width + x;
+                    for (std::size_t k = first; k < first + spp; ++k) {
+                        sampler.start(p, k);
+                        auto [dir, pdf] = m_cam.sample(x, y, sampler);
+                        estimate(thread, sampler, p, dir, pdf);
+                        Tape::local().clear();
+                    }
+                }
+            }
+        });
+    }
+
+    ThreadPool& m_pool;
+    const SceneT& m_scene;
+    const Camera<T>& m_cam;
+    Pathtracer<T, SceneT> m_tracer;
+    std::vector<Tile> m_tiles;
+    std::vector<Sampler> m_samplers;
+    std::vector<GradientBuffer<T, 3>> m_buffers;
+};
+
+} // namespace drt
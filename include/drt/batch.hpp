@@ -0,0 +1,243 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <vector>
+#include "shape.hpp"
+#include "simd.hpp"
+#include "vector.hpp"
+
+namespace drt {
+
+namespace internal {
+
+// Columns of doubles, one per primitive attribute, padded past the last
+// primitive so that whole lanes can always be loaded.
+template <std::size_t N>
+class Columns {
+public:
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+    void clear()
+    {
+        m_size = 0;
+        for (auto& column : m_columns)
+            column.clear();
+    }
+
+    // Adds a primitive; `padding` fills the lanes past the last one.
+    void push_back(const std::array<double, N>& values,
+                   const std::array<double, N>& padding)
+    {
+        for (std::size_t k = 0; k < N; ++k) {
+            m_columns[k].resize(m_size + simd::Lanes::size, padding[k]);
+            m_columns[k][m_size] = values[k];
+        }
+        ++m_size;
+    }
+
+    simd::Lanes load(std::size_t k, std::size_t i) const
+    {
+        return simd::Lanes::load(m_columns[k].data() + i);
+    }
+
+private:
+    std::size_t m_size = 0;
+    std::array<std::vector<double>, N> m_columns;
+};
+
+// Finds the nearest of primitives `[begin, end)` hit within `(0, tmax)`,
+// given `hit(i)` which returns the distances to primitives
+// `[i, i + Lanes::size)` (non-positive or NaN when missed). On a hit,
+// shortens `tmax` and sets `index` to the primitive.
+template <typename Hit>
+bool nearest_hit(std::size_t begin,
+                 std::size_t end,
+                 double& tmax,
+                 std::size_t& index,
+                 Hit&& hit)
+{
+    using simd::Lanes;
+    Lanes zero(0.);
+    Lanes last = Lanes(double(end));
+    Lanes best(tmax);
+    Lanes best_index(-1.);
+    for (std::size_t i = begin; i < end; i += Lanes::size) {
+        Lanes lane = Lanes::iota() + Lanes(double(i));
+        Lanes t = hit(i);
+        Lanes::Mask mask = (t > zero) & (t < best) & (lane < last);
+        best = select(mask, t, best);
+        best_index = select(mask, lane, best_index);
+    }
+    double ts[Lanes::size], indices[Lanes::size];
+    best.store(ts);
+    best_index.store(indices);
+    bool found = false;
+    for (std::size_t k = 0; k < Lanes::size; ++k) {
+        if (indices[k] < 0 || (found && ts[k] >= tmax))
+            continue;
+        tmax = ts[k];
+        index = std::size_t(indices[k]);
+        found = true;
+    }
+    return found;
+}
+
+// Same as `nearest_hit`, but only tells whether any primitive is hit.
+template <typename Hit>
+bool any_hit(std::size_t begin, std::size_t end, double tmax, Hit&& hit)
+{
+    using simd::Lanes;
+    Lanes zero(0.);
+    Lanes last = Lanes(double(end));
+    Lanes far(tmax);
+    for (std::size_t i = begin; i < end; i += Lanes::size) {
+        Lanes lane = Lanes::iota() + Lanes(double(i));
+        Lanes t = hit(i);
+        if (simd::any((t > zero) & (t < far) & (lane < last)))
+            return true;
+    }
+    return false;
+}
+
+} // namespace internal
+
+// Spheres stored as a structure of arrays, so that a ray is tested against
+// as many of them at once as the target has SIMD lanes (see `simd::Lanes`).
+// Spheres are indexed in the order they were added. Only the geometry is
+// stored: callers map indices back to their shapes.
+template <typename T>
+class SphereBatch {
+public:
+    std::size_t size() const
+    {
+        return m_columns.size();
+    }
+
+    void clear()
+    {
+        m_columns.clear();
+    }
+
+    void push_back(const Sphere<T>& sphere)
+    {
+        const Vector<T, 3>& c = sphere.center();
+        double r = sphere.radius();
+        // Padding lanes hold spheres which no ray hits
+        m_columns.push_back({real(c[0]), real(c[1]), real(c[2]), r*r},
+                            {0, 0, 0, -1});
+    }
+
+    // Finds the nearest of spheres `[begin, end)` hit by the ray within
+    // `(0, tmax)`, as `Sphere::intersect` would. On a hit, shortens `tmax`
+    // and sets `index` to the sphere.
+    bool intersect(const Vector<double, 3>& orig,
+                   const Vector<double, 3>& dir,
+                   std::size_t begin,
+                   std::size_t end,
+                   double& tmax,
+                   std::size_t& index) const
+    {
+        return internal::nearest_hit(begin, end, tmax, index, hit(orig, dir));
+    }
+
+    // Tells whether any of spheres `[begin, end)` is hit within `(0, tmax)`.
+    bool occluded(const Vector<double, 3>& orig,
+                  const Vector<double, 3>& dir,
+                  std::size_t begin,
+                  std::size_t end,
+                  double tmax) const
+    {
+        return internal::any_hit(begin, end, tmax, hit(orig, dir));
+    }
+
+private:
+    auto hit(const Vector<double, 3>& orig, const Vector<double, 3>& dir) const
+    {
+        using internal::simd::Lanes;
+        double a = dot(dir, dir);
+        return [=](std::size_t i) {
+            Lanes zero(0.);
+            Lanes ox = Lanes(orig[0]) - m_columns.load(0, i);
+            Lanes oy = Lanes(orig[1]) - m_columns.load(1, i);
+            Lanes oz = Lanes(orig[2]) - m_columns.load(2, i);
+            Lanes b = Lanes(2.)
+                * (ox*Lanes(dir[0]) + oy*Lanes(dir[1]) + oz*Lanes(dir[2]));
+            Lanes c = ox*ox + oy*oy + oz*oz - m_columns.load(3, i);
+            // Misses have a negative discriminant, whose root is NaN
+            Lanes root = sqrt(b*b - Lanes(4 * a)*c);
+            Lanes t1 = (zero - b - root) / Lanes(2 * a);
+            Lanes t2 = (zero - b + root) / Lanes(2 * a);
+            return select(t1 > zero, t1, t2);
+        };
+    }
+
+    internal::Columns<4> m_columns;
+};
+
+// Planes stored as a structure of arrays (see `SphereBatch`).
+template <typename T>
+class PlaneBatch {
+public:
+    std::size_t size() const
+    {
+        return m_columns.size();
+    }
+
+    void clear()
+    {
+        m_columns.clear();
+    }
+
+    void push_back(const Plane<T>& plane)
+    {
+        const Vector<T, 3>& n = plane.normal();
+        // Padding lanes hold degenerate planes, whose distance is NaN
+        m_columns.push_back(
+            {real(n[0]), real(n[1]), real(n[2]), plane.offset()},
+            {0, 0, 0, 0});
+    }
+
+    // Same as `SphereBatch::intersect`.
+    bool intersect(const Vector<double, 3>& orig,
+                   const Vector<double, 3>& dir,
+                   std::size_t begin,
+                   std::size_t end,
+                   double& tmax,
+                   std::size_t& index) const
+    {
+        return internal::nearest_hit(begin, end, tmax, index, hit(orig, dir));
+    }
+
+    // Same as `SphereBatch::occluded`.
+    bool occluded(const Vector<double, 3>& orig,
+                  const Vector<double, 3>& dir,
+                  std::size_t begin,
+                  std::size_t end,
+                  double tmax) const
+    {
+        return internal::any_hit(begin, end, tmax, hit(orig, dir));
+    }
+
+private:
+    auto hit(const Vector<double, 3>& orig, const Vector<double, 3>& dir) const
+    {
+        using internal::simd::Lanes;
+        return [=](std::size_t i) {
+            Lanes nx = m_columns.load(0, i);
+            Lanes ny = m_columns.load(1, i);
+            Lanes nz = m_columns.load(2, i);
+            Lanes h = Lanes(orig[0])*nx + Lanes(orig[1])*ny
+                + Lanes(orig[2])*nz - m_columns.load(3, i);
+            Lanes cos = Lanes(dir[0])*nx + Lanes(dir[1])*ny + Lanes(dir[2])*nz;
+            return h / (Lanes(0.) - cos);
+        };
+    }
+
+    internal::Columns<4> m_columns;
+};
+
+} // namespace drt
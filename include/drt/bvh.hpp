@@ -0,0 +1,460 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "vector.hpp"
+
+namespace drt {
+
+// Axis-aligned bounding box. Default-constructed bounds are empty.
+struct Bounds {
+    Bounds()
+      : lo(std::numeric_limits<double>::infinity())
+      , hi(-std::numeric_limits<double>::infinity())
+    { }
+
+    Bounds(const Vector<double, 3>& lo, const Vector<double, 3>& hi)
+      : lo(lo), hi(hi)
+    { }
+
+    static Bounds infinite()
+    {
+        double inf = std::numeric_limits<double>::infinity();
+        return Bounds(Vector<double, 3>(-inf), Vector<double, 3>(inf));
+    }
+
+    bool empty() const
+    {
+        return lo[0] > hi[0] || lo[1] > hi[1] || lo[2] > hi[2];
+    }
+
+    bool finite() const
+    {
+        for (std::size_t i = 0; i < 3; ++i)
+            if (!std::isfinite(lo[i]) || !std::isfinite(hi[i]))
+                return false;
+        return true;
+    }
+
+    Vector<double, 3> centroid() const
+    {
+        return 0.5 * (lo + hi);
+    }
+
+    double area() const
+    {
+        if (empty())
+            return 0;
+        Vector<double, 3> d = hi - lo;
+        return 2 * (d[0]*d[1] + d[1]*d[2] + d[2]*d[0]);
+    }
+
+    void extend(const Vector<double, 3>& p)
+    {
+        for (std::size_t i = 0; i < 3; ++i) {
+            lo[i] = std::min(lo[i], p[i]);
+            hi[i] = std::max(hi[i], p[i]);
+        }
+    }
+
+    void extend(const Bounds& b)
+    {
+        for (std::size_t i = 0; i < 3; ++i) {
+            lo[i] = std::min(lo[i], b.lo[i]);
+            hi[i] = std::max(hi[i], b.hi[i]);
+        }
+    }
+
+    Vector<double, 3> lo;
+    Vector<double, 3> hi;
+};
+
+// Bounding volume hierarchy over an indexed set of primitives, built with
+// the binned surface area heuristic. Nodes are stored depth-first in a
+// single array: the left child of an interior node immediately follows it,
+// so only the index of the right child is stored. Node bounds are kept in
+// single precision (rounded outwards) to fit two nodes per cache line.
+// Hierarchies can also be used in place from arrays built beforehand (e.g.
+// stored in a file).
+class BVH {
+public:
+    struct alignas(32) Node {
+        float lo[3];
+        float hi[3];
+        // First primitive of a leaf, or right child of an interior node
+        std::uint32_t offset;
+        // Number of primitives (zero for interior nodes)
+        std::uint16_t count;
+        std::uint16_t axis;
+    };
+
+    static_assert(sizeof(Node) == 32, "unexpected BVH node size");
+
+    BVH() = default;
+
+    explicit BVH(const std::vector<Bounds>& bounds)
+    {
+        build(bounds);
+    }
+
+    // Hierarchy of `num_nodes` nodes over `size` primitives, as given by
+    // `nodes()` and `indices()` of a built one, used in place: the arrays
+    // must outlive the BVH and its copies.
+    BVH(const Node *nodes,
+        std::size_t num_nodes,
+        const std::uint32_t *indices,
+        std::size_t size)
+      : m_view_nodes(nodes)
+      , m_view_indices(indices)
+      , m_num_nodes(num_nodes)
+      , m_size(size)
+    { }
+
+    // Builds the hierarchy over primitives `0, ..., bounds.size() - 1`.
+    void build(const std::vector<Bounds>& bounds)
+    {
+        m_view_nodes = nullptr;
+        m_view_indices = nullptr;
+        m_nodes.clear();
+        m_num_nodes = 0;
+        m_size = bounds.size();
+        m_indices.resize(bounds.size());
+        for (std::size_t i = 0; i < bounds.size(); ++i)
+            m_indices[i] = std::uint32_t(i);
+        if (bounds.empty())
+            return;
+        std::vector<Vector<double, 3>> centroids;
+        centroids.reserve(bounds.size());
+        for (const auto& b : bounds)
+            centroids.push_back(b.centroid());
+        m_nodes.reserve(2 * bounds.size());
+        build(bounds, centroids, 0, bounds.size());
+        m_num_nodes = m_nodes.size();
+    }
+
+    bool empty() const
+    {
+        return m_num_nodes == 0;
+    }
+
+    std::size_t num_nodes() const
+    {
+        return m_num_nodes;
+    }
+
+    const Node *nodes() const
+    {
+        return m_view_nodes ? m_view_nodes : m_nodes.data();
+    }
+
+    // Number of primitives
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+    // Primitive indices in leaf order
+    const std::uint32_t *indices() const
+    {
+        return m_view_indices ? m_view_indices : m_indices.data();
+    }
+
+    // Visits the primitives whose bounds are hit by the ray within
+    // `(0, tmax)`, nearest nodes first. `intersect(index, tmax)` must return
+    // true and shorten `tmax` when the primitive is hit closer than `tmax`.
+    template <typename Intersect>
+    bool traverse(const Vector<double, 3>& orig,
+                  const Vector<double, 3>& dir,
+                  double& tmax,
+                  Intersect&& intersect) const
+    {
+        return visit<false>(orig, dir, tmax,
+            [&, indices = indices()](std::size_t first, std::size_t count,
+                                     double& t) {
+                bool hit = false;
+                for (std::size_t i = first; i < first + count; ++i)
+                    hit |= intersect(indices[i], t);
+                return hit;
+            });
+    }
+
+    // Same as `traverse`, but stops at the first primitive for which
+    // `occluded(index)` returns true, i.e. which is hit within `(0, tmax)`.
+    template <typename Occluded>
+    bool occluded(const Vector<double, 3>& orig,
+                  const Vector<double, 3>& dir,
+                  double tmax,
+                  Occluded&& occluded) const
+    {
+        return occluded_leaves(orig, dir, tmax,
+            [&, indices = indices()](std::size_t first, std::size_t count) {
+                for (std::size_t i = first; i < first + count; ++i)
+                    if (occluded(indices[i]))
+                        return true;
+                return false;
+            });
+    }
+
+    // Same as `traverse`, but visits whole leaves, for primitives stored in
+    // leaf order: `intersect(first, count, tmax)` tests the primitives at
+    // positions `[first, first + count)` of `indices()`.
+    template <typename Intersect>
+    bool traverse_leaves(const Vector<double, 3>& orig,
+                         const Vector<double, 3>& dir,
+                         double& tmax,
+                         Intersect&& intersect) const
+    {
+        return visit<false>(orig, dir, tmax, intersect);
+    }
+
+    // Same as `occluded`, but visits whole leaves (see `traverse_leaves`).
+    template <typename Occluded>
+    bool occluded_leaves(const Vector<double, 3>& orig,
+                         const Vector<double, 3>& dir,
+                         double tmax,
+                         Occluded&& occluded) const
+    {
+        return visit<true>(orig, dir, tmax,
+            [&](std::size_t first, std::size_t count, double&) {
+                return occluded(first, count);
+            });
+    }
+
+private:
+    static constexpr std::size_t bins = 16;
+    static constexpr std::size_t max_leaf = 4;
+    static constexpr std::size_t max_depth = 64;
+    // Cost of visiting a node, relative to intersecting a primitive
+    static constexpr double traversal_cost = 0.125;
+
+    // Calls `leaf(first, count, tmax)` on the leaves hit by the ray.
+    template <bool any_hit, typename Leaf>
+    bool visit(const Vector<double, 3>& orig,
+               const Vector<double, 3>& dir,
+               double& tmax,
+               Leaf&& leaf) const
+    {
+        if (m_num_nodes == 0)
+            return false;
+        const Node *nodes = this->nodes();
+        float o[3], inv_dir[3];
+        bool neg[3];
+        for (std::size_t i = 0; i < 3; ++i) {
+            o[i] = float(orig[i]);
+            inv_dir[i] = float(1 / dir[i]);
+            neg[i] = std::signbit(inv_dir[i]);
+        }
+        std::array<std::uint32_t, max_depth> stack;
+        std::size_t top = 0;
+        std::uint32_t index = 0;
+        bool hit = false;
+        for (;;) {
+            const Node& node = nodes[index];
+            if (slabs(node, o, inv_dir, neg, tmax)) {
+                if (node.count > 0) {
+                    if (leaf(node.offset, node.count, tmax)) {
+                        hit = true;
+                        if constexpr (any_hit)
+                            return true;
+                    }
+                } else if (neg[node.axis]) {
+                    stack[top++] = index + 1;
+                    index = node.offset;
+                    continue;
+                } else {
+                    stack[top++] = node.offset;
+                    index = index + 1;
+                    continue;
+                }
+            }
+            if (top == 0)
+                break;
+            index = stack[--top];
+        }
+        return hit;
+    }
+
+    static bool slabs(const Node& node,
+                      const float *o,
+                      const float *inv_dir,
+                      const bool *neg,
+                      double tmax)
+    {
+        // Slightly enlarge the far distance to compensate for rounding
+        // errors in the slab computations. Picking the near and far planes
+        // by the sign of the direction (rather than by comparing distances)
+        // makes NaNs, from rays lying in a slab plane, leave the bounds as
+        // they are.
+        constexpr float eps = 1 + 6 * std::numeric_limits<float>::epsilon();
+        float t0 = 0;
+        float t1 = float(tmax);
+        for (std::size_t i = 0; i < 3; ++i) {
+            float lo = neg[i] ? node.hi[i] : node.lo[i];
+            float hi = neg[i] ? node.lo[i] : node.hi[i];
+            float near = (lo - o[i]) * inv_dir[i];
+            float far = (hi - o[i]) * inv_dir[i];
+            far *= eps;
+            t0 = near > t0 ? near : t0;
+            t1 = far < t1 ? far : t1;
+            if (t0 > t1)
+                return false;
+        }
+        return true;
+    }
+
+    void build(const std::vector<Bounds>& bounds,
+               const std::vector<Vector<double, 3>>& centroids,
+               std::size_t begin,
+               std::size_t end,
+               std::size_t depth = 0)
+    {
+        std::size_t index = m_nodes.size();
+        m_nodes.emplace_back();
+        Bounds box, centroid_box;
+        for (std::size_t i = begin; i < end; ++i) {
+            box.extend(bounds[m_indices[i]]);
+            centroid_box.extend(centroids[m_indices[i]]);
+        }
+        for (std::size_t i = 0; i < 3; ++i) {
+            m_nodes[index].lo[i] = round_down(box.lo[i]);
+            m_nodes[index].hi[i] = round_up(box.hi[i]);
+        }
+
+        std::size_t count = end - begin;
+        std::size_t axis = 0;
+        Vector<double, 3> extent = centroid_box.hi - centroid_box.lo;
+        for (std::size_t i = 1; i < 3; ++i)
+            if (extent[i] > extent[axis])
+                axis = i;
+
+        // Deep down the tree (which only happens for very unbalanced SAH
+        // splits) fall back to median splits, which bound the depth
+        std::size_t mid = begin;
+        if (extent[axis] > 0 && depth < max_depth / 2)
+            mid = split_sah(bounds, centroids, begin, end, axis, centroid_box,
+                            box.area());
+        if (mid == begin && count > max_leaf) {
+            // Splitting does not pay off but the leaf would be too large;
+            // split at the median instead
+            mid = begin + count / 2;
+            std::nth_element(
+                m_indices.begin() + begin,
+                m_indices.begin() + mid,
+                m_indices.begin() + end,
+                [&](std::uint32_t a, std::uint32_t b) {
+                    return centroids[a][axis] < centroids[b][axis];
+                });
+        }
+        if (mid == begin || count <= 1) {
+            make_leaf(index, begin, count);
+            return;
+        }
+
+        m_nodes[index].axis = std::uint16_t(axis);
+        m_nodes[index].count = 0;
+        build(bounds, centroids, begin, mid, depth + 1);
+        m_nodes[index].offset = std::uint32_t(m_nodes.size());
+        build(bounds, centroids, mid, end, depth + 1);
+    }
+
+    // Partitions the primitives along the plane of lowest SAH cost, and
+    // returns the first primitive of the right side. Returns `begin` if a
+    // leaf is cheaper than any split.
+    std::size_t split_sah(const std::vector<Bounds>& bounds,
+                          const std::vector<Vector<double, 3>>& centroids,
+                          std::size_t begin,
+                          std::size_t end,
+                          std::size_t axis,
+                          const Bounds& centroid_box,
+                          double area)
+    {
+        double lo = centroid_box.lo[axis];
+        double scale = bins / (centroid_box.hi[axis] - lo);
+        auto bin_of = [&](std::uint32_t prim) {
+            auto b = std::size_t((centroids[prim][axis] - lo) * scale);
+            return std::min(b, bins - 1);
+        };
+
+        std::array<Bounds, bins> bin_bounds;
+        std::array<std::size_t, bins> bin_counts {};
+        for (std::size_t i = begin; i < end; ++i) {
+            std::size_t b = bin_of(m_indices[i]);
+            bin_bounds[b].extend(bounds[m_indices[i]]);
+            ++bin_counts[b];
+        }
+
+        // Sweep from the right to get the area and count of every right
+        // side, then from the left to evaluate the cost of each split
+        std::array<double, bins> right_area;
+        std::array<std::size_t, bins> right_count;
+        Bounds acc;
+        std::size_t n = 0;
+        for (std::size_t b = bins; b-- > 1; ) {
+            acc.extend(bin_bounds[b]);
+            n += bin_counts[b];
+            right_area[b] = acc.area();
+            right_count[b] = n;
+        }
+        std::size_t count = end - begin;
+        double best_cost = count;
+        std::size_t best_split = 0;
+        acc = Bounds();
+        n = 0;
+        for (std::size_t b = 1; b < bins; ++b) {
+            acc.extend(bin_bounds[b - 1]);
+            n += bin_counts[b - 1];
+            if (n == 0 || right_count[b] == 0)
+                continue;
+            double cost = traversal_cost
+                + (n * acc.area() + right_count[b] * right_area[b]) / area;
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_split = b;
+            }
+        }
+        if (best_split == 0)
+            return begin;
+
+        auto it = std::partition(
+            m_indices.begin() + begin,
+            m_indices.begin() + end,
+            [&](std::uint32_t prim) { return bin_of(prim) < best_split; });
+        return it - m_indices.begin();
+    }
+
+    void make_leaf(std::size_t index, std::size_t begin, std::size_t count)
+    {
+        m_nodes[index].offset = std::uint32_t(begin);
+        m_nodes[index].count = std::uint16_t(count);
+        m_nodes[index].axis = 0;
+    }
+
+    static float round_down(double x)
+    {
+        float f = float(x);
+        float inf = std::numeric_limits<float>::infinity();
+        return f > x ? std::nextafter(f, -inf) : f;
+    }
+
+    static float round_up(double x)
+    {
+        float f = float(x);
+        float inf = std::numeric_limits<float>::infinity();
+        return f < x ? std::nextafter(f, inf) : f;
+    }
+
+    // Built hierarchy, unless used in place from the `m_view_` arrays
+    std::vector<Node> m_nodes;
+    std::vector<std::uint32_t> m_indices;
+    const Node *m_view_nodes = nullptr;
+    const std::uint32_t *m_view_indices = nullptr;
+    std::size_t m_num_nodes = 0;
+    std::size_t m_size = 0;
+};
+
+} // namespace drt
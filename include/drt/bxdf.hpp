@@ -1,9 +1,12 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <cmath>
 #include <memory>
 #include <tuple>
 #include "constants.hpp"
+#include "dual.hpp"
 #include "random.hpp"
 #include "vector.hpp"
 
@@ -21,7 +24,20 @@ public:
 
     virtual std::tuple<Vector<T, 3>, double> sample(
         const Vector<T, 3>& normal,
-        const Vector<T, 3>& dir_in) const = 0;
+        const Vector<T, 3>& dir_in,
+        Sampler& sampler) const = 0;
+
+    // Pdf (w.r.t. solid angle) of `sample` returning `dir_out`
+    virtual double pdf(
+        const Vector<T, 3>& normal,
+        const Vector<T, 3>& dir_in,
+        const Vector<T, 3>& dir_out) const = 0;
+
+    // BxDFs which only scatter in discrete directions (e.g. mirrors) cannot
+    // be evaluated for arbitrary directions, so lights are not sampled for
+    // them.
+    virtual bool delta() const
+    { return false; }
 };
 
 namespace internal {
@@ -32,7 +48,8 @@ inline std::array<Vector<T, 3>, 3> make_frame(const Vector<T, 3>& normal)
     Vector<T, 3> e1 {1., 0., 0.};
     Vector<T, 3> e2 {0., 1., 0.};
     Vector<T, 3> tangent;
-    if (std::abs(dot(e1, normal)) < std::abs(dot(e2, normal)))
+    using std::abs;
+    if (abs(dot(e1, normal)) < abs(dot(e2, normal)))
         tangent = normalize(e1 - normal*dot(e1, normal));
     else
         tangent = normalize(e2 - normal*dot(e2, normal));
@@ -45,9 +62,9 @@ inline Vector<T, 3> angle_to_dir(
     double theta, double phi,
     const std::array<Vector<T, 3>, 3>& frame)
 {
-    double x = cos(phi) * sin(theta);
-    double y = sin(phi) * sin(theta);
-    double z = cos(theta);
+    double x = std::cos(phi) * std::sin(theta);
+    double y = std::sin(phi) * std::sin(theta);
+    double z = std::cos(theta);
     return x*frame[0] + y*frame[1] + z*frame[2];
 }
 
@@ -68,16 +85,23 @@ public:
 
     std::tuple<Vector<T, 3>, double> sample(
         const Vector<T, 3>& normal,
-        const Vector<T, 3>& dir_in) const override
+        const Vector<T, 3>& dir_in,
+        Sampler& sampler) const override
     {
-        double theta = asin(sqrt(random::uniform()));
-        double phi = 2 * pi * random::uniform();
+        double theta = std::asin(std::sqrt(sampler.uniform()));
+        double phi = 2 * pi * sampler.uniform();
         auto frame = internal::make_frame(normal);
         auto dir = internal::angle_to_dir(theta, phi, frame);
-        double pdf = cos(theta) / pi;
+        double pdf = std::cos(theta) / pi;
         return std::make_tuple(dir, pdf);
     }
 
+    double pdf(
+        const Vector<T, 3>& normal,
+        const Vector<T, 3>& dir_in,
+        const Vector<T, 3>& dir_out) const override
+    { return std::max(0., real(dot(normal, dir_out))) / pi; }
+
 private:
     Vector<T, 3, true> m_color;
 };
@@ -90,34 +114,57 @@ public:
       , m_exponent(exponent)
     { }
 
+    // Normalized Blinn-Phong distribution of half vectors, with the Jacobian
+    // of the reflection so that both the value and the pdf are expressed
+    // w.r.t. the solid angle of `dir_out`.
     Vector<T, 3, true> operator()(
         const Vector<T, 3>& normal,
         const Vector<T, 3>& dir_in,
         const Vector<T, 3>& dir_out) const override
     {
+        using std::abs;
+        using std::pow;
+        if (dot(normal, dir_out) <= 0)
+            return Vector<T, 3>(0);
         Vector<T, 3> halfway = normalize(dir_in + dir_out);
-        double cos_theta = dot(normal, halfway);
-        double sin_theta = sqrt(1 - cos_theta*cos_theta);
-        double factor = (m_exponent + 2) / (2 * pi)
-            * pow(cos_theta, m_exponent) * sin_theta;
+        T cos_theta = dot(normal, halfway);
+        if (cos_theta <= 0)
+            return Vector<T, 3>(0);
+        T factor = (m_exponent + 2) / (8 * pi)
+            * pow(cos_theta, m_exponent) / abs(dot(dir_in, halfway));
         return factor * m_color;
     }
 
     std::tuple<Vector<T, 3>, double> sample(
         const Vector<T, 3>& normal,
-        const Vector<T, 3>& dir_in) const override
+        const Vector<T, 3>& dir_in,
+        Sampler& sampler) const override
     {
-        double theta = acos(sqrt(pow(random::uniform(), 2/(m_exponent+2))));
-        double phi = 2 * pi * random::uniform();
+        double theta = std::acos(
+            std::sqrt(std::pow(sampler.uniform(), 2/(m_exponent+2))));
+        double phi = 2 * pi * sampler.uniform();
         auto frame = internal::make_frame(normal);
         auto halfway = internal::angle_to_dir(theta, phi, frame);
-        if (dot(halfway, dir_in) < 0)
-            halfway = reflect(halfway, normal);
         auto dir = reflect(dir_in, halfway);
-        double pdf = (m_exponent + 2) / (2 * pi) *
-            pow(cos(theta), m_exponent+1) * sin(theta);
+        double pdf = (m_exponent + 2) / (8 * pi)
+            * std::pow(std::cos(theta), m_exponent+1)
+            / std::abs(real(dot(dir_in, halfway)));
         return std::make_tuple(dir, pdf);
     }
+
+    double pdf(
+        const Vector<T, 3>& normal,
+        const Vector<T, 3>& dir_in,
+        const Vector<T, 3>& dir_out) const override
+    {
+        Vector<T, 3> halfway = normalize(dir_in + dir_out);
+        double cos_theta = real(dot(normal, halfway));
+        if (cos_theta <= 0)
+            return 0;
+        return (m_exponent + 2) / (8 * pi) * std::pow(cos_theta, m_exponent+1)
+            / std::abs(real(dot(dir_in, halfway)));
+    }
+
 private:
     Vector<T, 3, true> m_color;
     double m_exponent;
@@ -131,16 +178,26 @@ public:
         const Vector<T, 3>& dir_in,
         const Vector<T, 3>& dir_out) const override
     {
-        double cos_theta = dot(normal, dir_out);
-        return 1 / cos_theta;
+        T cos_theta = dot(normal, dir_out);
+        return Vector<T, 3>(1 / cos_theta);
     }
 
     std::tuple<Vector<T, 3>, double> sample(
         const Vector<T, 3>& normal,
-        const Vector<T, 3>& dir_in) const override
+        const Vector<T, 3>& dir_in,
+        Sampler& sampler) const override
     {
         return std::make_tuple(reflect(dir_in, normal), 1);
     }
+
+    double pdf(
+        const Vector<T, 3>& normal,
+        const Vector<T, 3>& dir_in,
+        const Vector<T, 3>& dir_out) const override
+    { return 0; }
+
+    bool delta() const override
+    { return true; }
 };
 
 } // namespace drt
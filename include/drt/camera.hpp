@@ -1,12 +1,20 @@
 #pragma once
 
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include <tuple>
 #include "random.hpp"
 #include "vector.hpp"
 
 namespace drt {
 
+// Sample `index` of pixel `pixel`, with pixels numbered row by row
+struct PixelSample {
+    std::uint32_t pixel;
+    std::uint32_t index;
+};
+
 template <typename T>
 class Camera {
 public:
@@ -48,13 +56,15 @@ public:
     double aspect() const
     { return double(m_width) / m_height; }
 
-    std::tuple<Vector<T, 3>, double> sample(std::size_t x, std::size_t y) const
+    std::tuple<Vector<T, 3>, double> sample(std::size_t x,
+                                            std::size_t y,
+                                            Sampler& sampler) const
     {
-        double s = (x + random::uniform()) / m_width;
-        double t = (y + random::uniform()) / m_height;
+        double s = (x + sampler.uniform()) / m_width;
+        double t = (y + sampler.uniform()) / m_height;
         Vector<T, 3> dir = m_forward;
-        dir += (2.*s - 1.) * aspect() * tan(m_vfov / 2.) * m_right;
-        dir += (2.*t - 1.) * tan(m_vfov / 2.) * -m_up;
+        dir += (2.*s - 1.) * aspect() * std::tan(m_vfov / 2.) * m_right;
+        dir += (2.*t - 1.) * std::tan(m_vfov / 2.) * -m_up;
         dir = normalize(dir);
         return std::make_tuple(dir, 1);
     }
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "vector.hpp"
+
+namespace drt {
+
+namespace internal {
+
+// Shared read-write memory mapping, of anonymous memory or of a file.
+class WritableMapping {
+public:
+    // Mapping of `size` bytes of zeros, backed by no file, which is shared
+    // with the processes forked afterwards.
+    explicit WritableMapping(std::size_t size)
+      : m_size(size)
+    {
+        m_data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (m_data == MAP_FAILED)
+            throw std::runtime_error("cannot map shared memory");
+    }
+
+    // Mapping of a whole file of `size` bytes. Missing (or empty) files are
+    // created filled with zeros, while files of another size are rejected.
+    WritableMapping(const std::string& path, std::size_t size)
+      : m_size(size)
+    {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+            throw std::runtime_error("cannot open " + path);
+        struct stat st;
+        if (::fstat(fd, &st) < 0) {
+            ::close(fd);
+            throw std::runtime_error("cannot stat " + path);
+        }
+        if (st.st_size != 0 && std::size_t(st.st_size) != size) {
+            ::close(fd);
+            throw std::runtime_error(path + " has an unexpected size");
+        }
+        if (st.st_size == 0 && ::ftruncate(fd, size) < 0) {
+            ::close(fd);
+            throw std::runtime_error("cannot resize " + path);
+        }
+        m_data = ::mmap(
+            nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (m_data == MAP_FAILED)
+            throw std::runtime_error("cannot map " + path);
+    }
+
+    WritableMapping(const WritableMapping&) = delete;
+
+    WritableMapping& operator=(const WritableMapping&) = delete;
+
+    ~WritableMapping()
+    {
+        if (m_data != MAP_FAILED)
+            ::munmap(m_data, m_size);
+    }
+
+    unsigned char *data() const
+    {
+        return static_cast<unsigned char*>(m_data);
+    }
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+    // Blocks until the mapping is written to the file.
+    void sync() const
+    {
+        if (::msync(m_data, m_size, MS_SYNC) < 0)
+            throw std::runtime_error("cannot write mapped file");
+    }
+
+private:
+    void *m_data = MAP_FAILED;
+    std::size_t m_size;
+};
+
+struct CheckpointHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t value_size;
+    std::uint64_t num_pixels;
+    std::uint64_t key;
+    // Slot holding the last complete snapshot, or `checkpoint_empty`
+    std::uint64_t current;
+};
+
+constexpr char checkpoint_magic[8] = {'D', 'R', 'T', 'C', 'K', 'P', 'T', '\0'};
+constexpr std::uint32_t checkpoint_version = 1;
+constexpr std::uint64_t checkpoint_empty = ~std::uint64_t(0);
+constexpr std::size_t checkpoint_align = 4096;
+
+inline std::size_t align_checkpoint_offset(std::size_t offset)
+{
+    return (offset + checkpoint_align - 1) & ~(checkpoint_align - 1);
+}
+
+} // namespace internal
+
+// Snapshots of the accumulation buffers of a progressive render (the sum of
+// the sample estimates and the number of samples of every pixel), kept in a
+// memory-mapped file so that the render can be resumed, and extended to
+// more samples, after it stopped or was killed. The file holds two slots,
+// written alternately, and a header pointing to the last complete one: a
+// render killed while saving keeps its previous snapshot.
+//
+// Sums are stored as they are in memory (`Vector<T, 3>`, derivatives
+// included), so checkpoints are only meant to be resumed by the same
+// program. `key` identifies the render (e.g. a hash of its settings), and
+// files written with another key, or for another image size, are rejected.
+template <typename T>
+class Checkpoint {
+    static_assert(std::is_trivially_copyable_v<Vector<T, 3>>);
+
+public:
+    Checkpoint(const std::string& path,
+               std::size_t num_pixels,
+               std::uint64_t key)
+      : m_num_pixels(num_pixels)
+      , m_samples_offset(internal::align_checkpoint_offset(
+            num_pixels * sizeof(Vector<T, 3>)))
+      , m_slot_size(internal::align_checkpoint_offset(
+            m_samples_offset + num_pixels * sizeof(std::uint32_t)))
+      , m_file(path, internal::checkpoint_align + 2*m_slot_size)
+    {
+        internal::CheckpointHeader header;
+        std::memcpy(&header, m_file.data(), sizeof(header));
+        if (header.magic[0] == '\0') {
+            // New file
+            std::memcpy(header.magic, internal::checkpoint_magic,
+                        sizeof(header.magic));
+            header.version = internal::checkpoint_version;
+            header.value_size = sizeof(Vector<T, 3>);
+            header.num_pixels = num_pixels;
+            header.key = key;
+            header.current = internal::checkpoint_empty;
+            std::memcpy(m_file.data(), &header, sizeof(header));
+        } else if (std::memcmp(header.magic, internal::checkpoint_magic,
+                               sizeof(header.magic))
+                   || header.version != internal::checkpoint_version) {
+            throw std::runtime_error(path + " is not a checkpoint file");
+        } else if (header.value_size != sizeof(Vector<T, 3>)
+                   || header.num_pixels != num_pixels
+                   || header.key != key) {
+            throw std::runtime_error(path + " is a checkpoint of another "
+                                     "render");
+        }
+    }
+
+    // Copies the last snapshot to `sums` and `samples`, if there is one.
+    bool load(Vector<T, 3> *sums, std::uint32_t *samples) const
+    {
+        std::uint64_t slot = header().current;
+        if (slot == internal::checkpoint_empty)
+            return false;
+        const unsigned char *data = slot_data(slot);
+        std::memcpy(sums, data, m_num_pixels * sizeof(Vector<T, 3>));
+        std::memcpy(samples, data + m_samples_offset,
+                    m_num_pixels * sizeof(std::uint32_t));
+        return true;
+    }
+
+    // Saves a snapshot, returning once it is on disk.
+    void save(const Vector<T, 3> *sums, const std::uint32_t *samples)
+    {
+        std::uint64_t slot = header().current == 0 ? 1 : 0;
+        unsigned char *data = slot_data(slot);
+        std::memcpy(data, sums, m_num_pixels * sizeof(Vector<T, 3>));
+        std::memcpy(data + m_samples_offset, samples,
+                    m_num_pixels * sizeof(std::uint32_t));
+        m_file.sync();
+        std::memcpy(m_file.data() + offsetof(internal::CheckpointHeader,
+                                             current),
+                    &slot, sizeof(slot));
+        m_file.sync();
+    }
+
+private:
+    internal::CheckpointHeader header() const
+    {
+        internal::CheckpointHeader header;
+        std::memcpy(&header, m_file.data(), sizeof(header));
+        return header;
+    }
+
+    unsigned char *slot_data(std::uint64_t slot) const
+    {
+        return m_file.data() + internal::checkpoint_align + slot*m_slot_size;
+    }
+
+    std::size_t m_num_pixels;
+    std::size_t m_samples_offset;
+    std::size_t m_slot_size;
+    internal::WritableMapping m_file;
+};
+
+} // namespace drt
@@ -1,19 +1,45 @@
 #pragma once
 
+#include <array>
 #include <cmath>
+#include <cstddef>
 #include <iostream>
+#include <string>
 #include <type_traits>
 
 namespace drt {
 
-template <typename T>
+namespace internal {
+
+template <typename T, std::size_t K>
+constexpr std::size_t dual_align =
+    (K & (K - 1)) == 0 && K * sizeof(T) <= 64 ? K * sizeof(T) : alignof(T);
+
+} // namespace internal
+
+// Dual number carrying `K` tangents, i.e. the derivatives along K directions
+// are propagated alongside the real part in a single evaluation. Tangents are
+// stored contiguously (and aligned when K is a power of two) so that loops
+// over them vectorize.
+template <typename T, std::size_t K = 1>
 class Dual {
 public:
     Dual(const T& real = T(), const T& dual = T())
       : m_real(real)
+    {
+        m_dual.fill(dual);
+    }
+
+    Dual(const T& real, const std::array<T, K>& dual)
+      : m_real(real)
       , m_dual(dual)
     { }
 
+    static constexpr std::size_t size()
+    {
+        return K;
+    }
+
     T& real()
     {
         return m_real;
@@ -24,152 +50,351 @@ public:
         return m_real;
     }
 
-    T& dual()
+    T& dual(std::size_t k = 0)
     {
-        return m_dual;
+        return m_dual[k];
     }
 
-    const T& dual() const
+    const T& dual(std::size_t k = 0) const
     {
-        return m_dual;
+        return m_dual[k];
     }
 
     Dual& operator+=(const Dual& rhs)
     {
         m_real += rhs.real();
-        m_dual += rhs.dual();
+        for (std::size_t k = 0; k < K; ++k)
+            m_dual[k] += rhs.m_dual[k];
         return *this;
     }
 
     Dual& operator-=(const Dual& rhs)
     {
         m_real -= rhs.real();
-        m_dual -= rhs.dual();
+        for (std::size_t k = 0; k < K; ++k)
+            m_dual[k] -= rhs.m_dual[k];
         return *this;
     }
 
     Dual& operator*=(const Dual& rhs)
     {
-        T new_real = real() * rhs.real();
-        T new_dual = real()*rhs.dual() + dual()*rhs.real();
-        m_real = new_real;
-        m_dual = new_dual;
+        for (std::size_t k = 0; k < K; ++k)
+            m_dual[k] = real()*rhs.m_dual[k] + m_dual[k]*rhs.real();
+        m_real *= rhs.real();
         return *this;
     }
 
     Dual& operator/=(const Dual& rhs)
     {
-        T new_real = real() / rhs.real();
-        T new_dual = (dual()*rhs.real() - real()*rhs.dual()) / (rhs.real()*rhs.real());
-        m_real = new_real;
-        m_dual = new_dual;
+        T denom = rhs.real() * rhs.real();
+        for (std::size_t k = 0; k < K; ++k)
+            m_dual[k] = (m_dual[k]*rhs.real() - real()*rhs.m_dual[k]) / denom;
+        m_real /= rhs.real();
         return *this;
     }
 
+    // Applies the chain rule for a scalar function with value `value` and
+    // derivative `deriv` at the real part of this number.
+    Dual chain(const T& value, const T& deriv) const
+    {
+        Dual r(value);
+        for (std::size_t k = 0; k < K; ++k)
+            r.m_dual[k] = deriv * m_dual[k];
+        return r;
+    }
+
 private:
     T m_real;
-    T m_dual;
+    alignas(internal::dual_align<T, K>) std::array<T, K> m_dual;
 };
 
-template <typename T>
-inline Dual<T> operator+(Dual<T> lhs, const Dual<T>& rhs)
+template <typename T, std::size_t K>
+inline Dual<T, K> operator-(const Dual<T, K>& n)
+{
+    return n.chain(-n.real(), T(-1));
+}
+
+template <typename T, std::size_t K>
+inline Dual<T, K> operator+(Dual<T, K> lhs, const Dual<T, K>& rhs)
 {
     return lhs += rhs;
 }
 
-template <typename T, typename S,
+template <typename T, std::size_t K, typename S,
           typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
-inline Dual<T> operator+(Dual<T> n, S s)
+inline Dual<T, K> operator+(Dual<T, K> n, S s)
 {
-    return n += Dual<T>(s);
+    return n += Dual<T, K>(s);
 }
 
-template <typename T, typename S,
+template <typename T, std::size_t K, typename S,
           typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
-inline Dual<T> operator+(S s, Dual<T> n)
+inline Dual<T, K> operator+(S s, Dual<T, K> n)
 {
-    return n += Dual<T>(s);
+    return n += Dual<T, K>(s);
 }
 
-template <typename T>
-inline Dual<T> operator-(Dual<T> lhs, const Dual<T>& rhs)
+template <typename T, std::size_t K>
+inline Dual<T, K> operator-(Dual<T, K> lhs, const Dual<T, K>& rhs)
 {
     return lhs -= rhs;
 }
 
-template <typename T, typename S,
+template <typename T, std::size_t K, typename S,
           typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
-inline Dual<T> operator-(Dual<T> n, S s)
+inline Dual<T, K> operator-(Dual<T, K> n, S s)
 {
-    return n -= Dual<T>(s);
+    return n -= Dual<T, K>(s);
 }
 
-template <typename T, typename S,
+template <typename T, std::size_t K, typename S,
           typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
-inline Dual<T> operator-(S s, const Dual<T>& n)
+inline Dual<T, K> operator-(S s, const Dual<T, K>& n)
 {
-    return Dual<T>(s) -= n;
+    return Dual<T, K>(s) -= n;
 }
 
-template <typename T>
-inline Dual<T> operator*(Dual<T> lhs, const Dual<T>& rhs)
+template <typename T, std::size_t K>
+inline Dual<T, K> operator*(Dual<T, K> lhs, const Dual<T, K>& rhs)
 {
     return lhs *= rhs;
 }
 
-template <typename T, typename S,
+template <typename T, std::size_t K, typename S,
           typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
-inline Dual<T> operator*(Dual<T> n, S s)
+inline Dual<T, K> operator*(Dual<T, K> n, S s)
 {
-    return n *= Dual<T>(s);
+    return n *= Dual<T, K>(s);
 }
 
-template <typename T, typename S,
+template <typename T, std::size_t K, typename S,
           typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
-inline Dual<T> operator*(S s, Dual<T> n)
+inline Dual<T, K> operator*(S s, Dual<T, K> n)
 {
-    return n *= Dual<T>(s);
+    return n *= Dual<T, K>(s);
 }
 
-template <typename T>
-inline Dual<T> operator/(Dual<T> lhs, const Dual<T>& rhs)
+template <typename T, std::size_t K>
+inline Dual<T, K> operator/(Dual<T, K> lhs, const Dual<T, K>& rhs)
 {
     return lhs /= rhs;
 }
 
-template <typename T, typename S,
+template <typename T, std::size_t K, typename S,
           typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
-inline Dual<T> operator/(Dual<T> n, S s)
+inline Dual<T, K> operator/(Dual<T, K> n, S s)
 {
-    return n /= Dual<T>(s);
+    return n /= Dual<T, K>(s);
 }
 
-template <typename T, typename S,
+template <typename T, std::size_t K, typename S,
           typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
-inline Dual<T> operator/(S s, const Dual<T>& n)
+inline Dual<T, K> operator/(S s, const Dual<T, K>& n)
 {
-    return Dual<T>(s) /= n;
+    return Dual<T, K>(s) /= n;
 }
 
-template <typename T>
-inline std::ostream& operator<<(std::ostream& os, const Dual<T>& n)
+// Comparisons only consider the real part.
+
+template <typename T, std::size_t K>
+inline bool operator<(const Dual<T, K>& lhs, const Dual<T, K>& rhs)
 {
-    return os << n.real() << "+" << n.dual() << "ε";
+    return lhs.real() < rhs.real();
 }
 
-template <typename T>
-inline T real(const Dual<T>& n)
+template <typename T, std::size_t K>
+inline bool operator>(const Dual<T, K>& lhs, const Dual<T, K>& rhs)
+{
+    return lhs.real() > rhs.real();
+}
+
+template <typename T, std::size_t K>
+inline bool operator<=(const Dual<T, K>& lhs, const Dual<T, K>& rhs)
+{
+    return lhs.real() <= rhs.real();
+}
+
+template <typename T, std::size_t K>
+inline bool operator>=(const Dual<T, K>& lhs, const Dual<T, K>& rhs)
+{
+    return lhs.real() >= rhs.real();
+}
+
+template <typename T, std::size_t K>
+inline bool operator==(const Dual<T, K>& lhs, const Dual<T, K>& rhs)
+{
+    return lhs.real() == rhs.real();
+}
+
+template <typename T, std::size_t K>
+inline bool operator!=(const Dual<T, K>& lhs, const Dual<T, K>& rhs)
+{
+    return lhs.real() != rhs.real();
+}
+
+template <typename T, std::size_t K, typename S,
+          typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
+inline bool operator<(const Dual<T, K>& n, S s)
+{
+    return n.real() < s;
+}
+
+template <typename T, std::size_t K, typename S,
+          typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
+inline bool operator>(const Dual<T, K>& n, S s)
+{
+    return n.real() > s;
+}
+
+template <typename T, std::size_t K, typename S,
+          typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
+inline bool operator<=(const Dual<T, K>& n, S s)
+{
+    return n.real() <= s;
+}
+
+template <typename T, std::size_t K, typename S,
+          typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
+inline bool operator>=(const Dual<T, K>& n, S s)
+{
+    return n.real() >= s;
+}
+
+template <typename T, std::size_t K, typename S,
+          typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
+inline bool operator==(const Dual<T, K>& n, S s)
+{
+    return n.real() == s;
+}
+
+template <typename T, std::size_t K, typename S,
+          typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
+inline bool operator!=(const Dual<T, K>& n, S s)
+{
+    return n.real() != s;
+}
+
+template <typename T, std::size_t K>
+inline std::ostream& operator<<(std::ostream& os, const Dual<T, K>& n)
+{
+    os << n.real();
+    for (std::size_t k = 0; k < K; ++k)
+        os << "+" << n.dual(k) << "ε" << (K > 1 ? std::to_string(k) : "");
+    return os;
+}
+
+inline float real(float x)
+{
+    return x;
+}
+
+inline double real(double x)
+{
+    return x;
+}
+
+template <typename T, std::size_t K>
+inline T real(const Dual<T, K>& n)
 {
     return n.real();
 }
 
+// Number of tangents carried by numbers of type `T` (none for plain ones)
 template <typename T>
-inline Dual<T> sqrt(const Dual<T>& n)
+constexpr std::size_t num_tangents = 0;
+
+template <typename T, std::size_t K>
+constexpr std::size_t num_tangents<Dual<T, K>> = K;
+
+inline double tangent(double, std::size_t)
+{
+    return 0;
+}
+
+template <typename T, std::size_t K>
+inline T tangent(const Dual<T, K>& n, std::size_t k)
+{
+    return n.dual(k);
+}
+
+template <typename T, std::size_t K>
+inline Dual<T, K> sqrt(const Dual<T, K>& n)
 {
     T real = std::sqrt(n.real());
-    T dual = n.dual() / (2*real);
-    return Dual<T>(real, dual);
+    return n.chain(real, 1 / (2*real));
 }
 
-} // namespace drt
+template <typename T, std::size_t K>
+inline Dual<T, K> abs(const Dual<T, K>& n)
+{
+    return n.chain(std::abs(n.real()), n.real() < 0 ? T(-1) : T(1));
+}
+
+template <typename T, std::size_t K>
+inline Dual<T, K> sin(const Dual<T, K>& n)
+{
+    return n.chain(std::sin(n.real()), std::cos(n.real()));
+}
+
+template <typename T, std::size_t K>
+inline Dual<T, K> cos(const Dual<T, K>& n)
+{
+    return n.chain(std::cos(n.real()), -std::sin(n.real()));
+}
+
+template <typename T, std::size_t K>
+inline Dual<T, K> tan(const Dual<T, K>& n)
+{
+    T c = std::cos(n.real());
+    return n.chain(std::tan(n.real()), 1 / (c*c));
+}
+
+template <typename T, std::size_t K>
+inline Dual<T, K> asin(const Dual<T, K>& n)
+{
+    return n.chain(std::asin(n.real()), 1 / std::sqrt(1 - n.real()*n.real()));
+}
 
+template <typename T, std::size_t K>
+inline Dual<T, K> acos(const Dual<T, K>& n)
+{
+    return n.chain(std::acos(n.real()), -1 / std::sqrt(1 - n.real()*n.real()));
+}
+
+template <typename T, std::size_t K>
+inline Dual<T, K> exp(const Dual<T, K>& n)
+{
+    T real = std::exp(n.real());
+    return n.chain(real, real);
+}
+
+template <typename T, std::size_t K>
+inline Dual<T, K> log(const Dual<T, K>& n)
+{
+    return n.chain(std::log(n.real()), 1 / n.real());
+}
+
+template <typename T, std::size_t K, typename S,
+          typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
+inline Dual<T, K> pow(const Dual<T, K>& n, S s)
+{
+    T e = s;
+    return n.chain(std::pow(n.real(), e), e * std::pow(n.real(), e - 1));
+}
+
+template <typename T, std::size_t K, typename S,
+          typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
+inline Dual<T, K> pow(S s, const Dual<T, K>& n)
+{
+    T b = s;
+    T real = std::pow(b, n.real());
+    return n.chain(real, real * std::log(b));
+}
+
+template <typename T, std::size_t K>
+inline Dual<T, K> pow(const Dual<T, K>& base, const Dual<T, K>& e)
+{
+    return exp(e * log(base));
+}
+
+} // namespace drt
@@ -9,7 +9,7 @@ class Emitter {
 public:
     virtual ~Emitter() { }
 
-    virtual Vector<T, 3, true> emission() const = 0;
+    virtual const Vector<T, 3, true>& emission() const = 0;
 };
 
 template <typename T>
@@ -17,7 +17,7 @@ class AreaEmitter : public Emitter<T> {
 public:
     AreaEmitter(Vector<T, 3, true> emission) : m_emission(emission) { }
 
-    Vector<T, 3, true> emission() const override
+    const Vector<T, 3, true>& emission() const override
     { return m_emission; }
 
 private:
@@ -0,0 +1,278 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include "checkpoint.hpp"
+#include "vector.hpp"
+
+namespace drt {
+
+namespace internal {
+
+struct FramebufferInfo {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t value_size;
+    std::uint64_t num_pixels;
+    std::uint64_t key;
+};
+
+constexpr char framebuffer_magic[8] = {'D', 'R', 'T', 'F', 'B', 'U', 'F',
+                                       '\0'};
+constexpr char gradients_magic[8] = {'D', 'R', 'T', 'G', 'R', 'A', 'D',
+                                     '\0'};
+constexpr std::uint32_t framebuffer_version = 2;
+// Offsets of the counters, each on a cache line of its own, of the flags
+// of the shards done, and of the pixel data
+constexpr std::size_t framebuffer_next_offset = 64;
+constexpr std::size_t framebuffer_finished_offset = 128;
+constexpr std::size_t framebuffer_done_offset = 192;
+constexpr std::size_t framebuffer_data_offset = 4096;
+constexpr std::size_t framebuffer_max_shards =
+    (framebuffer_data_offset - framebuffer_done_offset) * 8;
+
+// Flags shard `shard` of `shards` as done in the mapping at `data`. Returns
+// true for the shard whose flag completes the set, which then sees the
+// work of all the others. Files outlive the processes, so shards may run
+// again (e.g. after another crashed): only their first completion is
+// counted, and exactly one shard returns true, once all are done.
+inline bool finish_shard(unsigned char *data,
+                         std::size_t shard,
+                         std::size_t shards)
+{
+    if (shards > framebuffer_max_shards)
+        throw std::runtime_error("too many shards");
+    auto *flags = reinterpret_cast<std::atomic<std::uint64_t>*>(
+        data + framebuffer_done_offset);
+    std::uint64_t bit = std::uint64_t(1) << (shard % 64);
+    if (flags[shard / 64].fetch_or(bit) & bit)
+        return false;
+    auto *finished = reinterpret_cast<std::atomic<std::uint64_t>*>(
+        data + framebuffer_finished_offset);
+    return finished->fetch_add(1) == shards - 1;
+}
+
+} // namespace internal
+
+// Image shared by several rendering processes through a memory mapping:
+// the sum of the sample estimates and the number of samples of every pixel,
+// along with a counter from which processes claim work items (e.g. tiles)
+// and flags of the shards done. Processes only write the pixels of
+// the items they own, so pixels need no synchronization, and the counters
+// are lock-free atomics in the mapping itself.
+//
+// As with `Checkpoint`, sums are stored as they are in memory, and `key`
+// identifies the render (files of other renders are rejected).
+template <typename T>
+class SharedFramebuffer {
+    static_assert(std::is_trivially_copyable_v<Vector<T, 3>>);
+    static_assert(std::atomic<std::uint64_t>::is_always_lock_free
+                  && sizeof(std::atomic<std::uint64_t>)
+                     == sizeof(std::uint64_t));
+
+public:
+    // Framebuffer in the file at `path`, created if missing, for processes
+    // started independently. The first process to open a new file writes
+    // its header: processes opening it at the same time may see it
+    // incomplete and fail, so shards should start after the first one.
+    SharedFramebuffer(const std::string& path,
+                      std::size_t num_pixels,
+                      std::uint64_t key)
+      : m_num_pixels(num_pixels)
+      , m_file(path, size(num_pixels))
+    {
+        internal::FramebufferInfo info = make_info(num_pixels, key);
+        internal::FramebufferInfo current;
+        std::memcpy(&current, m_file.data(), sizeof(current));
+        if (current.magic[0] == '\0')
+            std::memcpy(m_file.data(), &info, sizeof(info));
+        else if (std::memcmp(current.magic, info.magic, sizeof(info.magic))
+                 || current.version != info.version)
+            throw std::runtime_error(path + " is not a framebuffer file");
+        else if (std::memcmp(&current, &info, sizeof(info)))
+            throw std::runtime_error(path + " is a framebuffer of another "
+                                     "render");
+    }
+
+    // Framebuffer in anonymous memory, shared with the processes forked
+    // afterwards.
+    explicit SharedFramebuffer(std::size_t num_pixels)
+      : m_num_pixels(num_pixels)
+      , m_file(size(num_pixels))
+    { }
+
+    std::size_t num_pixels() const
+    {
+        return m_num_pixels;
+    }
+
+    Vector<T, 3> *sums() const
+    {
+        return reinterpret_cast<Vector<T, 3>*>(
+            m_file.data() + internal::framebuffer_data_offset);
+    }
+
+    std::uint32_t *samples() const
+    {
+        return reinterpret_cast<std::uint32_t*>(
+            m_file.data() + internal::framebuffer_data_offset
+            + samples_offset(m_num_pixels));
+    }
+
+    // Claims the next of `count` work items, shared by all processes.
+    // Returns false once all are claimed.
+    bool claim(std::size_t count, std::size_t& item)
+    {
+        item = counter(internal::framebuffer_next_offset).fetch_add(1);
+        return item < count;
+    }
+
+    // Records that shard `shard` of `shards` is done, returning true for
+    // the last one (see `internal::finish_shard`).
+    bool finish(std::size_t shard, std::size_t shards)
+    {
+        return internal::finish_shard(m_file.data(), shard, shards);
+    }
+
+private:
+    static internal::FramebufferInfo make_info(std::size_t num_pixels,
+                                               std::uint64_t key)
+    {
+        internal::FramebufferInfo info {};
+        std::memcpy(info.magic, internal::framebuffer_magic,
+                    sizeof(info.magic));
+        info.version = internal::framebuffer_version;
+        info.value_size = sizeof(Vector<T, 3>);
+        info.num_pixels = num_pixels;
+        info.key = key;
+        return info;
+    }
+
+    static std::size_t samples_offset(std::size_t num_pixels)
+    {
+        return internal::align_checkpoint_offset(
+            num_pixels * sizeof(Vector<T, 3>));
+    }
+
+    static std::size_t size(std::size_t num_pixels)
+    {
+        return internal::framebuffer_data_offset + samples_offset(num_pixels)
+               + num_pixels * sizeof(std::uint32_t);
+    }
+
+    std::atomic<std::uint64_t>& counter(std::size_t offset)
+    {
+        // Lock-free atomics have the layout of the underlying integer,
+        // and work across processes sharing the memory
+        return *reinterpret_cast<std::atomic<std::uint64_t>*>(
+            m_file.data() + offset);
+    }
+
+    std::size_t m_num_pixels;
+    internal::WritableMapping m_file;
+};
+
+// Gradients (flat arrays, see `ParameterSet`) computed by several processes
+// sharing a memory mapping, each in a slice of its own. The last process to
+// finish sums the slices in process order, so that the gradient does not
+// depend on which process finished first. Files are handled as with
+// `SharedFramebuffer`, with `num_pixels` holding the number of processes.
+template <typename T>
+class SharedGradients {
+    static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+    // Gradients of `size` values in the file at `path`, created if
+    // missing, for processes started independently.
+    SharedGradients(const std::string& path,
+                    std::size_t size,
+                    std::size_t processes,
+                    std::uint64_t key)
+      : m_size(size)
+      , m_processes(processes)
+      , m_file(path, file_size(size, processes))
+    {
+        internal::FramebufferInfo info = make_info(processes, key);
+        internal::FramebufferInfo current;
+        std::memcpy(&current, m_file.data(), sizeof(current));
+        if (current.magic[0] == '\0')
+            std::memcpy(m_file.data(), &info, sizeof(info));
+        else if (std::memcmp(current.magic, info.magic, sizeof(info.magic))
+                 || current.version != info.version)
+            throw std::runtime_error(path + " is not a gradient file");
+        else if (std::memcmp(&current, &info, sizeof(info)))
+            throw std::runtime_error(path + " holds the gradients of "
+                                     "another render");
+    }
+
+    // Gradients in anonymous memory, shared with the processes forked
+    // afterwards.
+    SharedGradients(std::size_t size, std::size_t processes)
+      : m_size(size)
+      , m_processes(processes)
+      , m_file(file_size(size, processes))
+    { }
+
+    // Stores the gradient computed by process `process`.
+    void store(std::size_t process, const T *grads)
+    {
+        std::memcpy(slice(process), grads, m_size * sizeof(T));
+    }
+
+    // Records that process `process` is done, returning true for the last
+    // one (see `internal::finish_shard`).
+    bool finish(std::size_t process)
+    {
+        return internal::finish_shard(m_file.data(), process, m_processes);
+    }
+
+    // Stores the sum of the slices of all the processes in `grads`.
+    void sum(T *grads) const
+    {
+        std::fill(grads, grads + m_size, T(0));
+        for (std::size_t i = 0; i < m_processes; ++i) {
+            const T *values = slice(i);
+            for (std::size_t j = 0; j < m_size; ++j)
+                grads[j] += values[j];
+        }
+    }
+
+private:
+    static internal::FramebufferInfo make_info(std::size_t processes,
+                                               std::uint64_t key)
+    {
+        internal::FramebufferInfo info {};
+        std::memcpy(info.magic, internal::gradients_magic,
+                    sizeof(info.magic));
+        info.version = internal::framebuffer_version;
+        info.value_size = sizeof(T);
+        info.num_pixels = processes;
+        info.key = key;
+        return info;
+    }
+
+    static std::size_t file_size(std::size_t size, std::size_t processes)
+    {
+        return internal::framebuffer_data_offset
+               + processes * size * sizeof(T);
+    }
+
+    T *slice(std::size_t process) const
+    {
+        return reinterpret_cast<T*>(
+            m_file.data() + internal::framebuffer_data_offset
+            + process * m_size * sizeof(T));
+    }
+
+    std::size_t m_size;
+    std::size_t m_processes;
+    internal::WritableMapping m_file;
+};
+
+} // namespace drt
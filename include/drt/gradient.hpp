@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace drt {
+
+template <typename T, std::size_t N, bool Autograd>
+class Vector;
+
+namespace internal {
+
+template <typename T, std::size_t N>
+class VariableNode;
+
+} // namespace internal
+
+// Thread-private storage for the gradients of variables. While a buffer is
+// bound to a thread, gradients reaching a variable on that thread are written
+// to the buffer instead of the variable, so several threads may backpropagate
+// into the same variables without synchronization. Once the threads are done,
+// `reduce` adds the buffered gradients to the variables. Reducing a fixed
+// sequence of buffers always yields the same sums, regardless of how the
+// threads were scheduled.
+//
+// In `Mode::atomic` no shadow copy is kept; gradients are instead added to
+// the variables with atomic operations, which is cheaper when contention is
+// low. `reduce` is still required to publish them.
+//
+// The buffer shares ownership of the variables it holds gradients for until
+// `reduce` or `clear`, so variables may be destroyed in between, and only
+// has slots for those variables.
+template <typename T, std::size_t N>
+class GradientBuffer {
+public:
+    enum class Mode { shadow, atomic };
+
+    explicit GradientBuffer(Mode mode = Mode::shadow)
+      : m_mode(mode)
+    { }
+
+    Mode mode() const
+    {
+        return m_mode;
+    }
+
+    static GradientBuffer *current()
+    {
+        return bound();
+    }
+
+    void bind()
+    {
+        bound() = this;
+    }
+
+    static void unbind()
+    {
+        bound() = nullptr;
+    }
+
+    void add(internal::VariableNode<T, N>& var, const Vector<T, N, false>& grad)
+    {
+        auto [it, added] = m_index.try_emplace(var.id(), m_slots.size());
+        if (added)
+            m_slots.push_back({var.shared_from_this(),
+                               Vector<T, N, false>(T(0))});
+        Slot& slot = m_slots[it->second];
+        if (m_mode == Mode::atomic)
+            var.add_atomic(grad);
+        else
+            slot.grad += grad;
+    }
+
+    // Gradient buffered for the variable `id` (see `Vector::id`), or null if
+    // none reached it. Only available in `Mode::shadow`.
+    const Vector<T, N, false> *find(std::size_t id) const
+    {
+        auto it = m_index.find(id);
+        if (m_mode == Mode::atomic || it == m_index.end())
+            return nullptr;
+        return &m_slots[it->second].grad;
+    }
+
+    void reduce()
+    {
+        for (auto& slot : m_slots) {
+            if (m_mode == Mode::atomic)
+                slot.var->flush_atomic();
+            else
+                slot.var->grad() += slot.grad;
+        }
+        clear();
+    }
+
+    void clear()
+    {
+        m_slots.clear();
+        m_index.clear();
+    }
+
+private:
+    struct Slot {
+        std::shared_ptr<internal::VariableNode<T, N>> var;
+        Vector<T, N, false> grad;
+    };
+
+    static GradientBuffer *&bound()
+    {
+        static thread_local GradientBuffer *buffer = nullptr;
+        return buffer;
+    }
+
+    Mode m_mode;
+    // Slots of the variables reached since the last reduction, in the order
+    // they were reached, and their positions by variable id
+    std::vector<Slot> m_slots;
+    std::unordered_map<std::size_t, std::size_t> m_index;
+};
+
+} // namespace drt
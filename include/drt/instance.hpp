@@ -0,0 +1,238 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <memory>
+#include <tuple>
+#include "bvh.hpp"
+#include "dual.hpp"
+#include "shape.hpp"
+#include "vector.hpp"
+
+namespace drt {
+
+// Affine transform `x -> linear * x + translation`, with the linear part
+// stored by rows. Entries may be dual numbers, whose derivatives then flow
+// through everything transformed.
+template <typename T>
+struct Transform {
+    static Transform identity()
+    {
+        return scale(Vector<T, 3>(1));
+    }
+
+    static Transform translate(const Vector<T, 3>& offset)
+    {
+        Transform m = identity();
+        m.translation = offset;
+        return m;
+    }
+
+    static Transform scale(const Vector<T, 3>& factors)
+    {
+        Transform m;
+        for (std::size_t i = 0; i < 3; ++i) {
+            m.rows[i] = Vector<T, 3>(0);
+            m.rows[i][i] = factors[i];
+        }
+        m.translation = Vector<T, 3>(0);
+        return m;
+    }
+
+    // Rotation by `angle` (in radians) around the unit vector `axis`
+    static Transform rotate(const Vector<T, 3>& axis, T angle)
+    {
+        using std::cos;
+        using std::sin;
+        T c = cos(angle);
+        T s = sin(angle);
+        const Vector<T, 3>& a = axis;
+        Transform m;
+        m.rows[0] = Vector<T, 3>{c + a[0]*a[0]*(1 - c),
+                                 a[0]*a[1]*(1 - c) - a[2]*s,
+                                 a[0]*a[2]*(1 - c) + a[1]*s};
+        m.rows[1] = Vector<T, 3>{a[1]*a[0]*(1 - c) + a[2]*s,
+                                 c + a[1]*a[1]*(1 - c),
+                                 a[1]*a[2]*(1 - c) - a[0]*s};
+        m.rows[2] = Vector<T, 3>{a[2]*a[0]*(1 - c) - a[1]*s,
+                                 a[2]*a[1]*(1 - c) + a[0]*s,
+                                 c + a[2]*a[2]*(1 - c)};
+        m.translation = Vector<T, 3>(0);
+        return m;
+    }
+
+    // Applies `rhs` first, then this transform
+    Transform operator*(const Transform& rhs) const
+    {
+        Transform m;
+        for (std::size_t i = 0; i < 3; ++i)
+            m.rows[i] = rhs.rows[0]*rows[i][0] + rhs.rows[1]*rows[i][1]
+                        + rhs.rows[2]*rows[i][2];
+        m.translation = point(rhs.translation);
+        return m;
+    }
+
+    Transform inverse() const
+    {
+        // The columns of the inverse are the cross products of the rows,
+        // divided by the determinant
+        std::array<Vector<T, 3>, 3> cols = {cross(rows[1], rows[2]),
+                                            cross(rows[2], rows[0]),
+                                            cross(rows[0], rows[1])};
+        T det = dot(rows[0], cols[0]);
+        Transform m;
+        for (std::size_t i = 0; i < 3; ++i)
+            m.rows[i] = Vector<T, 3>{cols[0][i], cols[1][i], cols[2][i]} / det;
+        m.translation = -m.vector(translation);
+        return m;
+    }
+
+    Vector<T, 3> point(const Vector<T, 3>& p) const
+    {
+        return vector(p) + translation;
+    }
+
+    Vector<T, 3> vector(const Vector<T, 3>& v) const
+    {
+        return Vector<T, 3>{dot(rows[0], v), dot(rows[1], v), dot(rows[2], v)};
+    }
+
+    // Multiplies `v` by the transpose of the linear part, which maps normals
+    // through the inverse of this transform.
+    Vector<T, 3> transpose(const Vector<T, 3>& v) const
+    {
+        return rows[0]*v[0] + rows[1]*v[1] + rows[2]*v[2];
+    }
+
+    Bounds bounds(const Bounds& b) const
+    {
+        if (!b.finite())
+            return Bounds::infinite();
+        Bounds result;
+        for (std::size_t corner = 0; corner < 8; ++corner) {
+            Vector<double, 3> p;
+            for (std::size_t i = 0; i < 3; ++i) {
+                p[i] = real(translation[i]);
+                for (std::size_t j = 0; j < 3; ++j)
+                    p[i] += real(rows[i][j])
+                            * ((corner >> j) & 1 ? b.hi[j] : b.lo[j]);
+            }
+            result.extend(p);
+        }
+        return result;
+    }
+
+    std::array<Vector<T, 3>, 3> rows;
+    Vector<T, 3> translation;
+};
+
+// Shape placing shared geometry in the scene through an affine transform,
+// so that repeated objects cost a transform each rather than a copy of the
+// geometry. Rays are transformed into object space, without normalizing
+// their direction, so that distances along them are the same in both
+// spaces. Instances take the material of their geometry unless given one
+// of their own.
+//
+// As with other shapes, derivatives w.r.t. the transform follow normals
+// and sampled light points, but not visibility. They are only available in
+// forward mode (with dual entries): like the rest of the geometry, the
+// transform holds no tape variables, so reverse-mode gradients (e.g. of
+// `AdjointRenderer`) cannot reach it. Emitting instances are
+// only sampled as lights when the transform is a similarity (rotation,
+// translation and uniform scaling), which preserves the pdfs of the
+// geometry up to a constant factor.
+template <typename T>
+class Instance : public Shape<T> {
+public:
+    Instance(std::shared_ptr<const Shape<T>> shape,
+             const Transform<T>& transform,
+             std::shared_ptr<BxDF<T>> bxdf = nullptr,
+             std::shared_ptr<Emitter<T>> emitter = nullptr)
+      : Shape<T>(bxdf ? bxdf : shape->shared_bxdf(),
+                 emitter ? emitter : shape->shared_emitter())
+      , m_shape(std::move(shape))
+      , m_transform(transform)
+      , m_inverse(transform.inverse())
+      , m_scale2(similarity_scale2(transform))
+    { }
+
+    const Shape<T>& shape() const
+    { return *m_shape; }
+
+    const Transform<T>& transform() const
+    { return m_transform; }
+
+    bool intersect(Vector<T, 3> orig,
+                   Vector<T, 3> dir,
+                   double& t,
+                   std::size_t& prim) const override
+    {
+        return m_shape->intersect(
+            m_inverse.point(orig), m_inverse.vector(dir), t, prim);
+    }
+
+    bool occluded(Vector<T, 3> orig,
+                  Vector<T, 3> dir,
+                  double tmax) const override
+    {
+        return m_shape->occluded(
+            m_inverse.point(orig), m_inverse.vector(dir), tmax);
+    }
+
+    Vector<T, 3> normal(Vector<T, 3> point, std::size_t prim) const override
+    {
+        Vector<T, 3> n = m_shape->normal(m_inverse.point(point), prim);
+        return normalize(m_inverse.transpose(n));
+    }
+
+    Bounds bounds() const override
+    { return m_transform.bounds(m_shape->bounds()); }
+
+    double area() const override
+    { return m_scale2 > 0 ? m_scale2 * m_shape->area() : inf; }
+
+    std::tuple<Vector<T, 3>, Vector<T, 3>, double> sample_surface(
+        const Vector<T, 3>& ref, Sampler& sampler) const override
+    {
+        if (!(m_scale2 > 0))
+            return Shape<T>::sample_surface(ref, sampler);
+        auto [point, normal, pdf] = m_shape->sample_surface(
+            m_inverse.point(ref), sampler);
+        return std::make_tuple(m_transform.point(point),
+                               normalize(m_inverse.transpose(normal)),
+                               pdf / m_scale2);
+    }
+
+    double pdf_surface(const Vector<T, 3>& ref,
+                       const Vector<T, 3>& point) const override
+    {
+        return m_shape->pdf_surface(
+            m_inverse.point(ref), m_inverse.point(point)) / m_scale2;
+    }
+
+private:
+    // Returns the factor by which a similarity transform scales areas, or
+    // zero if the transform is not a similarity.
+    static double similarity_scale2(const Transform<T>& transform)
+    {
+        Vector<double, 3> rows[3];
+        for (std::size_t i = 0; i < 3; ++i)
+            for (std::size_t j = 0; j < 3; ++j)
+                rows[i][j] = real(transform.rows[i][j]);
+        double s2 = dot(rows[0], rows[0]);
+        double eps = 1e-9 * s2;
+        for (std::size_t i = 0; i < 3; ++i)
+            for (std::size_t j = 0; j < 3; ++j)
+                if (std::abs(dot(rows[i], rows[j]) - (i == j ? s2 : 0)) > eps)
+                    return 0;
+        return s2;
+    }
+
+    std::shared_ptr<const Shape<T>> m_shape;
+    Transform<T> m_transform;
+    Transform<T> m_inverse;
+    double m_scale2;
+};
+
+} // namespace drt
@@ -14,7 +14,8 @@ struct IntegrateBackward {
     {
         for (std::size_t i = 0; i < n_samples; ++i) {
             auto [sample, pdf] = sampler();
-            forward(sample).backward(grad / pdf);
+            Vector<T, N, true> value = forward(sample);
+            value.backward(grad / pdf);
         }
     }
 
@@ -44,7 +45,8 @@ inline Vector<T, N, true> integrate_unbiased(const Forward& forward,
     Vector<T, N> r(0);
     for (std::size_t i = 0; i < n_samples; ++i) {
         auto [sample, pdf] = sampler();
-        r += forward(sample).detach() / pdf;
+        Vector<T, N, true> value = forward(sample);
+        r += value.detach() / pdf;
     }
     return Vector<T, N, true>(r,
         IntegrateBackward<T, N, Forward, Sampler>
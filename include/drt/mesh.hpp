@@ -0,0 +1,353 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "bvh.hpp"
+#include "dual.hpp"
+#include "random.hpp"
+#include "shape.hpp"
+#include "vector.hpp"
+
+namespace drt {
+
+// Triangle mesh stored as a structure of arrays: vertex positions and
+// (optional) normals are kept as one array per coordinate, and triangles as
+// one array per corner. The arrays are views into memory owned by `storage`,
+// which is either a set of heap buffers or a memory-mapped file.
+//
+// Meshes may also come with the structures `TriangleMesh` builds on load,
+// computed beforehand (see `save_mesh`), so that they are used in place.
+struct MeshData {
+    std::size_t num_vertices = 0;
+    std::size_t num_triangles = 0;
+    std::array<const float*, 3> position {};
+    // Null if the mesh has no vertex normals
+    std::array<const float*, 3> normal {};
+    std::array<const std::uint32_t*, 3> index {};
+    // Null if not precomputed: the BVH of the triangles (nodes, and triangle
+    // indices in leaf order), and the prefix sums of the triangle areas
+    const BVH::Node *bvh_nodes = nullptr;
+    std::size_t num_bvh_nodes = 0;
+    const std::uint32_t *bvh_indices = nullptr;
+    const double *area_cdf = nullptr;
+    // Bounds of the mesh, if precomputed
+    Bounds bounds;
+    std::shared_ptr<const void> storage;
+
+    bool has_normals() const
+    {
+        return normal[0] != nullptr;
+    }
+
+    bool has_bvh() const
+    {
+        return bvh_nodes != nullptr;
+    }
+
+    Vector<double, 3> vertex(std::size_t v) const
+    {
+        return Vector<double, 3>{
+            position[0][v], position[1][v], position[2][v]};
+    }
+
+    std::array<Vector<double, 3>, 3> triangle(std::size_t tri) const
+    {
+        return {vertex(index[0][tri]),
+                vertex(index[1][tri]),
+                vertex(index[2][tri])};
+    }
+};
+
+// Builder for meshes held in memory, e.g. by the loaders.
+class MeshBuffers {
+public:
+    void add_vertex(const std::array<float, 3>& p)
+    {
+        for (std::size_t i = 0; i < 3; ++i)
+            m_position[i].push_back(p[i]);
+    }
+
+    void add_vertex(const std::array<float, 3>& p,
+                    const std::array<float, 3>& n)
+    {
+        for (std::size_t i = 0; i < 3; ++i) {
+            m_position[i].push_back(p[i]);
+            m_normal[i].push_back(n[i]);
+        }
+    }
+
+    void add_triangle(std::uint32_t a, std::uint32_t b, std::uint32_t c)
+    {
+        m_index[0].push_back(a);
+        m_index[1].push_back(b);
+        m_index[2].push_back(c);
+    }
+
+    std::size_t num_vertices() const
+    {
+        return m_position[0].size();
+    }
+
+    // Moves the buffers into a `MeshData`. Normals are only kept if every
+    // vertex has one.
+    MeshData finish() &&
+    {
+        auto buffers = std::make_shared<MeshBuffers>(std::move(*this));
+        MeshData data;
+        data.num_vertices = buffers->m_position[0].size();
+        data.num_triangles = buffers->m_index[0].size();
+        bool normals = buffers->m_normal[0].size() == data.num_vertices
+                       && data.num_vertices > 0;
+        for (std::size_t i = 0; i < 3; ++i) {
+            data.position[i] = buffers->m_position[i].data();
+            data.normal[i] = normals ? buffers->m_normal[i].data() : nullptr;
+            data.index[i] = buffers->m_index[i].data();
+        }
+        data.storage = std::move(buffers);
+        return data;
+    }
+
+private:
+    std::array<std::vector<float>, 3> m_position;
+    std::array<std::vector<float>, 3> m_normal;
+    std::array<std::vector<std::uint32_t>, 3> m_index;
+};
+
+namespace internal {
+
+// Computes the bounds of every triangle of `mesh`, and the prefix sums of
+// their areas.
+inline void triangle_bounds(const MeshData& mesh,
+                            std::vector<Bounds>& bounds,
+                            std::vector<double>& cdf)
+{
+    bounds.assign(mesh.num_triangles, Bounds());
+    cdf.resize(mesh.num_triangles);
+    double area = 0;
+    for (std::size_t i = 0; i < mesh.num_triangles; ++i) {
+        auto v = mesh.triangle(i);
+        for (const auto& p : v)
+            bounds[i].extend(p);
+        area += norm(cross(v[1] - v[0], v[2] - v[0])) / 2;
+        cdf[i] = area;
+    }
+}
+
+// Ray transformed for the watertight ray/triangle test of Woop et al. [2013]:
+// vertices are translated to the ray origin and sheared so that the ray
+// points along +z, after which edge functions are evaluated in 2D. Edges
+// shared by two triangles are then classified consistently, so rays cannot
+// slip through the mesh between adjacent triangles.
+struct WatertightRay {
+    explicit WatertightRay(const Vector<double, 3>& orig,
+                           const Vector<double, 3>& dir)
+      : orig(orig)
+    {
+        kz = 0;
+        for (std::size_t i = 1; i < 3; ++i)
+            if (std::abs(dir[i]) > std::abs(dir[kz]))
+                kz = i;
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if (dir[kz] < 0)
+            std::swap(kx, ky);
+        sx = dir[kx] / dir[kz];
+        sy = dir[ky] / dir[kz];
+        sz = 1 / dir[kz];
+    }
+
+    // Returns true if the triangle is hit within `(0, tmax)`, in which case
+    // `t` is set to the hit distance.
+    bool intersect(const std::array<Vector<double, 3>, 3>& tri,
+                   double tmax,
+                   double& t) const
+    {
+        Vector<double, 3> a = tri[0] - orig;
+        Vector<double, 3> b = tri[1] - orig;
+        Vector<double, 3> c = tri[2] - orig;
+        double ax = a[kx] - sx*a[kz], ay = a[ky] - sy*a[kz];
+        double bx = b[kx] - sx*b[kz], by = b[ky] - sy*b[kz];
+        double cx = c[kx] - sx*c[kz], cy = c[ky] - sy*c[kz];
+        double u = cx*by - cy*bx;
+        double v = ax*cy - ay*cx;
+        double w = bx*ay - by*ax;
+        if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+            return false;
+        double det = u + v + w;
+        if (det == 0)
+            return false;
+        double az = sz*a[kz], bz = sz*b[kz], cz = sz*c[kz];
+        double dist = u*az + v*bz + w*cz;
+        if (det < 0 ? (dist >= 0 || dist < tmax*det)
+                    : (dist <= 0 || dist > tmax*det))
+            return false;
+        t = dist / det;
+        return true;
+    }
+
+    Vector<double, 3> orig;
+    std::size_t kx, ky, kz;
+    double sx, sy, sz;
+};
+
+} // namespace internal
+
+// Mesh of triangles sharing a BxDF and emitter. Triangles are indexed by a
+// BVH of their own, so a mesh is a single (bounded) shape of the scene. The
+// BVH is built on construction, unless the mesh data comes with one.
+// Vertices are stored in single precision, so like other shapes the mesh
+// geometry is not differentiable.
+template <typename T>
+class TriangleMesh : public Shape<T> {
+public:
+    TriangleMesh(MeshData data,
+                 std::shared_ptr<BxDF<T>> bxdf = nullptr,
+                 std::shared_ptr<Emitter<T>> emitter = nullptr)
+      : Shape<T>(bxdf, emitter)
+      , m_data(std::move(data))
+    {
+        if (m_data.has_bvh()) {
+            m_bvh = BVH(m_data.bvh_nodes, m_data.num_bvh_nodes,
+                        m_data.bvh_indices, m_data.num_triangles);
+            m_bounds = m_data.bounds;
+            if (m_data.num_triangles > 0)
+                m_area = m_data.area_cdf[m_data.num_triangles - 1];
+            return;
+        }
+        std::vector<Bounds> bounds;
+        internal::triangle_bounds(m_data, bounds, m_cdf);
+        for (const auto& b : bounds)
+            m_bounds.extend(b);
+        if (!m_cdf.empty())
+            m_area = m_cdf.back();
+        m_bvh.build(bounds);
+        // Only emitting meshes are sampled, so only they need the CDF of the
+        // triangle areas.
+        if (!emitter)
+            m_cdf = std::vector<double>();
+    }
+
+    const MeshData& data() const
+    { return m_data; }
+
+    bool intersect(Vector<T, 3> orig,
+                   Vector<T, 3> dir,
+                   double& t,
+                   std::size_t& prim) const override
+    {
+        Vector<double, 3> o, d;
+        for (std::size_t i = 0; i < 3; ++i) {
+            o[i] = real(orig[i]);
+            d[i] = real(dir[i]);
+        }
+        internal::WatertightRay ray(o, d);
+        double tmax = inf;
+        bool hit = m_bvh.traverse(o, d, tmax, [&](std::size_t i, double& tmax) {
+            double t;
+            if (!ray.intersect(m_data.triangle(i), tmax, t))
+                return false;
+            tmax = t;
+            prim = i;
+            return true;
+        });
+        t = tmax;
+        return hit;
+    }
+
+    bool occluded(Vector<T, 3> orig,
+                  Vector<T, 3> dir,
+                  double tmax) const override
+    {
+        Vector<double, 3> o, d;
+        for (std::size_t i = 0; i < 3; ++i) {
+            o[i] = real(orig[i]);
+            d[i] = real(dir[i]);
+        }
+        internal::WatertightRay ray(o, d);
+        return m_bvh.occluded(o, d, tmax, [&](std::size_t i) {
+            double t;
+            return ray.intersect(m_data.triangle(i), tmax, t);
+        });
+    }
+
+    // Interpolates the vertex normals if the mesh has them, and returns the
+    // geometric normal (following the winding order) otherwise.
+    Vector<T, 3> normal(Vector<T, 3> point, std::size_t prim) const override
+    {
+        auto v = m_data.triangle(prim);
+        Vector<double, 3> n = cross(v[1] - v[0], v[2] - v[0]);
+        if (!m_data.has_normals())
+            return to_vector(normalize(n));
+
+        // Barycentric coordinates of the point (projected onto the plane of
+        // the triangle) from the areas of the sub-triangles
+        Vector<double, 3> p;
+        for (std::size_t i = 0; i < 3; ++i)
+            p[i] = real(point[i]);
+        double area = dot(n, n);
+        double b1 = dot(cross(p - v[0], v[2] - v[0]), n) / area;
+        double b2 = dot(cross(v[1] - v[0], p - v[0]), n) / area;
+        b1 = std::clamp(b1, 0., 1.);
+        b2 = std::clamp(b2, 0., 1. - b1);
+        double b0 = 1 - b1 - b2;
+        std::uint32_t a = m_data.index[0][prim];
+        std::uint32_t b = m_data.index[1][prim];
+        std::uint32_t c = m_data.index[2][prim];
+        Vector<double, 3> shading;
+        for (std::size_t i = 0; i < 3; ++i)
+            shading[i] = b0*m_data.normal[i][a] + b1*m_data.normal[i][b]
+                       + b2*m_data.normal[i][c];
+        return to_vector(normalize(shading));
+    }
+
+    Bounds bounds() const override
+    { return m_bounds; }
+
+    double area() const override
+    { return m_area; }
+
+    // Samples points uniformly over the mesh. The number picking the
+    // triangle is rescaled to pick the point as well, so that only two
+    // dimensions are used.
+    std::tuple<Vector<T, 3>, Vector<T, 3>, double> sample_surface(
+        const Vector<T, 3>& ref, Sampler& sampler) const override
+    {
+        const double *cdf = m_data.area_cdf ? m_data.area_cdf : m_cdf.data();
+        std::size_t n = m_data.area_cdf ? m_data.num_triangles : m_cdf.size();
+        if (n == 0)
+            throw std::runtime_error("Only emitting meshes can be sampled");
+        double u = sampler.uniform() * m_area;
+        std::size_t tri = std::min<std::size_t>(
+            std::upper_bound(cdf, cdf + n, u) - cdf, n - 1);
+        double lo = tri > 0 ? cdf[tri - 1] : 0;
+        double width = cdf[tri] - lo;
+        u = width > 0 ? std::clamp((u - lo) / width, 0., 1.) : 0;
+        auto v = m_data.triangle(tri);
+        double r = std::sqrt(u);
+        double b1 = r * (1 - sampler.uniform());
+        double b2 = r - b1;
+        Vector<double, 3> point = v[0] + b1*(v[1] - v[0]) + b2*(v[2] - v[0]);
+        Vector<double, 3> normal = normalize(cross(v[1] - v[0], v[2] - v[0]));
+        return std::make_tuple(to_vector(point), to_vector(normal), 1 / m_area);
+    }
+
+private:
+    static Vector<T, 3> to_vector(const Vector<double, 3>& v)
+    { return Vector<T, 3>{v[0], v[1], v[2]}; }
+
+    MeshData m_data;
+    Bounds m_bounds;
+    double m_area = 0;
+    std::vector<double> m_cdf;
+    BVH m_bvh;
+};
+
+} // namespace drt
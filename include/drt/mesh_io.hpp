@@ -0,0 +1,532 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mesh.hpp"
+
+namespace drt {
+
+namespace internal {
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("cannot open " + path);
+        struct stat st;
+        if (::fstat(fd, &st) < 0) {
+            ::close(fd);
+            throw std::runtime_error("cannot stat " + path);
+        }
+        m_size = st.st_size;
+        if (m_size > 0)
+            m_data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (m_data == MAP_FAILED)
+            throw std::runtime_error("cannot map " + path);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
+    {
+        if (m_data && m_data != MAP_FAILED)
+            ::munmap(m_data, m_size);
+    }
+
+    const unsigned char *data() const
+    {
+        return static_cast<const unsigned char*>(m_data);
+    }
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    void *m_data = nullptr;
+    std::size_t m_size = 0;
+};
+
+// Layout of the native mesh format. The header is followed by the arrays of
+// `MeshData` (positions, then normals if present, then indices, then the BVH
+// nodes, the BVH indices and the area CDF), each one starting at a multiple
+// of `mesh_align` bytes so that they can be used in place once the file is
+// mapped. Data is stored little-endian.
+struct MeshHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t flags;
+    std::uint64_t num_vertices;
+    std::uint64_t num_triangles;
+    std::uint64_t num_bvh_nodes;
+    double bounds_lo[3];
+    double bounds_hi[3];
+};
+
+constexpr char mesh_magic[8] = {'D', 'R', 'T', 'M', 'E', 'S', 'H', '\0'};
+constexpr std::uint32_t mesh_version = 2;
+constexpr std::uint32_t mesh_has_normals = 1;
+constexpr std::size_t mesh_align = 64;
+
+inline std::size_t align_mesh_offset(std::size_t offset)
+{
+    return (offset + mesh_align - 1) & ~(mesh_align - 1);
+}
+
+// Sizes of the arrays of a native mesh file, in `MeshData` order.
+inline std::vector<std::size_t> mesh_array_sizes(const MeshHeader& header)
+{
+    std::size_t vertices = header.flags & mesh_has_normals ? 6 : 3;
+    std::vector<std::size_t> sizes(vertices,
+                                   header.num_vertices * sizeof(float));
+    for (std::size_t i = 0; i < 3; ++i)
+        sizes.push_back(header.num_triangles * sizeof(std::uint32_t));
+    sizes.push_back(header.num_bvh_nodes * sizeof(BVH::Node));
+    sizes.push_back(header.num_triangles * sizeof(std::uint32_t));
+    sizes.push_back(header.num_triangles * sizeof(double));
+    return sizes;
+}
+
+// Offsets of the arrays of a native mesh file, followed by the file size.
+inline std::vector<std::size_t> mesh_layout(const MeshHeader& header)
+{
+    std::vector<std::size_t> sizes = mesh_array_sizes(header);
+    std::vector<std::size_t> offsets(sizes.size() + 1);
+    std::size_t offset = align_mesh_offset(sizeof(MeshHeader));
+    for (std::size_t i = 0; i < sizes.size(); ++i) {
+        offsets[i] = offset;
+        offset = align_mesh_offset(offset + sizes[i]);
+    }
+    offsets[sizes.size()] = offset;
+    return offsets;
+}
+
+inline bool little_endian()
+{
+    std::uint16_t x = 1;
+    unsigned char c;
+    std::memcpy(&c, &x, 1);
+    return c == 1;
+}
+
+enum class PlyType {
+    int8, uint8, int16, uint16, int32, uint32, float32, float64
+};
+
+inline PlyType ply_type(const std::string& name)
+{
+    static const std::pair<const char*, PlyType> types[] = {
+        {"char", PlyType::int8}, {"int8", PlyType::int8},
+        {"uchar", PlyType::uint8}, {"uint8", PlyType::uint8},
+        {"short", PlyType::int16}, {"int16", PlyType::int16},
+        {"ushort", PlyType::uint16}, {"uint16", PlyType::uint16},
+        {"int", PlyType::int32}, {"int32", PlyType::int32},
+        {"uint", PlyType::uint32}, {"uint32", PlyType::uint32},
+        {"float", PlyType::float32}, {"float32", PlyType::float32},
+        {"double", PlyType::float64}, {"float64", PlyType::float64},
+    };
+    for (const auto& [n, type] : types)
+        if (name == n)
+            return type;
+    throw std::runtime_error("unsupported PLY type " + name);
+}
+
+inline std::size_t ply_size(PlyType type)
+{
+    switch (type) {
+    case PlyType::int8: case PlyType::uint8: return 1;
+    case PlyType::int16: case PlyType::uint16: return 2;
+    case PlyType::float64: return 8;
+    default: return 4;
+    }
+}
+
+// Converts a binary PLY value (in native byte order) to double.
+inline double ply_value(PlyType type, const unsigned char *buf)
+{
+    auto as = [&](auto x) {
+        std::memcpy(&x, buf, sizeof(x));
+        return double(x);
+    };
+    switch (type) {
+    case PlyType::int8: return as(std::int8_t());
+    case PlyType::uint8: return as(std::uint8_t());
+    case PlyType::int16: return as(std::int16_t());
+    case PlyType::uint16: return as(std::uint16_t());
+    case PlyType::int32: return as(std::int32_t());
+    case PlyType::uint32: return as(std::uint32_t());
+    case PlyType::float32: return as(float());
+    default: return as(double());
+    }
+}
+
+// Splits a polygon into a fan of triangles.
+inline void add_polygon(MeshBuffers& mesh,
+                        const std::vector<std::uint32_t>& poly)
+{
+    for (std::size_t i = 2; i < poly.size(); ++i)
+        mesh.add_triangle(poly[0], poly[i - 1], poly[i]);
+}
+
+} // namespace internal
+
+// Loads a Wavefront OBJ file. Only positions, normals and (polygonal) faces
+// are read; polygons are triangulated as fans.
+inline MeshData load_obj(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file)
+        throw std::runtime_error("cannot open " + path);
+
+    std::vector<std::array<float, 3>> positions;
+    std::vector<std::array<float, 3>> normals;
+    // Maps (position, normal) pairs of the file to mesh vertices
+    std::unordered_map<std::uint64_t, std::uint32_t> vertices;
+    MeshBuffers mesh;
+    bool use_normals = true;
+
+    auto resolve = [&](long i, std::size_t n) -> std::size_t {
+        long j = i < 0 ? long(n) + i : i - 1;
+        if (i == 0 || j < 0 || std::size_t(j) >= n)
+            throw std::runtime_error("invalid index in " + path);
+        return std::size_t(j);
+    };
+
+    std::string line;
+    std::vector<std::uint32_t> poly;
+    while (std::getline(file, line)) {
+        std::istringstream ss(line);
+        std::string tag;
+        ss >> tag;
+        if (tag == "v") {
+            std::array<float, 3> p;
+            ss >> p[0] >> p[1] >> p[2];
+            positions.push_back(p);
+        } else if (tag == "vn") {
+            std::array<float, 3> n;
+            ss >> n[0] >> n[1] >> n[2];
+            normals.push_back(n);
+        } else if (tag == "f") {
+            poly.clear();
+            std::string corner;
+            while (ss >> corner) {
+                // Corners are `v`, `v/vt`, `v//vn` or `v/vt/vn`
+                std::size_t s1 = corner.find('/');
+                std::size_t s2 = s1 == std::string::npos
+                    ? std::string::npos : corner.find('/', s1 + 1);
+                std::size_t v = resolve(std::stol(corner), positions.size());
+                std::size_t n = 0;
+                bool has_normal = s2 != std::string::npos
+                                  && s2 + 1 < corner.size();
+                if (has_normal) {
+                    long i = std::stol(corner.substr(s2 + 1));
+                    n = resolve(i, normals.size()) + 1;
+                } else {
+                    use_normals = false;
+                }
+                std::uint64_t key = (std::uint64_t(v) << 32) | n;
+                auto [it, inserted] =
+                    vertices.emplace(key, std::uint32_t(mesh.num_vertices()));
+                if (inserted) {
+                    if (has_normal)
+                        mesh.add_vertex(positions[v], normals[n - 1]);
+                    else
+                        mesh.add_vertex(positions[v]);
+                }
+                poly.push_back(it->second);
+            }
+            internal::add_polygon(mesh, poly);
+        }
+    }
+    // Vertex normals are only meaningful if every face has them
+    if (!use_normals) {
+        MeshBuffers flat;
+        MeshData data = std::move(mesh).finish();
+        for (std::size_t v = 0; v < data.num_vertices; ++v)
+            flat.add_vertex({data.position[0][v], data.position[1][v],
+                             data.position[2][v]});
+        for (std::size_t t = 0; t < data.num_triangles; ++t)
+            flat.add_triangle(data.index[0][t], data.index[1][t],
+                              data.index[2][t]);
+        return std::move(flat).finish();
+    }
+    return std::move(mesh).finish();
+}
+
+// Loads a PLY file (ASCII or binary). Vertex positions and normals are read
+// from the `vertex` element and polygons from the `face` element; other
+// elements and properties are skipped.
+inline MeshData load_ply(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        throw std::runtime_error("cannot open " + path);
+
+    enum class Format { ascii, little_endian, big_endian };
+    struct Property {
+        std::string name;
+        internal::PlyType type;
+        bool list = false;
+        internal::PlyType count_type;
+    };
+    struct Element {
+        std::string name;
+        std::size_t count;
+        std::vector<Property> properties;
+    };
+
+    Format format = Format::ascii;
+    std::vector<Element> elements;
+    std::string line;
+    std::getline(file, line);
+    if (line.rfind("ply", 0) != 0)
+        throw std::runtime_error(path + " is not a PLY file");
+    while (std::getline(file, line)) {
+        std::istringstream ss(line);
+        std::string tag;
+        ss >> tag;
+        if (tag == "format") {
+            std::string f;
+            ss >> f;
+            if (f == "binary_little_endian")
+                format = Format::little_endian;
+            else if (f == "binary_big_endian")
+                format = Format::big_endian;
+        } else if (tag == "element") {
+            Element e;
+            ss >> e.name >> e.count;
+            elements.push_back(e);
+        } else if (tag == "property" && !elements.empty()) {
+            Property p;
+            std::string type;
+            ss >> type;
+            if (type == "list") {
+                p.list = true;
+                ss >> type;
+                p.count_type = internal::ply_type(type);
+                ss >> type;
+            }
+            p.type = internal::ply_type(type);
+            ss >> p.name;
+            elements.back().properties.push_back(p);
+        } else if (tag == "end_header") {
+            break;
+        }
+    }
+
+    bool native = (format == Format::little_endian) == internal::little_endian();
+    bool swap = format != Format::ascii && !native;
+    auto read = [&](internal::PlyType type) -> double {
+        if (format == Format::ascii) {
+            double x;
+            if (!(file >> x))
+                throw std::runtime_error("unexpected end of " + path);
+            return x;
+        }
+        unsigned char buf[8];
+        std::size_t size = internal::ply_size(type);
+        if (!file.read(reinterpret_cast<char*>(buf), size))
+            throw std::runtime_error("unexpected end of " + path);
+        if (swap)
+            std::reverse(buf, buf + size);
+        return internal::ply_value(type, buf);
+    };
+
+    MeshBuffers mesh;
+    std::vector<std::uint32_t> poly;
+    for (const Element& e : elements) {
+        for (std::size_t i = 0; i < e.count; ++i) {
+            std::array<float, 3> p {0, 0, 0}, n {0, 0, 0};
+            bool has_normal = false;
+            poly.clear();
+            for (const Property& prop : e.properties) {
+                if (prop.list) {
+                    auto count = std::size_t(read(prop.count_type));
+                    for (std::size_t j = 0; j < count; ++j) {
+                        double x = read(prop.type);
+                        bool indices = prop.name == "vertex_indices"
+                                       || prop.name == "vertex_index";
+                        if (e.name == "face" && indices)
+                            poly.push_back(std::uint32_t(x));
+                    }
+                    continue;
+                }
+                double x = read(prop.type);
+                if (e.name != "vertex")
+                    continue;
+                const char *names[] = {"x", "y", "z", "nx", "ny", "nz"};
+                for (std::size_t k = 0; k < 6; ++k) {
+                    if (prop.name != names[k])
+                        continue;
+                    if (k < 3) {
+                        p[k] = float(x);
+                    } else {
+                        n[k - 3] = float(x);
+                        has_normal = true;
+                    }
+                }
+            }
+            if (e.name == "vertex") {
+                if (has_normal)
+                    mesh.add_vertex(p, n);
+                else
+                    mesh.add_vertex(p);
+            } else if (e.name == "face") {
+                for (auto v : poly)
+                    if (v >= mesh.num_vertices())
+                        throw std::runtime_error("invalid index in " + path);
+                internal::add_polygon(mesh, poly);
+            }
+        }
+    }
+    return std::move(mesh).finish();
+}
+
+// Writes a mesh in the native format read by `map_mesh`, along with its BVH
+// and area CDF (built here unless the mesh comes with them), so that mapped
+// meshes need no processing at all.
+inline void save_mesh(const std::string& path, const MeshData& mesh)
+{
+    if (!internal::little_endian())
+        throw std::runtime_error("native meshes are little-endian only");
+
+    BVH bvh;
+    std::vector<double> cdf;
+    Bounds bounds = mesh.bounds;
+    if (mesh.has_bvh()) {
+        bvh = BVH(mesh.bvh_nodes, mesh.num_bvh_nodes, mesh.bvh_indices,
+                  mesh.num_triangles);
+    } else {
+        std::vector<Bounds> triangles;
+        internal::triangle_bounds(mesh, triangles, cdf);
+        for (const auto& b : triangles)
+            bounds.extend(b);
+        bvh.build(triangles);
+    }
+
+    internal::MeshHeader header {};
+    std::memcpy(header.magic, internal::mesh_magic, sizeof(header.magic));
+    header.version = internal::mesh_version;
+    header.flags = mesh.has_normals() ? internal::mesh_has_normals : 0;
+    header.num_vertices = mesh.num_vertices;
+    header.num_triangles = mesh.num_triangles;
+    header.num_bvh_nodes = bvh.num_nodes();
+    for (std::size_t i = 0; i < 3; ++i) {
+        header.bounds_lo[i] = bounds.lo[i];
+        header.bounds_hi[i] = bounds.hi[i];
+    }
+
+    std::vector<const void*> arrays;
+    for (auto p : mesh.position)
+        arrays.push_back(p);
+    if (mesh.has_normals())
+        for (auto n : mesh.normal)
+            arrays.push_back(n);
+    for (auto i : mesh.index)
+        arrays.push_back(i);
+    arrays.push_back(bvh.nodes());
+    arrays.push_back(bvh.indices());
+    arrays.push_back(mesh.has_bvh() ? mesh.area_cdf : cdf.data());
+    auto sizes = internal::mesh_array_sizes(header);
+    auto offsets = internal::mesh_layout(header);
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file)
+        throw std::runtime_error("cannot open " + path);
+    std::vector<char> padding(internal::mesh_align, 0);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    std::size_t pos = sizeof(header);
+    for (std::size_t i = 0; i < arrays.size(); ++i) {
+        file.write(padding.data(), offsets[i] - pos);
+        file.write(static_cast<const char*>(arrays[i]), sizes[i]);
+        pos = offsets[i] + sizes[i];
+    }
+    file.write(padding.data(), offsets.back() - pos);
+    if (!file)
+        throw std::runtime_error("cannot write " + path);
+}
+
+// Maps a mesh in the native format. Nothing is copied (or even read) here:
+// the arrays of the returned mesh, BVH included, point into the mapping,
+// which lives as long as the mesh. Indices are not validated, so the file
+// must be trusted.
+inline MeshData map_mesh(const std::string& path)
+{
+    auto file = std::make_shared<internal::MappedFile>(path);
+    internal::MeshHeader header;
+    if (file->size() < sizeof(header))
+        throw std::runtime_error(path + " is not a mesh file");
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, internal::mesh_magic, sizeof(header.magic))
+        || !internal::little_endian())
+        throw std::runtime_error(path + " is not a mesh file");
+    if (header.version != internal::mesh_version)
+        throw std::runtime_error(path + " is a mesh file of another version "
+                                 "(convert the original mesh again)");
+    auto offsets = internal::mesh_layout(header);
+    if (file->size() < offsets.back())
+        throw std::runtime_error(path + " is truncated");
+
+    MeshData data;
+    data.num_vertices = header.num_vertices;
+    data.num_triangles = header.num_triangles;
+    std::size_t k = 0;
+    auto at = [&](std::size_t i) { return file->data() + offsets[i]; };
+    for (std::size_t i = 0; i < 3; ++i)
+        data.position[i] = reinterpret_cast<const float*>(at(k++));
+    if (header.flags & internal::mesh_has_normals)
+        for (std::size_t i = 0; i < 3; ++i)
+            data.normal[i] = reinterpret_cast<const float*>(at(k++));
+    for (std::size_t i = 0; i < 3; ++i)
+        data.index[i] = reinterpret_cast<const std::uint32_t*>(at(k++));
+    data.bvh_nodes = reinterpret_cast<const BVH::Node*>(at(k++));
+    data.num_bvh_nodes = header.num_bvh_nodes;
+    data.bvh_indices = reinterpret_cast<const std::uint32_t*>(at(k++));
+    data.area_cdf = reinterpret_cast<const double*>(at(k++));
+    for (std::size_t i = 0; i < 3; ++i) {
+        data.bounds.lo[i] = header.bounds_lo[i];
+        data.bounds.hi[i] = header.bounds_hi[i];
+    }
+    data.storage = std::move(file);
+    return data;
+}
+
+// Loads a mesh, choosing the format from the file extension (`.obj`, `.ply`,
+// or `.drtm` for the native format).
+inline MeshData load_mesh(const std::string& path)
+{
+    auto ends_with = [&](const char *ext) {
+        std::size_t n = std::strlen(ext);
+        return path.size() >= n && path.compare(path.size() - n, n, ext) == 0;
+    };
+    if (ends_with(".obj"))
+        return load_obj(path);
+    if (ends_with(".ply"))
+        return load_ply(path);
+    if (ends_with(".drtm"))
+        return map_mesh(path);
+    throw std::runtime_error("unknown mesh format: " + path);
+}
+
+} // namespace drt
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "constants.hpp"
+#include "gradient.hpp"
+#include "vector.hpp"
+
+namespace drt {
+
+enum class Loss { l1, l2 };
+
+inline Loss parse_loss(const std::string& name)
+{
+    if (name == "l1")
+        return Loss::l1;
+    if (name == "l2")
+        return Loss::l2;
+    throw std::runtime_error("unknown loss " + name);
+}
+
+// Returns the loss of `image` against `target`, both of `size` pixels,
+// averaged over pixels and channels, and stores its derivative w.r.t. every
+// pixel of `image` in `adjoint`.
+template <typename T>
+double image_loss(Loss loss,
+                  const Vector<T, 3> *image,
+                  const Vector<T, 3> *target,
+                  std::size_t size,
+                  Vector<T, 3> *adjoint)
+{
+    double scale = 1.0 / (3 * size);
+    double sum = 0;
+    for (std::size_t i = 0; i < size; ++i) {
+        for (std::size_t c = 0; c < 3; ++c) {
+            T diff = image[i][c] - target[i][c];
+            if (loss == Loss::l1) {
+                sum += std::abs(diff);
+                adjoint[i][c] = diff > 0 ? scale : diff < 0 ? -scale : 0;
+            } else {
+                sum += diff * diff;
+                adjoint[i][c] = 2 * scale * diff;
+            }
+        }
+    }
+    return sum * scale;
+}
+
+// Scene parameters being optimized, seen as one flat array: the values of
+// the registered variables one after the other, in registration order.
+template <typename T, std::size_t N>
+class ParameterSet {
+public:
+    // Registers `param` (a variable), whose values are kept in `[lo, hi]`.
+    // The set refers to the variable itself, not to a copy of its value.
+    void add(const Vector<T, N, true>& param, T lo = -inf, T hi = inf)
+    {
+        if (!param.requires_grad())
+            throw std::runtime_error("parameters must be variables");
+        m_params.push_back({param, lo, hi});
+    }
+
+    std::size_t size() const
+    {
+        return N * m_params.size();
+    }
+
+    void get(T *values) const
+    {
+        for (const auto& param : m_params)
+            for (std::size_t i = 0; i < N; ++i)
+                *values++ = param.var.detach()[i];
+    }
+
+    // Sets the values of the parameters, clamped to their bounds.
+    void set(const T *values)
+    {
+        for (auto& param : m_params)
+            for (std::size_t i = 0; i < N; ++i)
+                param.var.detach()[i] = std::clamp(*values++, param.lo,
+                                                   param.hi);
+    }
+
+    void gradients(T *grads) const
+    {
+        for (const auto& param : m_params)
+            for (std::size_t i = 0; i < N; ++i)
+                *grads++ = param.var.grad()[i];
+    }
+
+    // Adds the gradients of the parameters held in `buffer` (in
+    // `Mode::shadow`) to `grads`, leaving the variables untouched.
+    void accumulate(const GradientBuffer<T, N>& buffer, T *grads) const
+    {
+        for (const auto& param : m_params) {
+            if (auto grad = buffer.find(param.var.id()))
+                for (std::size_t i = 0; i < N; ++i)
+                    grads[i] += (*grad)[i];
+            grads += N;
+        }
+    }
+
+    void zero_grad()
+    {
+        for (auto& param : m_params)
+            param.var.grad() = Vector<T, N>(T(0));
+    }
+
+private:
+    struct Parameter {
+        Vector<T, N, true> var;
+        T lo;
+        T hi;
+    };
+
+    std::vector<Parameter> m_params;
+};
+
+// First-order optimizer, updating flat arrays of parameters (see
+// `ParameterSet`) from their gradients, one step at a time. Optimizers keep
+// state per parameter, so every step must be given the same parameters.
+class Optimizer {
+public:
+    virtual ~Optimizer() = default;
+
+    virtual void step(double *values, const double *grads,
+                      std::size_t size) = 0;
+};
+
+// Gradient descent, with momentum if nonzero.
+class SGD : public Optimizer {
+public:
+    explicit SGD(double rate, double momentum = 0)
+      : m_rate(rate)
+      , m_momentum(momentum)
+    { }
+
+    void step(double *values, const double *grads, std::size_t size) override
+    {
+        m_velocity.resize(size, 0);
+        for (std::size_t i = 0; i < size; ++i) {
+            m_velocity[i] = m_momentum * m_velocity[i] + grads[i];
+            values[i] -= m_rate * m_velocity[i];
+        }
+    }
+
+private:
+    double m_rate;
+    double m_momentum;
+    std::vector<double> m_velocity;
+};
+
+// Adam (Kingma and Ba, 2015): steps scaled by running estimates of the
+// first and second moments of the gradients, so that every parameter moves
+// by about `rate` per step whatever the scale of its gradient.
+class Adam : public Optimizer {
+public:
+    explicit Adam(double rate,
+                  double beta1 = 0.9,
+                  double beta2 = 0.999,
+                  double epsilon = 1e-8)
+      : m_rate(rate)
+      , m_beta1(beta1)
+      , m_beta2(beta2)
+      , m_epsilon(epsilon)
+    { }
+
+    void step(double *values, const double *grads, std::size_t size) override
+    {
+        m_m.resize(size, 0);
+        m_v.resize(size, 0);
+        ++m_steps;
+        double correction1 = 1 - std::pow(m_beta1, double(m_steps));
+        double correction2 = 1 - std::pow(m_beta2, double(m_steps));
+        for (std::size_t i = 0; i < size; ++i) {
+            m_m[i] = m_beta1 * m_m[i] + (1 - m_beta1) * grads[i];
+            m_v[i] = m_beta2 * m_v[i] + (1 - m_beta2) * grads[i] * grads[i];
+            double m = m_m[i] / correction1;
+            double v = m_v[i] / correction2;
+            values[i] -= m_rate * m / (std::sqrt(v) + m_epsilon);
+        }
+    }
+
+private:
+    double m_rate;
+    double m_beta1;
+    double m_beta2;
+    double m_epsilon;
+    std::size_t m_steps = 0;
+    std::vector<double> m_m;
+    std::vector<double> m_v;
+};
+
+} // namespace drt
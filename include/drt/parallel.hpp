@@ -0,0 +1,235 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace drt {
+
+// Rectangle of pixels `[x_begin, x_end) x [y_begin, y_end)`
+struct Tile {
+    std::size_t x_begin;
+    std::size_t y_begin;
+    std::size_t x_end;
+    std::size_t y_end;
+};
+
+namespace internal {
+
+// Interleaves the bits of `x` and `y`, giving the position of `(x, y)`
+// along the Z-order curve.
+inline std::uint64_t morton(std::uint32_t x, std::uint32_t y)
+{
+    auto spread = [](std::uint64_t v) {
+        v = (v | (v << 16)) & 0x0000FFFF0000FFFF;
+        v = (v | (v << 8)) & 0x00FF00FF00FF00FF;
+        v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0F;
+        v = (v | (v << 2)) & 0x3333333333333333;
+        v = (v | (v << 1)) & 0x5555555555555555;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+} // namespace internal
+
+// Splits an image into tiles of `size` x `size` pixels (smaller along the
+// right and bottom edges), in Z-order so that tiles close in the list are
+// close in the image.
+inline std::vector<Tile> make_tiles(std::size_t width,
+                                    std::size_t height,
+                                    std::size_t size = 16)
+{
+    std::vector<std::pair<std::uint64_t, Tile>> tiles;
+    for (std::size_t y = 0; y < height; y += size) {
+        for (std::size_t x = 0; x < width; x += size) {
+            Tile tile {x, y, std::min(x + size, width),
+                       std::min(y + size, height)};
+            tiles.emplace_back(internal::morton(std::uint32_t(x / size),
+                                                std::uint32_t(y / size)),
+                               tile);
+        }
+    }
+    std::sort(tiles.begin(), tiles.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+    });
+    std::vector<Tile> result;
+    result.reserve(tiles.size());
+    for (const auto& tile : tiles)
+        result.push_back(tile.second);
+    return result;
+}
+
+// Fixed pool of threads running parallel loops with work stealing. The
+// items of a loop are split into one contiguous range per thread, which
+// the thread processes in order. Threads that run out of items steal the
+// second half of the remaining items of another. Ranges are guarded by
+// locks, which is cheap as long as items are coarse (e.g. image tiles).
+class ThreadPool {
+public:
+    // Pool of `threads` threads including the one calling `run` (as many
+    // as hardware threads if zero).
+    explicit ThreadPool(std::size_t threads = 0)
+      : m_size(threads ? threads
+                       : std::max(std::thread::hardware_concurrency(), 1u))
+      , m_ranges(new Range[m_size])
+    {
+        for (std::size_t i = 1; i < m_size; ++i)
+            m_threads.emplace_back([this, i]() { work(i); });
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (auto& thread : m_threads)
+            thread.join();
+    }
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+    // Calls `task(thread, item)` for every item in `[0, count)`, where
+    // `thread` (less than `size()`) identifies the calling thread, so that
+    // tasks can keep per-thread state. Returns once all items are done, or
+    // rethrows the first exception thrown by a task (skipping the items
+    // not started yet).
+    template <typename Task>
+    void run(std::size_t count, Task&& task)
+    {
+        if (count == 0)
+            return;
+        for (std::size_t i = 0; i < m_size; ++i) {
+            m_ranges[i].begin = count * i / m_size;
+            m_ranges[i].end = count * (i+1) / m_size;
+        }
+        m_task = [&task](std::size_t thread, std::size_t item) {
+            task(thread, item);
+        };
+        m_error = nullptr;
+        m_failed.store(false, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_active = m_size - 1;
+            ++m_generation;
+        }
+        m_wake.notify_all();
+        process(0);
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_done.wait(lock, [&]() { return m_active == 0; });
+        }
+        m_task = nullptr;
+        if (m_error)
+            std::rethrow_exception(m_error);
+    }
+
+private:
+    struct alignas(64) Range {
+        std::mutex mutex;
+        std::size_t begin = 0;
+        std::size_t end = 0;
+    };
+
+    void work(std::size_t thread)
+    {
+        std::uint64_t generation = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [&]() {
+                    return m_stop || m_generation != generation;
+                });
+                if (m_stop)
+                    return;
+                generation = m_generation;
+            }
+            process(thread);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_active == 0)
+                m_done.notify_all();
+        }
+    }
+
+    void process(std::size_t thread)
+    {
+        std::size_t item;
+        try {
+            while (next(thread, item))
+                m_task(thread, item);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_error)
+                m_error = std::current_exception();
+            m_failed.store(true, std::memory_order_relaxed);
+            for (std::size_t i = 0; i < m_size; ++i) {
+                std::lock_guard<std::mutex> range_lock(m_ranges[i].mutex);
+                m_ranges[i].begin = m_ranges[i].end;
+            }
+        }
+    }
+
+    // Takes the next item of `thread`, stealing some if it has none left.
+    bool next(std::size_t thread, std::size_t& item)
+    {
+        Range& own = m_ranges[thread];
+        {
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (own.begin < own.end) {
+                item = own.begin++;
+                return true;
+            }
+        }
+        for (std::size_t i = 1; i < m_size; ++i) {
+            Range& victim = m_ranges[(thread + i) % m_size];
+            // Both ranges are locked while the items move, and no item moves
+            // once a task failed (the failing thread may have cleared the
+            // range of this one already)
+            std::scoped_lock lock(own.mutex, victim.mutex);
+            if (m_failed.load(std::memory_order_relaxed))
+                return false;
+            if (victim.begin == victim.end)
+                continue;
+            std::size_t begin = victim.begin + (victim.end - victim.begin) / 2;
+            own.begin = begin + 1;
+            own.end = victim.end;
+            victim.end = begin;
+            item = begin;
+            return true;
+        }
+        return false;
+    }
+
+    std::size_t m_size;
+    std::unique_ptr<Range[]> m_ranges;
+    std::vector<std::thread> m_threads;
+    std::function<void(std::size_t, std::size_t)> m_task;
+    std::exception_ptr m_error;
+    std::atomic<bool> m_failed {false};
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    std::uint64_t m_generation = 0;
+    std::size_t m_active = 0;
+    bool m_stop = false;
+};
+
+} // namespace drt
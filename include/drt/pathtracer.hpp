@@ -1,27 +1,29 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
 #include <tuple>
 #include "bxdf.hpp"
 #include "emitter.hpp"
 #include "vector.hpp"
-#include "shape.hpp"
-#include <vector>
+#include "random.hpp"
+#include "scene.hpp"
 
 namespace drt {
 
-template <typename T>
-using Scene = std::vector<Shape<T>*>;
-
 namespace internal {
 
 template <typename T>
 std::tuple<Vector<T, 3>, double> sample_bxdf(
     const BxDF<T> *bxdf,
     Vector<T, 3> normal,
-    Vector<T, 3> dir_in)
+    Vector<T, 3> dir_in,
+    Sampler& sampler)
 {
     if (bxdf)
-        return bxdf->sample(normal, dir_in);
+        return bxdf->sample(normal, dir_in, sampler);
     else
         return std::make_tuple(Vector<T, 3>(0), 1);
 }
@@ -39,100 +41,386 @@ Vector<T, 3, true> eval_bxdf(
         return Vector<T, 3>(0);
 }
 
+// Returned by reference, as copies of parameters would update their shared
+// reference count, which is contended when rendering with many threads.
 template <typename T>
-Vector<T, 3, true> emission(const Emitter<T> *emitter)
+const Vector<T, 3, true>& emission(const Emitter<T> *emitter)
 {
+    static const Vector<T, 3, true> none(Vector<T, 3>(0));
     if (emitter)
         return emitter->emission();
     else
+        return none;
+}
+
+// Sample dimensions drawn by a path. Camera rays take the first two, then
+// every bounce takes a block of its own (for Russian roulette, choosing a
+// light, a point on it, and a BxDF direction), whether or not it makes all
+// of these decisions. Each decision thus always draws from the same
+// dimensions, which low-discrepancy sequences stratify across samples.
+constexpr std::uint64_t camera_dimensions = 2;
+
+enum BounceDimension : std::uint64_t {
+    roulette_dimension = 0,
+    light_dimension = 1,
+    bxdf_dimension = 4,
+    bounce_dimensions = 6
+};
+
+inline void seek(Sampler& sampler, std::size_t depth, BounceDimension offset)
+{
+    sampler.seek(camera_dimensions + depth*bounce_dimensions + offset);
+}
+
+inline double power_heuristic(double pdf, double other_pdf)
+{
+    return pdf*pdf / (pdf*pdf + other_pdf*other_pdf);
+}
+
+// Pdf (w.r.t. solid angle at `ref`) of light sampling choosing `point` on
+// `light`, with normal `normal` there.
+template <typename T, typename SceneT>
+double light_pdf(const SceneT& scene,
+                 const Shape<T> *light,
+                 const Vector<T, 3>& ref,
+                 const Vector<T, 3>& point,
+                 const Vector<T, 3>& normal)
+{
+    Vector<double, 3> offset, n;
+    for (std::size_t i = 0; i < 3; ++i) {
+        offset[i] = real(point[i]) - real(ref[i]);
+        n[i] = real(normal[i]);
+    }
+    double dist2 = dot(offset, offset);
+    double cos_light = std::abs(dot(n, offset)) / std::sqrt(dist2);
+    return light->pdf_surface(ref, point) * dist2
+        / (cos_light * scene.lights().size());
+}
+
+// MIS weight of the emission of `shape`, hit at `point`, by a ray sampled
+// from `ref` with pdf `pdf` by a BxDF. The pdf is zero if lights were not
+// sampled at `ref`, in which case the emission is counted fully.
+template <typename T, typename SceneT>
+double emission_weight(const SceneT& scene,
+                       const Shape<T> *shape,
+                       const Vector<T, 3>& ref,
+                       const Vector<T, 3>& point,
+                       const Vector<T, 3>& normal,
+                       double pdf)
+{
+    if (pdf == 0 || !shape->light())
+        return 1;
+    return power_heuristic(
+        pdf, light_pdf<T>(scene, shape, ref, point, normal));
+}
+
+// Next event estimation: estimates the radiance scattered by `bxdf` towards
+// `dir_in` of the light arriving directly from a point sampled on one of the
+// lights of the scene (zero if the point is occluded). The estimate is
+// weighted against BxDF sampling with the power heuristic.
+template <typename T, typename SceneT>
+Vector<T, 3, true> sample_light(const SceneT& scene,
+                                const BxDF<T> *bxdf,
+                                const Vector<T, 3>& point,
+                                const Vector<T, 3>& normal,
+                                const Vector<T, 3>& dir_in,
+                                Sampler& sampler)
+{
+    using std::abs;
+    using std::sqrt;
+    const auto& lights = scene.lights();
+    if (lights.empty())
+        return Vector<T, 3>(0);
+    std::size_t i = std::min(std::size_t(sampler.uniform() * lights.size()),
+                             lights.size() - 1);
+    Shape<T> *light = lights[i];
+    auto [light_point, light_normal, pdf] = light->sample_surface(
+        point, sampler);
+    Vector<T, 3> offset = light_point - point;
+    T dist = sqrt(dot(offset, offset));
+    Vector<T, 3> dir_out = offset / dist;
+    T cos_theta = dot(normal, dir_out);
+    T cos_light = abs(dot(light_normal, dir_out));
+    if (cos_theta <= 0 || cos_light <= 0)
         return Vector<T, 3>(0);
+
+    if (scene.occluded(point + 1e-3*dir_out, dir_out, real(dist) - 2e-3))
+        return Vector<T, 3>(0);
+
+    // Converts the pdf from area to solid angle
+    T solid_pdf = pdf * dist*dist / cos_light / double(lights.size());
+    double mis = power_heuristic(
+        real(solid_pdf), bxdf->pdf(normal, dir_in, dir_out));
+    return (*bxdf)(normal, dir_in, dir_out)
+        * emission(light->emitter()) * (cos_theta * mis / solid_pdf);
 }
 
 } // namespace internal
 
-template <typename T>
+// Unidirectional path tracer. Unless `sample_lights` is false, lights are
+// also sampled directly at every vertex whose BxDF allows it, and combined
+// with BxDF sampling by multiple importance sampling. Scenes may be either a
+// `Scene` or a `StaticScene`.
+template <typename T, typename SceneT = Scene<T>>
 class Pathtracer {
 public:
-    Pathtracer(double absorb, std::size_t min_bounces)
-      : m_absorb(absorb), m_min_bounces(min_bounces) { }
+    Pathtracer(double absorb,
+               std::size_t min_bounces,
+               bool sample_lights = true)
+      : m_absorb(absorb)
+      , m_min_bounces(min_bounces)
+      , m_sample_lights(sample_lights)
+    { }
 
-    Vector<T, 3, true> trace(const Scene<T>& scene,
+    // Random numbers are drawn from `sampler`, at the dimensions of the
+    // bounces from `depth` on (see `internal::seek`).
+    Vector<T, 3, true> trace(const SceneT& scene,
                              Vector<T, 3> orig,
                              Vector<T, 3> dir,
+                             Sampler& sampler,
                              std::size_t depth = 0) const;
 
+    // Path replay backpropagation: estimates the radiance along a ray without
+    // recording it, then retraces the same path (by replaying the random
+    // number sequence) and backpropagates `grad` to the scene parameters
+    // vertex by vertex. Memory use does not depend on the path length.
+    Vector<T, 3> trace_replay(const SceneT& scene,
+                              Vector<T, 3> orig,
+                              Vector<T, 3> dir,
+                              Sampler& sampler,
+                              const Vector<T, 3>& grad) const;
+
 private:
     struct RaycastHit {
         Vector<T, 3> point;
         Vector<T, 3> normal;
         BxDF<T> *bxdf;
         Emitter<T> *emitter;
+        const Shape<T> *shape;
     };
 
-    bool raycast(const Scene<T>& scene,
+    bool raycast(const SceneT& scene,
                  Vector<T, 3> orig,
                  Vector<T, 3> dir,
                  RaycastHit& hit) const
     {
-        double tmin = inf;
-        for (auto shape : scene) {
-            double t;
-            if (!shape->intersect(orig, dir, t) || t >= tmin)
-                continue;
-            tmin = t;
-            hit.point = orig + t*dir;
-            hit.normal = shape->normal(hit.point);
-            hit.bxdf = shape->bxdf();
-            hit.emitter = shape->emitter();
-        }
-        return !std::isinf(tmin);
+        double t;
+        std::size_t prim;
+        Shape<T> *shape = scene.intersect(orig, dir, t, prim);
+        if (!shape)
+            return false;
+        hit.point = orig + t*dir;
+        hit.normal = scene.normal(shape, hit.point, prim);
+        // Surfaces are two-sided (e.g. mesh triangles seen from behind)
+        if (dot(hit.normal, dir) > 0)
+            hit.normal = -hit.normal;
+        hit.bxdf = shape->bxdf();
+        hit.emitter = shape->emitter();
+        hit.shape = shape;
+        return true;
     }
 
-    Vector<T, 3, true> scatter(const Scene<T>& scene,
-                               RaycastHit& hit,
-                               Vector<T, 3> dir_in,
-                               std::size_t depth) const
+    bool sample_lights(const RaycastHit& hit) const
     {
-        Vector<T, 3, true> diffuse = integrate<T, 3>(
-            [=](const Vector<T, 3>& dir_out)
-            {
-                Vector<T, 3> orig = hit.point + 1e-3*dir_out;
-                Vector<T, 3, true> brdf_value = internal::eval_bxdf(
-                    hit.bxdf, hit.normal, -dir_in, dir_out);
-                Vector<T, 3, true> radiance = trace(scene, orig, dir_out, depth+1);
-                double cos_theta = dot(hit.normal, dir_out);
-                return brdf_value * radiance * cos_theta;
-            },
-            [=]()
-            {
-                return internal::sample_bxdf(hit.bxdf, hit.normal, -dir_in);
-            },
-            1,
-            false
-        );
-        Vector<T, 3, true> emission = internal::emission(hit.emitter);
-        return emission + diffuse;
+        return m_sample_lights && !hit.bxdf->delta();
     }
 
+    // MIS weight of the emission at `hit`, for a ray scattered from `from`
+    // with pdf `pdf` (zero if lights were not sampled there).
+    double emission_weight(const SceneT& scene,
+                           const RaycastHit& hit,
+                           const Vector<T, 3>& from,
+                           double pdf) const
+    {
+        return internal::emission_weight<T>(
+            scene, hit.shape, from, hit.point, hit.normal, pdf);
+    }
+
+    Vector<T, 3> trace_detached(const SceneT& scene,
+                                Vector<T, 3> orig,
+                                Vector<T, 3> dir,
+                                Sampler& sampler,
+                                std::size_t depth,
+                                Vector<T, 3> from,
+                                double from_pdf) const;
+
     double m_absorb;
     std::size_t m_min_bounces;
+    bool m_sample_lights;
 };
 
-template <typename T>
-Vector<T, 3, true> Pathtracer<T>::trace(const Scene<T>& scene,
+template <typename T, typename SceneT>
+Vector<T, 3, true> Pathtracer<T, SceneT>::trace(const SceneT& scene,
                                         Vector<T, 3> orig,
                                         Vector<T, 3> dir,
+                                        Sampler& sampler,
                                         std::size_t depth) const
+{
+    Vector<T, 3, true> radiance(Vector<T, 3>(0));
+    Vector<T, 3, true> throughput(Vector<T, 3>(1));
+    // Vertex the ray was scattered from, and the pdf of its direction
+    Vector<T, 3> from = orig;
+    double from_pdf = 0;
+    for (;; ++depth) {
+        internal::seek(sampler, depth, internal::roulette_dimension);
+        if (depth >= m_min_bounces && sampler.uniform() < m_absorb)
+            break;
+        if (depth >= m_min_bounces)
+            throughput /= T(1 - m_absorb);
+        RaycastHit hit;
+        if (!raycast(scene, orig, dir, hit))
+            break;
+        radiance += throughput * internal::emission(hit.emitter)
+            * emission_weight(scene, hit, from, from_pdf);
+        if (!hit.bxdf)
+            break;
+        bool nee = sample_lights(hit);
+        internal::seek(sampler, depth, internal::light_dimension);
+        if (nee)
+            radiance += throughput * internal::sample_light<T>(
+                scene, hit.bxdf, hit.point, hit.normal, -dir, sampler);
+        internal::seek(sampler, depth, internal::bxdf_dimension);
+        auto [dir_out, pdf] = internal::sample_bxdf<T>(
+            hit.bxdf, hit.normal, -dir, sampler);
+        Vector<T, 3, true> brdf_value = internal::eval_bxdf<T>(
+            hit.bxdf, hit.normal, -dir, dir_out);
+        T cos_theta = dot(hit.normal, dir_out);
+        throughput *= brdf_value * (cos_theta / pdf);
+        from = hit.point;
+        from_pdf = nee ? pdf : 0;
+        orig = hit.point + 1e-3*dir_out;
+        dir = dir_out;
+    }
+    return radiance;
+}
 
+template <typename T, typename SceneT>
+Vector<T, 3> Pathtracer<T, SceneT>::trace_detached(const SceneT& scene,
+                                           Vector<T, 3> orig,
+                                           Vector<T, 3> dir,
+                                           Sampler& sampler,
+                                           std::size_t depth,
+                                           Vector<T, 3> from,
+                                           double from_pdf) const
 {
-    if (depth >= m_min_bounces && random::uniform() < m_absorb)
-        return Vector<T, 3>(0);
-    double p = depth >= m_min_bounces ? (1 - m_absorb) : 1;
-    RaycastHit hit;
-    if (raycast(scene, orig, dir, hit))
-        return scatter(scene, hit, dir, depth) / p;
-    else
-        return Vector<T, 3>(0);
+    Vector<T, 3> radiance(0);
+    Vector<T, 3> throughput(1);
+    std::size_t mark = Tape::local().size();
+    for (;; ++depth) {
+        internal::seek(sampler, depth, internal::roulette_dimension);
+        if (depth >= m_min_bounces && sampler.uniform() < m_absorb)
+            break;
+        throughput /= depth >= m_min_bounces ? (1 - m_absorb) : 1;
+        RaycastHit hit;
+        if (!raycast(scene, orig, dir, hit))
+            break;
+        radiance += throughput * internal::emission(hit.emitter).detach()
+            * emission_weight(scene, hit, from, from_pdf);
+        if (!hit.bxdf)
+            break;
+        bool nee = sample_lights(hit);
+        internal::seek(sampler, depth, internal::light_dimension);
+        if (nee)
+            radiance += throughput * internal::sample_light<T>(
+                scene, hit.bxdf, hit.point, hit.normal, -dir, sampler).detach();
+        internal::seek(sampler, depth, internal::bxdf_dimension);
+        auto [dir_out, pdf] = internal::sample_bxdf<T>(
+            hit.bxdf, hit.normal, -dir, sampler);
+        Vector<T, 3> brdf_value = internal::eval_bxdf<T>(
+            hit.bxdf, hit.normal, -dir, dir_out).detach();
+        T cos_theta = dot(hit.normal, dir_out);
+        throughput *= brdf_value * cos_theta / pdf;
+        from = hit.point;
+        from_pdf = nee ? pdf : 0;
+        orig = hit.point + 1e-3*dir_out;
+        dir = dir_out;
+        Tape::local().rewind(mark);
+    }
+    Tape::local().rewind(mark);
+    return radiance;
+}
+
+template <typename T, typename SceneT>
+Vector<T, 3> Pathtracer<T, SceneT>::trace_replay(const SceneT& scene,
+                                         Vector<T, 3> orig,
+                                         Vector<T, 3> dir,
+                                         Sampler& sampler,
+                                         const Vector<T, 3>& grad) const
+{
+    Sampler replay = sampler;
+    Vector<T, 3> radiance = trace_detached(
+        scene, orig, dir, replay, 0, orig, 0);
+
+    // Radiance still to be collected from the rest of the path, as seen from
+    // the camera (i.e. already weighted by the path throughput).
+    Vector<T, 3> remaining = radiance;
+    Vector<T, 3> throughput(1);
+    Vector<T, 3> from = orig;
+    double from_pdf = 0;
+    std::size_t mark = Tape::local().size();
+    for (std::size_t depth = 0;; ++depth) {
+        internal::seek(sampler, depth, internal::roulette_dimension);
+        if (depth >= m_min_bounces && sampler.uniform() < m_absorb)
+            break;
+        throughput /= depth >= m_min_bounces ? (1 - m_absorb) : 1;
+        RaycastHit hit;
+        if (!raycast(scene, orig, dir, hit))
+            break;
+        if (hit.emitter) {
+            double mis = emission_weight(scene, hit, from, from_pdf);
+            const Vector<T, 3, true>& emission =
+                internal::emission(hit.emitter);
+            emission.backward(grad * throughput * mis);
+            remaining -= throughput * emission.detach() * mis;
+        }
+        if (!hit.bxdf)
+            break;
+        bool nee = sample_lights(hit);
+        internal::seek(sampler, depth, internal::light_dimension);
+        if (nee) {
+            Vector<T, 3, true> direct = internal::sample_light<T>(
+                scene, hit.bxdf, hit.point, hit.normal, -dir, sampler);
+            direct.backward(grad * throughput);
+            remaining -= throughput * direct.detach();
+        }
+        internal::seek(sampler, depth, internal::bxdf_dimension);
+        auto [dir_out, pdf] = internal::sample_bxdf<T>(
+            hit.bxdf, hit.normal, -dir, sampler);
+        Vector<T, 3, true> brdf_value = internal::eval_bxdf<T>(
+            hit.bxdf, hit.normal, -dir, dir_out);
+        T cos_theta = dot(hit.normal, dir_out);
+        Vector<T, 3> weight = throughput * cos_theta / pdf;
+        Vector<T, 3> next_throughput = weight * brdf_value.detach();
+        from = hit.point;
+        from_pdf = nee ? pdf : 0;
+        orig = hit.point + 1e-3*dir_out;
+        dir = dir_out;
+
+        // The incident radiance is recovered from what remains of the path
+        // estimate, except in channels where the BRDF vanishes; those are
+        // estimated again by tracing the rest of the path a second time.
+        Vector<T, 3> incident(0);
+        bool retrace = false;
+        for (std::size_t i = 0; i < 3; ++i) {
+            if (next_throughput[i] != 0)
+                incident[i] = remaining[i] / next_throughput[i];
+            else if (weight[i] != 0)
+                retrace = true;
+        }
+        if (retrace) {
+            Sampler replay = sampler;
+            Vector<T, 3> suffix = trace_detached(
+                scene, orig, dir, replay, depth+1, from, from_pdf);
+            for (std::size_t i = 0; i < 3; ++i)
+                if (next_throughput[i] == 0)
+                    incident[i] = suffix[i];
+        }
+        brdf_value.backward(grad * weight * incident);
+        throughput = next_throughput;
+        Tape::local().rewind(mark);
+    }
+    Tape::local().rewind(mark);
+    return radiance;
 }
 
 }
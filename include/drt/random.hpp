@@ -1,12 +1,118 @@
 #pragma once
 
-#include <cstdlib>
+#include <array>
+#include <cstddef>
+#include <cstdint>
 
-namespace drt { namespace random {
+namespace drt {
 
-inline double uniform()
+namespace internal {
+
+// Philox4x32-10 block cipher of Salmon et al., "Parallel Random Numbers: As
+// Easy as 1, 2, 3": maps a counter to four random words, given a key.
+inline std::array<std::uint32_t, 4> philox(std::array<std::uint32_t, 4> ctr,
+                                           std::array<std::uint32_t, 2> key)
 {
-    return double(rand()) / RAND_MAX;
+    for (int round = 0; round < 10; ++round) {
+        std::uint64_t p0 = std::uint64_t(0xD2511F53) * ctr[0];
+        std::uint64_t p1 = std::uint64_t(0xCD9E8D57) * ctr[2];
+        ctr = {std::uint32_t(p1 >> 32) ^ ctr[1] ^ key[0],
+               std::uint32_t(p1),
+               std::uint32_t(p0 >> 32) ^ ctr[3] ^ key[1],
+               std::uint32_t(p0)};
+        key[0] += 0x9E3779B9;
+        key[1] += 0xBB67AE85;
+    }
+    return ctr;
 }
 
-} }
+} // namespace internal
+
+// Sequence of sample points, e.g. a low-discrepancy sequence (see
+// sequence.hpp). Samples are a pure function of the seed, the pixel, the
+// sample index and the dimension, so sequences hold no mutable state.
+class Sequence {
+public:
+    virtual ~Sequence() { }
+
+    // Returns a number in [0, 1).
+    virtual double sample(std::uint64_t seed,
+                          std::uint64_t pixel,
+                          std::uint32_t index,
+                          std::uint64_t dimension) const = 0;
+};
+
+// Source of the random numbers of one sample, e.g. of a camera ray and the
+// path it starts. The n-th number drawn (its dimension) is a pure function
+// of the seed, the pixel, the sample index and n: it is taken from
+// `sequence` if given, and otherwise computed with the Philox counter-based
+// generator (i.e. numbers are independent). Samplers thus share no state:
+// threads need no synchronization, results do not depend on the order in
+// which samples are taken, and copying a sampler is enough to replay its
+// sequence. The sequence must outlive the sampler.
+class Sampler {
+public:
+    explicit Sampler(std::uint64_t seed = 0,
+                     const Sequence *sequence = nullptr)
+      : m_seed(seed)
+      , m_key{std::uint32_t(seed), std::uint32_t(seed >> 32)}
+      , m_sequence(sequence)
+    { }
+
+    // Starts the sequence of sample `index` (below 2^32) of `pixel`.
+    void start(std::uint64_t pixel, std::uint64_t index)
+    {
+        m_pixel = pixel;
+        m_index = std::uint32_t(index);
+        m_dimension = 0;
+        m_block = none;
+    }
+
+    std::uint64_t dimension() const
+    {
+        return m_dimension;
+    }
+
+    // Makes `dimension` the next dimension drawn.
+    void seek(std::uint64_t dimension)
+    {
+        m_dimension = dimension;
+    }
+
+    // Returns a uniform number in [0, 1), with 53 random bits, for the next
+    // dimension.
+    double uniform()
+    {
+        if (m_sequence)
+            return m_sequence->sample(
+                m_seed, m_pixel, m_index, m_dimension++);
+        // Every block of output yields two numbers
+        std::uint64_t block = m_dimension / 2;
+        if (block != m_block) {
+            m_words = internal::philox({std::uint32_t(block),
+                                        m_index,
+                                        std::uint32_t(m_pixel),
+                                        std::uint32_t(m_pixel >> 32)},
+                                       m_key);
+            m_block = block;
+        }
+        std::size_t i = 2 * (m_dimension++ % 2);
+        std::uint64_t bits = std::uint64_t(m_words[i]) << 32 | m_words[i+1];
+        return double(bits >> 11) * 0x1p-53;
+    }
+
+private:
+    static constexpr std::uint64_t none = ~std::uint64_t(0);
+
+    std::uint64_t m_seed;
+    std::array<std::uint32_t, 2> m_key;
+    const Sequence *m_sequence;
+    std::uint64_t m_pixel = 0;
+    std::uint32_t m_index = 0;
+    std::uint64_t m_dimension = 0;
+    // Block of output currently held in `m_words`
+    std::uint64_t m_block = none;
+    std::array<std::uint32_t, 4> m_words;
+};
+
+} // namespace drt
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstddef>
+#include <limits>
+#include <vector>
+#include "bvh.hpp"
+#include "dual.hpp"
+#include "shape.hpp"
+#include "vector.hpp"
+
+namespace drt {
+
+// Collection of shapes to be rendered. Bounded shapes are indexed by a BVH
+// once `build` is called, whereas unbounded ones are tested individually.
+// Shapes added after the last call to `build` are still found, but they are
+// tested linearly until the BVH is rebuilt.
+template <typename T>
+class Scene {
+public:
+    void push_back(Shape<T> *shape)
+    {
+        m_shapes.push_back(shape);
+        if (shape->bounds().finite())
+            m_bounded.push_back(shape);
+        else
+            m_unbounded.push_back(shape);
+        if (shape->light())
+            m_lights.push_back(shape);
+    }
+
+    void build()
+    {
+        std::vector<Bounds> bounds;
+        bounds.reserve(m_bounded.size());
+        for (auto shape : m_bounded)
+            bounds.push_back(shape->bounds());
+        m_bvh.build(bounds);
+        m_indexed = m_bounded.size();
+    }
+
+    std::size_t size() const
+    {
+        return m_shapes.size();
+    }
+
+    const std::vector<Shape<T>*>& shapes() const
+    {
+        return m_shapes;
+    }
+
+    // Shapes sampled directly as light sources (see `Shape::light`)
+    const std::vector<Shape<T>*>& lights() const
+    {
+        return m_lights;
+    }
+
+    const BVH& bvh() const
+    {
+        return m_bvh;
+    }
+
+    // Returns the closest shape hit by the ray, or null if there is none,
+    // and sets `t` to the distance to the hit point and `prim` to the
+    // primitive of the shape which was hit.
+    Shape<T> *intersect(const Vector<T, 3>& orig,
+                        const Vector<T, 3>& dir,
+                        double& t,
+                        std::size_t& prim) const
+    {
+        Shape<T> *closest = nullptr;
+        double tmin = std::numeric_limits<double>::infinity();
+        auto test = [&](Shape<T> *shape, double& tmax) {
+            double t;
+            std::size_t p;
+            if (!shape->intersect(orig, dir, t, p) || t >= tmax)
+                return false;
+            tmax = t;
+            closest = shape;
+            prim = p;
+            return true;
+        };
+        for (auto shape : m_unbounded)
+            test(shape, tmin);
+        for (std::size_t i = m_indexed; i < m_bounded.size(); ++i)
+            test(m_bounded[i], tmin);
+        Vector<double, 3> o, d;
+        for (std::size_t i = 0; i < 3; ++i) {
+            o[i] = real(orig[i]);
+            d[i] = real(dir[i]);
+        }
+        m_bvh.traverse(o, d, tmin, [&](std::size_t i, double& tmax) {
+            return test(m_bounded[i], tmax);
+        });
+        t = tmin;
+        return closest;
+    }
+
+    // Returns true if any shape is hit by the ray within `(0, tmax)`, which
+    // is cheaper than finding the closest one (e.g. for shadow rays).
+    bool occluded(const Vector<T, 3>& orig,
+                  const Vector<T, 3>& dir,
+                  double tmax) const
+    {
+        for (auto shape : m_unbounded)
+            if (shape->occluded(orig, dir, tmax))
+                return true;
+        for (std::size_t i = m_indexed; i < m_bounded.size(); ++i)
+            if (m_bounded[i]->occluded(orig, dir, tmax))
+                return true;
+        Vector<double, 3> o, d;
+        for (std::size_t i = 0; i < 3; ++i) {
+            o[i] = real(orig[i]);
+            d[i] = real(dir[i]);
+        }
+        return m_bvh.occluded(o, d, tmax, [&](std::size_t i) {
+            return m_bounded[i]->occluded(orig, dir, tmax);
+        });
+    }
+
+    // Normal of `shape` at `point`, where `prim` is as set by `intersect`.
+    Vector<T, 3> normal(const Shape<T> *shape,
+                        const Vector<T, 3>& point,
+                        std::size_t prim) const
+    {
+        return shape->normal(point, prim);
+    }
+
+private:
+    std::vector<Shape<T>*> m_shapes;
+    std::vector<Shape<T>*> m_bounded;
+    std::vector<Shape<T>*> m_unbounded;
+    std::vector<Shape<T>*> m_lights;
+    std::size_t m_indexed = 0;
+    BVH m_bvh;
+};
+
+} // namespace drt
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "random.hpp"
+
+namespace drt {
+
+namespace internal {
+
+// Finalizer of SplitMix64, a cheap bijective hash of 64-bit words
+inline std::uint64_t mix(std::uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EB;
+    return x ^ (x >> 31);
+}
+
+inline std::uint64_t hash(std::uint64_t a, std::uint64_t b)
+{
+    return mix(a ^ mix(b + 0x9E3779B97F4A7C15));
+}
+
+// Maps the top 53 bits of `bits` to [0, 1).
+inline double to_unit(std::uint64_t bits)
+{
+    return double(bits >> 11) * 0x1p-53;
+}
+
+inline std::uint32_t reverse_bits(std::uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00FF00FF) << 8) | ((x & 0xFF00FF00) >> 8);
+    x = ((x & 0x0F0F0F0F) << 4) | ((x & 0xF0F0F0F0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xCCCCCCCC) >> 2);
+    x = ((x & 0x55555555) << 1) | ((x & 0xAAAAAAAA) >> 1);
+    return x;
+}
+
+// Nested uniform (Owen) scrambling of the bits of `x`, most significant
+// first, with the hash-based permutation of Burley [2020] as improved by
+// Vegdahl [2021].
+inline std::uint32_t owen_scramble(std::uint32_t x, std::uint32_t seed)
+{
+    x = reverse_bits(x);
+    x ^= x * 0x3D20ADEA;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526C56;
+    x ^= x * 0x53A22864;
+    return reverse_bits(x);
+}
+
+// Direction numbers of the first four dimensions of the Sobol sequence
+// (with the primitive polynomials and initial numbers of Joe and Kuo).
+inline const std::array<std::array<std::uint32_t, 32>, 4>& sobol_directions()
+{
+    static const auto directions = [] {
+        struct Poly { unsigned degree, coeffs; std::array<std::uint32_t, 3> m; };
+        const Poly polys[3] = {{1, 0, {1}}, {2, 1, {1, 3}}, {3, 1, {1, 3, 1}}};
+        std::array<std::array<std::uint32_t, 32>, 4> v;
+        for (unsigned i = 0; i < 32; ++i)
+            v[0][i] = std::uint32_t(1) << (31 - i);
+        for (std::size_t d = 1; d < 4; ++d) {
+            const Poly& p = polys[d - 1];
+            for (unsigned i = 0; i < 32; ++i) {
+                if (i < p.degree) {
+                    v[d][i] = p.m[i] << (31 - i);
+                    continue;
+                }
+                v[d][i] = v[d][i - p.degree] ^ (v[d][i - p.degree] >> p.degree);
+                for (unsigned k = 1; k < p.degree; ++k)
+                    if ((p.coeffs >> (p.degree - 1 - k)) & 1)
+                        v[d][i] ^= v[d][i - k];
+            }
+        }
+        return v;
+    }();
+    return directions;
+}
+
+// Point `index` of an Owen-scrambled Sobol sequence. Dimensions are taken
+// four at a time from independently shuffled and scrambled copies of the
+// four-dimensional sequence (Burley [2020]), which keeps every group of four
+// well stratified without the quality loss of high Sobol dimensions.
+inline double sobol_owen(std::uint32_t index,
+                         std::uint64_t dimension,
+                         std::uint64_t seed)
+{
+    const auto& directions = sobol_directions()[dimension % 4];
+    std::uint64_t key = hash(seed, dimension / 4);
+    index = owen_scramble(index, std::uint32_t(key));
+    std::uint32_t x = 0;
+    for (std::size_t bit = 0; index; index >>= 1, ++bit)
+        if (index & 1)
+            x ^= directions[bit];
+    x = owen_scramble(x, std::uint32_t(hash(key, dimension % 4)));
+    return x * 0x1p-32;
+}
+
+// Adds `shift` to `u` modulo one (a Cranley-Patterson rotation).
+inline double rotate(double u, double shift)
+{
+    u += shift;
+    return u < 1 ? u : u - 1;
+}
+
+// Blue noise mask of `size` x `size` values in (0, 1), tileable, generated
+// with the void-and-cluster method of Ulichney [1993].
+inline std::vector<double> make_blue_noise(std::size_t size)
+{
+    std::size_t n = size * size;
+    // Toroidal Gaussian measuring how much every pixel is surrounded by
+    // set pixels
+    std::vector<double> kernel(n);
+    for (std::size_t y = 0; y < size; ++y) {
+        for (std::size_t x = 0; x < size; ++x) {
+            double dx = double(std::min(x, size - x));
+            double dy = double(std::min(y, size - y));
+            kernel[y*size + x] = std::exp(-(dx*dx + dy*dy) / (2 * 1.5*1.5));
+        }
+    }
+    std::vector<char> set(n, 0);
+    std::vector<double> energy(n, 0);
+    auto toggle = [&](std::size_t p) {
+        set[p] = !set[p];
+        double sign = set[p] ? 1 : -1;
+        std::size_t px = p % size, py = p / size;
+        for (std::size_t y = 0; y < size; ++y) {
+            const double *row = &kernel[((y + size - py) % size) * size];
+            for (std::size_t x = 0; x < size; ++x)
+                energy[y*size + x] += sign * row[(x + size - px) % size];
+        }
+    };
+    // Set pixel in the tightest cluster, or unset one in the largest void
+    auto extreme = [&](bool cluster) {
+        std::size_t best = n;
+        for (std::size_t p = 0; p < n; ++p)
+            if (bool(set[p]) == cluster && (best == n
+                    || (cluster ? energy[p] > energy[best]
+                                : energy[p] < energy[best])))
+                best = p;
+        return best;
+    };
+
+    // Start from a tenth of the pixels picked at random, and spread them
+    // evenly by moving points from clusters to voids
+    std::size_t initial = n / 10;
+    for (std::uint64_t i = 0, count = 0; count < initial; ++i) {
+        std::size_t p = std::size_t(mix(i) % n);
+        if (!set[p]) {
+            toggle(p);
+            ++count;
+        }
+    }
+    for (std::size_t i = 0; i < n; ++i) {
+        std::size_t cluster = extreme(true);
+        toggle(cluster);
+        std::size_t void_ = extreme(false);
+        toggle(void_);
+        if (void_ == cluster)
+            break;
+    }
+
+    // Rank the initial points by removing clusters first, then the rest by
+    // filling voids first
+    std::vector<std::size_t> rank(n);
+    std::vector<char> initial_set = set;
+    std::vector<double> initial_energy = energy;
+    for (std::size_t r = initial; r-- > 0; ) {
+        std::size_t p = extreme(true);
+        toggle(p);
+        rank[p] = r;
+    }
+    set = initial_set;
+    energy = initial_energy;
+    for (std::size_t r = initial; r < n; ++r) {
+        std::size_t p = extreme(false);
+        toggle(p);
+        rank[p] = r;
+    }
+
+    std::vector<double> mask(n);
+    for (std::size_t p = 0; p < n; ++p)
+        mask[p] = (rank[p] + 0.5) / n;
+    return mask;
+}
+
+} // namespace internal
+
+// Halton sequence (the radical inverses of the sample index in the first
+// prime bases), rotated by a random offset per pixel and dimension. Past the
+// first 256 dimensions, whose bases grow large enough for points to become
+// correlated, samples are independent random numbers.
+class HaltonSequence : public Sequence {
+public:
+    static constexpr std::size_t max_dimensions = 256;
+
+    HaltonSequence()
+    {
+        for (std::uint32_t p = 2; m_primes.size() < max_dimensions; ++p) {
+            bool prime = true;
+            for (std::uint32_t q : m_primes)
+                if (p % q == 0)
+                    prime = false;
+            if (prime)
+                m_primes.push_back(p);
+        }
+    }
+
+    double sample(std::uint64_t seed,
+                  std::uint64_t pixel,
+                  std::uint32_t index,
+                  std::uint64_t dimension) const override
+    {
+        using internal::hash;
+        std::uint64_t key = hash(hash(seed, pixel), dimension);
+        if (dimension >= max_dimensions)
+            return internal::to_unit(hash(key, index));
+        std::uint32_t base = m_primes[dimension];
+        double inv_base = 1. / base;
+        double u = 0;
+        for (double f = inv_base; index; index /= base, f *= inv_base)
+            u += (index % base) * f;
+        return internal::rotate(std::min(u, 0x1.fffffffffffffp-1),
+                                internal::to_unit(key));
+    }
+
+private:
+    std::vector<std::uint32_t> m_primes;
+};
+
+// Sobol sequence with Owen scrambling, scrambled independently for every
+// pixel (see `internal::sobol_owen`). Every group of four dimensions is
+// stratified over the samples of a pixel, for any power-of-two count.
+class SobolSequence : public Sequence {
+public:
+    double sample(std::uint64_t seed,
+                  std::uint64_t pixel,
+                  std::uint32_t index,
+                  std::uint64_t dimension) const override
+    {
+        return internal::sobol_owen(
+            index, dimension, internal::hash(seed, pixel));
+    }
+};
+
+// Scrambled Sobol sequence shared by all pixels, rotated per pixel and
+// dimension by the value of a blue noise mask (Georgiev and Fajardo
+// [2016]). Errors of neighbouring pixels are then negatively correlated,
+// which leaves high-frequency noise that is less visible at low sample
+// counts. Pixels are numbered row by row in images `width` pixels wide.
+class BlueNoiseSequence : public Sequence {
+public:
+    static constexpr std::size_t mask_size = 64;
+
+    explicit BlueNoiseSequence(std::size_t width)
+      : m_width(width)
+      , m_mask(internal::make_blue_noise(mask_size))
+    { }
+
+    double sample(std::uint64_t seed,
+                  std::uint64_t pixel,
+                  std::uint32_t index,
+                  std::uint64_t dimension) const override
+    {
+        // Every dimension uses the mask with a different toroidal offset
+        std::uint64_t offset = internal::hash(seed, dimension);
+        std::size_t x = (pixel % m_width + offset) % mask_size;
+        std::size_t y = (pixel / m_width + (offset >> 32)) % mask_size;
+        return internal::rotate(
+            internal::sobol_owen(index, dimension, seed),
+            m_mask[y*mask_size + x]);
+    }
+
+private:
+    std::size_t m_width;
+    std::vector<double> m_mask;
+};
+
+} // namespace drt
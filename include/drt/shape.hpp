@@ -1,9 +1,16 @@
 #pragma once
 
+#include <algorithm>
 #include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <tuple>
+#include "bvh.hpp"
 #include "bxdf.hpp"
 #include "constants.hpp"
+#include "dual.hpp"
 #include "emitter.hpp"
+#include "random.hpp"
 #include "vector.hpp"
 
 namespace drt {
@@ -17,11 +24,50 @@ public:
 
     virtual ~Shape() { }
 
+    // Only the real part of the distance is computed for dual numbers, i.e.
+    // derivatives of the hit point follow the ray but not the surface.
+    // Shapes made of several primitives (e.g. meshes) report which one was
+    // hit in `prim`, which is then passed back to `normal`.
     virtual bool intersect(Vector<T, 3> orig,
                            Vector<T, 3> dir,
-                           double& t) const = 0;
+                           double& t,
+                           std::size_t& prim) const = 0;
 
-    virtual Vector<T, 3> normal(Vector<T, 3> point) const = 0;
+    virtual Vector<T, 3> normal(Vector<T, 3> point, std::size_t prim) const = 0;
+
+    // Returns true if the ray hits the shape within `(0, tmax)`. Shapes made
+    // of several primitives may return on the first one found.
+    virtual bool occluded(Vector<T, 3> orig,
+                          Vector<T, 3> dir,
+                          double tmax) const
+    {
+        double t;
+        std::size_t prim;
+        return intersect(orig, dir, t, prim) && t < tmax;
+    }
+
+    // Shapes which are not bounded (e.g. planes) are kept out of the BVH.
+    virtual Bounds bounds() const
+    { return Bounds::infinite(); }
+
+    virtual double area() const
+    { return inf; }
+
+    // Samples a point of the surface (and the normal there) for light
+    // sampling from `ref`, and returns it along with its pdf w.r.t. area.
+    // Only shapes of finite area need to support it.
+    virtual std::tuple<Vector<T, 3>, Vector<T, 3>, double> sample_surface(
+        const Vector<T, 3>& ref, Sampler& sampler) const
+    { throw std::runtime_error("Cannot sample the surface of this shape"); }
+
+    // Pdf (w.r.t. area) of `sample_surface(ref, ...)` returning `point`
+    virtual double pdf_surface(const Vector<T, 3>& ref,
+                               const Vector<T, 3>& point) const
+    { return 1 / area(); }
+
+    // Emitting shapes of finite area are sampled directly as lights.
+    bool light() const
+    { return m_emitter && std::isfinite(area()); }
 
     BxDF<T> *bxdf()
     { return m_bxdf.get(); }
@@ -29,6 +75,12 @@ public:
     Emitter<T> *emitter()
     { return m_emitter.get(); }
 
+    const std::shared_ptr<BxDF<T>>& shared_bxdf() const
+    { return m_bxdf; }
+
+    const std::shared_ptr<Emitter<T>>& shared_emitter() const
+    { return m_emitter; }
+
 private:
     std::shared_ptr<BxDF<T>> m_bxdf;
     std::shared_ptr<Emitter<T>> m_emitter;
@@ -48,16 +100,24 @@ public:
 
     bool intersect(Vector<T, 3> orig,
                    Vector<T, 3> dir,
-                   double& t) const override
+                   double& t,
+                   std::size_t& prim) const override
     {
-        double h = dot(orig, m_normal) - m_offset;
-        t = h / dot(dir, -m_normal);
+        prim = 0;
+        double h = real(dot(orig, m_normal)) - m_offset;
+        t = h / real(dot(dir, -m_normal));
         return t > 0;
     }
 
-    Vector<T, 3> normal(Vector<T, 3> point) const override
+    Vector<T, 3> normal(Vector<T, 3> point, std::size_t prim) const override
+    { return m_normal; }
+
+    const Vector<T, 3>& normal() const
     { return m_normal; }
 
+    double offset() const
+    { return m_offset; }
+
 private:
     Vector<T, 3> m_normal;
     double m_offset;
@@ -77,12 +137,14 @@ public:
 
     bool intersect(Vector<T, 3> orig,
                    Vector<T, 3> dir,
-                   double& t) const override
+                   double& t,
+                   std::size_t& prim) const override
     {
+        prim = 0;
         orig -= m_center;
-        double a = 1;
-        double b = 2 * dot(orig, dir);
-        double c = dot(orig, orig) - m_radius*m_radius;
+        double a = real(dot(dir, dir));
+        double b = 2 * real(dot(orig, dir));
+        double c = real(dot(orig, orig)) - m_radius*m_radius;
         double d = b*b - 4*a*c;
         if (d < 0)
             return false;
@@ -102,10 +164,93 @@ public:
         }
     }
 
-    Vector<T, 3> normal(Vector<T, 3> point) const override
+    Vector<T, 3> normal(Vector<T, 3> point, std::size_t prim) const override
     { return normalize(point - m_center); }
 
+    const Vector<T, 3>& center() const
+    { return m_center; }
+
+    double radius() const
+    { return m_radius; }
+
+    Bounds bounds() const override
+    {
+        Vector<double, 3> center;
+        for (std::size_t i = 0; i < 3; ++i)
+            center[i] = real(m_center[i]);
+        return Bounds(center - Vector<double, 3>(m_radius),
+                      center + Vector<double, 3>(m_radius));
+    }
+
+    double area() const override
+    { return 4 * pi * m_radius*m_radius; }
+
+    // Samples the cone of directions from `ref` subtended by the sphere
+    // (Shirley et al. [1996]) unless `ref` is inside.
+    std::tuple<Vector<T, 3>, Vector<T, 3>, double> sample_surface(
+        const Vector<T, 3>& ref, Sampler& sampler) const override
+    {
+        Vector<double, 3> axis;
+        for (std::size_t i = 0; i < 3; ++i)
+            axis[i] = real(m_center[i]) - real(ref[i]);
+        double dist = norm(axis);
+        double sin2_max = m_radius*m_radius / (dist*dist);
+        Vector<double, 3> normal;
+        double pdf;
+        if (sin2_max >= 1) {
+            double z = 1 - 2*sampler.uniform();
+            double r = std::sqrt(std::max(0., 1 - z*z));
+            double phi = 2 * pi * sampler.uniform();
+            normal = Vector<double, 3>{r*std::cos(phi), r*std::sin(phi), z};
+            pdf = 1 / area();
+        } else {
+            double cos_max = std::sqrt(1 - sin2_max);
+            double cos_theta = 1 - sampler.uniform() * (1 - cos_max);
+            double sin2_theta = 1 - cos_theta*cos_theta;
+            double phi = 2 * pi * sampler.uniform();
+            // Angle at the center between the axis and the sampled point
+            double cos_alpha = sin2_theta / std::sqrt(sin2_max)
+                + cos_theta * std::sqrt(std::max(0., 1 - sin2_theta/sin2_max));
+            double sin_alpha = std::sqrt(std::max(0., 1 - cos_alpha*cos_alpha));
+            auto frame = internal::make_frame(Vector<double, 3>(axis / dist));
+            normal = -(sin_alpha*std::cos(phi)*frame[0]
+                       + sin_alpha*std::sin(phi)*frame[1]
+                       + cos_alpha*frame[2]);
+            pdf = cone_pdf(cos_max, axis / dist, normal, dist);
+        }
+        Vector<T, 3> n {normal[0], normal[1], normal[2]};
+        Vector<T, 3> point = m_center + m_radius*n;
+        return std::make_tuple(point, n, pdf);
+    }
+
+    double pdf_surface(const Vector<T, 3>& ref,
+                       const Vector<T, 3>& point) const override
+    {
+        Vector<double, 3> axis, normal;
+        for (std::size_t i = 0; i < 3; ++i) {
+            axis[i] = real(m_center[i]) - real(ref[i]);
+            normal[i] = (real(point[i]) - real(m_center[i])) / m_radius;
+        }
+        double dist = norm(axis);
+        double sin2_max = m_radius*m_radius / (dist*dist);
+        if (sin2_max >= 1)
+            return 1 / area();
+        return cone_pdf(std::sqrt(1 - sin2_max), axis / dist, normal, dist);
+    }
+
 private:
+    // Converts the (uniform) pdf of the cone of directions to area
+    double cone_pdf(double cos_max,
+                    const Vector<double, 3>& axis,
+                    const Vector<double, 3>& normal,
+                    double dist) const
+    {
+        Vector<double, 3> offset = dist*axis + m_radius*normal;
+        double dist2 = dot(offset, offset);
+        double cos_light = std::abs(dot(normal, offset)) / std::sqrt(dist2);
+        return cos_light / (dist2 * 2 * pi * (1 - cos_max));
+    }
+
     Vector<T, 3> m_center;
     double m_radius;
 };
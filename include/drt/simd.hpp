@@ -0,0 +1,432 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <type_traits>
+
+#if !defined(DRT_NO_SIMD) && defined(__SSE2__)
+#define DRT_SIMD 1
+#include <immintrin.h>
+#endif
+
+namespace drt { namespace internal { namespace simd {
+
+// Four-lane packets backing `Vector<float, N>` and `Vector<double, N>` for
+// N = 3 and N = 4. Three-component vectors are padded to four lanes; the
+// value of the padding lane is unspecified and must be ignored by reductions.
+// Defining `DRT_NO_SIMD` (or building for a target without SSE2) falls back
+// to plain scalar loops.
+template <typename T>
+struct Packet;
+
+#ifdef DRT_SIMD
+
+template <>
+struct Packet<float> {
+    Packet(__m128 v)
+      : v(v)
+    { }
+
+    explicit Packet(float s)
+      : v(_mm_set1_ps(s))
+    { }
+
+    static Packet load(const float *p)
+    {
+        return _mm_load_ps(p);
+    }
+
+    void store(float *p) const
+    {
+        _mm_store_ps(p, v);
+    }
+
+    Packet yzx() const
+    {
+        return _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 0, 2, 1));
+    }
+
+    Packet zxy() const
+    {
+        return _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 1, 0, 2));
+    }
+
+    friend Packet operator+(Packet a, Packet b) { return _mm_add_ps(a.v, b.v); }
+    friend Packet operator-(Packet a, Packet b) { return _mm_sub_ps(a.v, b.v); }
+    friend Packet operator*(Packet a, Packet b) { return _mm_mul_ps(a.v, b.v); }
+    friend Packet operator/(Packet a, Packet b) { return _mm_div_ps(a.v, b.v); }
+
+    __m128 v;
+};
+
+namespace internal_sse2 {
+
+inline __m128d yzx_lo(__m128d lo, __m128d hi) { return _mm_shuffle_pd(lo, hi, 1); }
+inline __m128d yzx_hi(__m128d lo, __m128d hi) { return _mm_shuffle_pd(lo, hi, 2); }
+inline __m128d zxy_lo(__m128d lo, __m128d hi) { return _mm_shuffle_pd(hi, lo, 0); }
+inline __m128d zxy_hi(__m128d lo, __m128d hi) { return _mm_shuffle_pd(lo, hi, 3); }
+
+} // namespace internal_sse2
+
+#ifdef __AVX__
+
+template <>
+struct Packet<double> {
+    Packet(__m256d v)
+      : v(v)
+    { }
+
+    explicit Packet(double s)
+      : v(_mm256_set1_pd(s))
+    { }
+
+    static Packet load(const double *p)
+    {
+        return _mm256_load_pd(p);
+    }
+
+    void store(double *p) const
+    {
+        _mm256_store_pd(p, v);
+    }
+
+    Packet yzx() const
+    {
+        using namespace internal_sse2;
+        __m128d lo = _mm256_castpd256_pd128(v);
+        __m128d hi = _mm256_extractf128_pd(v, 1);
+        return _mm256_insertf128_pd(
+            _mm256_castpd128_pd256(yzx_lo(lo, hi)), yzx_hi(lo, hi), 1);
+    }
+
+    Packet zxy() const
+    {
+        using namespace internal_sse2;
+        __m128d lo = _mm256_castpd256_pd128(v);
+        __m128d hi = _mm256_extractf128_pd(v, 1);
+        return _mm256_insertf128_pd(
+            _mm256_castpd128_pd256(zxy_lo(lo, hi)), zxy_hi(lo, hi), 1);
+    }
+
+    friend Packet operator+(Packet a, Packet b) { return _mm256_add_pd(a.v, b.v); }
+    friend Packet operator-(Packet a, Packet b) { return _mm256_sub_pd(a.v, b.v); }
+    friend Packet operator*(Packet a, Packet b) { return _mm256_mul_pd(a.v, b.v); }
+    friend Packet operator/(Packet a, Packet b) { return _mm256_div_pd(a.v, b.v); }
+
+    __m256d v;
+};
+
+#else
+
+template <>
+struct Packet<double> {
+    Packet(__m128d lo, __m128d hi)
+      : lo(lo), hi(hi)
+    { }
+
+    explicit Packet(double s)
+      : lo(_mm_set1_pd(s)), hi(lo)
+    { }
+
+    static Packet load(const double *p)
+    {
+        return Packet(_mm_load_pd(p), _mm_load_pd(p + 2));
+    }
+
+    void store(double *p) const
+    {
+        _mm_store_pd(p, lo);
+        _mm_store_pd(p + 2, hi);
+    }
+
+    Packet yzx() const
+    {
+        using namespace internal_sse2;
+        return Packet(yzx_lo(lo, hi), yzx_hi(lo, hi));
+    }
+
+    Packet zxy() const
+    {
+        using namespace internal_sse2;
+        return Packet(zxy_lo(lo, hi), zxy_hi(lo, hi));
+    }
+
+    friend Packet operator+(Packet a, Packet b)
+    { return Packet(_mm_add_pd(a.lo, b.lo), _mm_add_pd(a.hi, b.hi)); }
+
+    friend Packet operator-(Packet a, Packet b)
+    { return Packet(_mm_sub_pd(a.lo, b.lo), _mm_sub_pd(a.hi, b.hi)); }
+
+    friend Packet operator*(Packet a, Packet b)
+    { return Packet(_mm_mul_pd(a.lo, b.lo), _mm_mul_pd(a.hi, b.hi)); }
+
+    friend Packet operator/(Packet a, Packet b)
+    { return Packet(_mm_div_pd(a.lo, b.lo), _mm_div_pd(a.hi, b.hi)); }
+
+    __m128d lo, hi;
+};
+
+#endif // __AVX__
+
+template <typename T, std::size_t N>
+constexpr bool enabled = (std::is_same_v<T, float> || std::is_same_v<T, double>)
+                         && (N == 3 || N == 4);
+
+#endif // DRT_SIMD
+
+// Lanes of doubles for kernels processing several primitives at once (see
+// batch.hpp), as many as the widest vector registers of the target hold.
+// Loads and stores are unaligned. Comparisons are ordered, i.e. false for
+// NaNs.
+#if defined(DRT_SIMD) && defined(__AVX512F__)
+
+struct Lanes {
+    using Mask = __mmask8;
+    static constexpr std::size_t size = 8;
+
+    Lanes(__m512d v)
+      : v(v)
+    { }
+
+    explicit Lanes(double s)
+      : v(_mm512_set1_pd(s))
+    { }
+
+    static Lanes load(const double *p)
+    {
+        return _mm512_loadu_pd(p);
+    }
+
+    // Lane indices, i.e. 0, 1, 2, ...
+    static Lanes iota()
+    {
+        return _mm512_set_pd(7, 6, 5, 4, 3, 2, 1, 0);
+    }
+
+    void store(double *p) const
+    {
+        _mm512_storeu_pd(p, v);
+    }
+
+    friend Lanes operator+(Lanes a, Lanes b) { return _mm512_add_pd(a.v, b.v); }
+    friend Lanes operator-(Lanes a, Lanes b) { return _mm512_sub_pd(a.v, b.v); }
+    friend Lanes operator*(Lanes a, Lanes b) { return _mm512_mul_pd(a.v, b.v); }
+    friend Lanes operator/(Lanes a, Lanes b) { return _mm512_div_pd(a.v, b.v); }
+
+    friend Mask operator<(Lanes a, Lanes b)
+    { return _mm512_cmp_pd_mask(a.v, b.v, _CMP_LT_OQ); }
+
+    friend Mask operator>(Lanes a, Lanes b)
+    { return _mm512_cmp_pd_mask(a.v, b.v, _CMP_GT_OQ); }
+
+    friend Lanes sqrt(Lanes a) { return _mm512_sqrt_pd(a.v); }
+
+    // Picks `a` in the lanes set in `mask`, and `b` in the others.
+    friend Lanes select(Mask mask, Lanes a, Lanes b)
+    { return _mm512_mask_blend_pd(mask, b.v, a.v); }
+
+    __m512d v;
+};
+
+inline bool any(Lanes::Mask mask)
+{
+    return mask != 0;
+}
+
+#elif defined(DRT_SIMD) && defined(__AVX__)
+
+struct LaneMask {
+    LaneMask(__m256d v)
+      : v(v)
+    { }
+
+    friend LaneMask operator&(LaneMask a, LaneMask b)
+    { return _mm256_and_pd(a.v, b.v); }
+
+    friend LaneMask operator|(LaneMask a, LaneMask b)
+    { return _mm256_or_pd(a.v, b.v); }
+
+    __m256d v;
+};
+
+struct Lanes {
+    using Mask = LaneMask;
+    static constexpr std::size_t size = 4;
+
+    Lanes(__m256d v)
+      : v(v)
+    { }
+
+    explicit Lanes(double s)
+      : v(_mm256_set1_pd(s))
+    { }
+
+    static Lanes load(const double *p)
+    {
+        return _mm256_loadu_pd(p);
+    }
+
+    static Lanes iota()
+    {
+        return _mm256_set_pd(3, 2, 1, 0);
+    }
+
+    void store(double *p) const
+    {
+        _mm256_storeu_pd(p, v);
+    }
+
+    friend Lanes operator+(Lanes a, Lanes b) { return _mm256_add_pd(a.v, b.v); }
+    friend Lanes operator-(Lanes a, Lanes b) { return _mm256_sub_pd(a.v, b.v); }
+    friend Lanes operator*(Lanes a, Lanes b) { return _mm256_mul_pd(a.v, b.v); }
+    friend Lanes operator/(Lanes a, Lanes b) { return _mm256_div_pd(a.v, b.v); }
+
+    friend Mask operator<(Lanes a, Lanes b)
+    { return _mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ); }
+
+    friend Mask operator>(Lanes a, Lanes b)
+    { return _mm256_cmp_pd(a.v, b.v, _CMP_GT_OQ); }
+
+    friend Lanes sqrt(Lanes a) { return _mm256_sqrt_pd(a.v); }
+
+    friend Lanes select(Mask mask, Lanes a, Lanes b)
+    { return _mm256_blendv_pd(b.v, a.v, mask.v); }
+
+    __m256d v;
+};
+
+inline bool any(LaneMask mask)
+{
+    return _mm256_movemask_pd(mask.v) != 0;
+}
+
+#elif defined(DRT_SIMD)
+
+struct LaneMask {
+    LaneMask(__m128d v)
+      : v(v)
+    { }
+
+    friend LaneMask operator&(LaneMask a, LaneMask b)
+    { return _mm_and_pd(a.v, b.v); }
+
+    friend LaneMask operator|(LaneMask a, LaneMask b)
+    { return _mm_or_pd(a.v, b.v); }
+
+    __m128d v;
+};
+
+struct Lanes {
+    using Mask = LaneMask;
+    static constexpr std::size_t size = 2;
+
+    Lanes(__m128d v)
+      : v(v)
+    { }
+
+    explicit Lanes(double s)
+      : v(_mm_set1_pd(s))
+    { }
+
+    static Lanes load(const double *p)
+    {
+        return _mm_loadu_pd(p);
+    }
+
+    static Lanes iota()
+    {
+        return _mm_set_pd(1, 0);
+    }
+
+    void store(double *p) const
+    {
+        _mm_storeu_pd(p, v);
+    }
+
+    friend Lanes operator+(Lanes a, Lanes b) { return _mm_add_pd(a.v, b.v); }
+    friend Lanes operator-(Lanes a, Lanes b) { return _mm_sub_pd(a.v, b.v); }
+    friend Lanes operator*(Lanes a, Lanes b) { return _mm_mul_pd(a.v, b.v); }
+    friend Lanes operator/(Lanes a, Lanes b) { return _mm_div_pd(a.v, b.v); }
+
+    friend Mask operator<(Lanes a, Lanes b) { return _mm_cmplt_pd(a.v, b.v); }
+    friend Mask operator>(Lanes a, Lanes b) { return _mm_cmpgt_pd(a.v, b.v); }
+
+    friend Lanes sqrt(Lanes a) { return _mm_sqrt_pd(a.v); }
+
+    friend Lanes select(Mask mask, Lanes a, Lanes b)
+    {
+        return _mm_or_pd(_mm_and_pd(mask.v, a.v),
+                         _mm_andnot_pd(mask.v, b.v));
+    }
+
+    __m128d v;
+};
+
+inline bool any(LaneMask mask)
+{
+    return _mm_movemask_pd(mask.v) != 0;
+}
+
+#else
+
+struct Lanes {
+    using Mask = bool;
+    static constexpr std::size_t size = 1;
+
+    explicit Lanes(double s)
+      : v(s)
+    { }
+
+    static Lanes load(const double *p)
+    {
+        return Lanes(*p);
+    }
+
+    static Lanes iota()
+    {
+        return Lanes(0);
+    }
+
+    void store(double *p) const
+    {
+        *p = v;
+    }
+
+    friend Lanes operator+(Lanes a, Lanes b) { return Lanes(a.v + b.v); }
+    friend Lanes operator-(Lanes a, Lanes b) { return Lanes(a.v - b.v); }
+    friend Lanes operator*(Lanes a, Lanes b) { return Lanes(a.v * b.v); }
+    friend Lanes operator/(Lanes a, Lanes b) { return Lanes(a.v / b.v); }
+
+    friend Mask operator<(Lanes a, Lanes b) { return a.v < b.v; }
+    friend Mask operator>(Lanes a, Lanes b) { return a.v > b.v; }
+
+    friend Lanes sqrt(Lanes a) { return Lanes(std::sqrt(a.v)); }
+
+    friend Lanes select(Mask mask, Lanes a, Lanes b)
+    { return mask ? a : b; }
+
+    double v;
+};
+
+inline bool any(bool mask)
+{
+    return mask;
+}
+
+#endif
+
+#ifndef DRT_SIMD
+
+template <typename T, std::size_t N>
+constexpr bool enabled = false;
+
+#endif // DRT_SIMD
+
+// Number of scalars actually stored by a `Vector<T, N>`, and their alignment.
+template <typename T, std::size_t N>
+constexpr std::size_t width = enabled<T, N> ? 4 : N;
+
+template <typename T, std::size_t N>
+constexpr std::size_t align = enabled<T, N> ? 4 * sizeof(T) : alignof(T);
+
+} } } // namespace drt::internal::simd
@@ -0,0 +1,290 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+#include "batch.hpp"
+#include "bvh.hpp"
+#include "dual.hpp"
+#include "shape.hpp"
+#include "vector.hpp"
+
+namespace drt {
+
+namespace internal {
+
+struct NoBatch { };
+
+// Structure of arrays in which the geometry of shapes of type `S` is
+// intersected in batches, if any.
+template <typename S>
+struct BatchOf {
+    using type = NoBatch;
+};
+
+template <typename T>
+struct BatchOf<Sphere<T>> {
+    using type = SphereBatch<T>;
+};
+
+template <typename T>
+struct BatchOf<Plane<T>> {
+    using type = PlaneBatch<T>;
+};
+
+// Shapes of a single type, along with the BVH indexing the bounded ones.
+// For batched types, the bounded shapes are also copied into a batch in
+// BVH leaf order, so that every leaf is a contiguous range of it.
+template <typename S>
+struct ShapeGroup {
+    using Batch = typename BatchOf<S>::type;
+    static constexpr bool batched = !std::is_same_v<Batch, NoBatch>;
+
+    std::vector<S> shapes;
+    std::vector<std::uint32_t> bounded;
+    std::vector<std::uint32_t> unbounded;
+    BVH bvh;
+    Batch bounded_batch;
+    Batch unbounded_batch;
+
+    bool contains(const void *shape) const
+    {
+        std::less<const void*> less;
+        return !shapes.empty()
+            && !less(shape, shapes.data())
+            && less(shape, shapes.data() + shapes.size());
+    }
+};
+
+} // namespace internal
+
+// Scene whose shapes belong to a closed set of types, known at compile time.
+// Shapes are stored by value, grouped by type, and every group is indexed by
+// a BVH of its own. Since the type of the shapes is known while traversing
+// a group, intersection and normal queries are dispatched statically (and
+// can be inlined) rather than through the virtual functions of `Shape`.
+//
+// Shapes are copied into the scene, which must be built before rendering;
+// adding shapes afterwards invalidates the pointers it hands out.
+template <typename T, typename... Shapes>
+class StaticScene {
+    static_assert((std::is_base_of_v<Shape<T>, Shapes> && ...),
+                  "scene shapes must derive from Shape<T>");
+
+public:
+    template <typename S>
+    void push_back(S shape)
+    {
+        std::get<internal::ShapeGroup<S>>(m_groups).shapes.push_back(
+            std::move(shape));
+        m_built = false;
+    }
+
+    void build()
+    {
+        m_shapes.clear();
+        m_lights.clear();
+        std::apply([this](auto&... group) { (build(group), ...); }, m_groups);
+        m_built = true;
+    }
+
+    std::size_t size() const
+    {
+        return m_shapes.size();
+    }
+
+    const std::vector<Shape<T>*>& shapes() const
+    {
+        return m_shapes;
+    }
+
+    const std::vector<Shape<T>*>& lights() const
+    {
+        return m_lights;
+    }
+
+    // Same as `Scene::intersect`.
+    Shape<T> *intersect(const Vector<T, 3>& orig,
+                        const Vector<T, 3>& dir,
+                        double& t,
+                        std::size_t& prim) const
+    {
+        if (!m_built)
+            throw std::runtime_error("StaticScene used before being built");
+        Shape<T> *closest = nullptr;
+        double tmin = std::numeric_limits<double>::infinity();
+        Vector<double, 3> o, d;
+        for (std::size_t i = 0; i < 3; ++i) {
+            o[i] = real(orig[i]);
+            d[i] = real(dir[i]);
+        }
+        std::apply([&](const auto&... group) {
+            (intersect(group, orig, dir, o, d, tmin, prim, closest), ...);
+        }, m_groups);
+        t = tmin;
+        return closest;
+    }
+
+    // Same as `Scene::occluded`.
+    bool occluded(const Vector<T, 3>& orig,
+                  const Vector<T, 3>& dir,
+                  double tmax) const
+    {
+        if (!m_built)
+            throw std::runtime_error("StaticScene used before being built");
+        Vector<double, 3> o, d;
+        for (std::size_t i = 0; i < 3; ++i) {
+            o[i] = real(orig[i]);
+            d[i] = real(dir[i]);
+        }
+        return std::apply([&](const auto&... group) {
+            return (occluded(group, orig, dir, o, d, tmax) || ...);
+        }, m_groups);
+    }
+
+    // Normal of `shape` (which must belong to the scene) at `point`.
+    Vector<T, 3> normal(const Shape<T> *shape,
+                        const Vector<T, 3>& point,
+                        std::size_t prim) const
+    {
+        Vector<T, 3> n;
+        std::apply([&](const auto&... group) {
+            (void)(normal(group, shape, point, prim, n) || ...);
+        }, m_groups);
+        return n;
+    }
+
+private:
+    template <typename S>
+    void build(internal::ShapeGroup<S>& group)
+    {
+        group.bounded.clear();
+        group.unbounded.clear();
+        std::vector<Bounds> bounds;
+        for (std::size_t i = 0; i < group.shapes.size(); ++i) {
+            S& shape = group.shapes[i];
+            m_shapes.push_back(&shape);
+            if (shape.light())
+                m_lights.push_back(&shape);
+            Bounds b = shape.S::bounds();
+            if (b.finite()) {
+                group.bounded.push_back(std::uint32_t(i));
+                bounds.push_back(b);
+            } else {
+                group.unbounded.push_back(std::uint32_t(i));
+            }
+        }
+        group.bvh.build(bounds);
+        if constexpr (internal::ShapeGroup<S>::batched) {
+            group.bounded_batch.clear();
+            const std::uint32_t *indices = group.bvh.indices();
+            for (std::size_t i = 0; i < group.bvh.size(); ++i)
+                group.bounded_batch.push_back(
+                    group.shapes[group.bounded[indices[i]]]);
+            group.unbounded_batch.clear();
+            for (std::uint32_t i : group.unbounded)
+                group.unbounded_batch.push_back(group.shapes[i]);
+        }
+    }
+
+    template <typename S>
+    static void intersect(const internal::ShapeGroup<S>& group,
+                          const Vector<T, 3>& orig,
+                          const Vector<T, 3>& dir,
+                          const Vector<double, 3>& o,
+                          const Vector<double, 3>& d,
+                          double& tmin,
+                          std::size_t& prim,
+                          Shape<T> *& closest)
+    {
+        if constexpr (internal::ShapeGroup<S>::batched) {
+            auto found = [&](std::uint32_t i) {
+                closest = const_cast<S*>(&group.shapes[i]);
+                prim = 0;
+            };
+            std::size_t j = 0;
+            const auto& unbounded = group.unbounded_batch;
+            if (unbounded.intersect(o, d, 0, unbounded.size(), tmin, j))
+                found(group.unbounded[j]);
+            group.bvh.traverse_leaves(o, d, tmin,
+                [&](std::size_t first, std::size_t count, double& tmax) {
+                    if (!group.bounded_batch.intersect(
+                            o, d, first, first + count, tmax, j))
+                        return false;
+                    found(group.bounded[group.bvh.indices()[j]]);
+                    return true;
+                });
+            return;
+        }
+        auto test = [&](std::size_t i, double& tmax) {
+            const S& shape = group.shapes[i];
+            double t;
+            std::size_t p;
+            if (!shape.S::intersect(orig, dir, t, p) || t >= tmax)
+                return false;
+            tmax = t;
+            closest = const_cast<S*>(&shape);
+            prim = p;
+            return true;
+        };
+        for (std::uint32_t i : group.unbounded)
+            test(i, tmin);
+        group.bvh.traverse(o, d, tmin, [&](std::size_t i, double& tmax) {
+            return test(group.bounded[i], tmax);
+        });
+    }
+
+    template <typename S>
+    static bool occluded(const internal::ShapeGroup<S>& group,
+                         const Vector<T, 3>& orig,
+                         const Vector<T, 3>& dir,
+                         const Vector<double, 3>& o,
+                         const Vector<double, 3>& d,
+                         double tmax)
+    {
+        if constexpr (internal::ShapeGroup<S>::batched) {
+            const auto& unbounded = group.unbounded_batch;
+            if (unbounded.occluded(o, d, 0, unbounded.size(), tmax))
+                return true;
+            return group.bvh.occluded_leaves(o, d, tmax,
+                [&](std::size_t first, std::size_t count) {
+                    return group.bounded_batch.occluded(
+                        o, d, first, first + count, tmax);
+                });
+        }
+        auto test = [&](std::size_t i) {
+            return group.shapes[i].S::occluded(orig, dir, tmax);
+        };
+        for (std::uint32_t i : group.unbounded)
+            if (test(i))
+                return true;
+        return group.bvh.occluded(o, d, tmax, [&](std::size_t i) {
+            return test(group.bounded[i]);
+        });
+    }
+
+    template <typename S>
+    static bool normal(const internal::ShapeGroup<S>& group,
+                       const Shape<T> *shape,
+                       const Vector<T, 3>& point,
+                       std::size_t prim,
+                       Vector<T, 3>& n)
+    {
+        if (!group.contains(shape))
+            return false;
+        n = static_cast<const S*>(shape)->S::normal(point, prim);
+        return true;
+    }
+
+    std::tuple<internal::ShapeGroup<Shapes>...> m_groups;
+    std::vector<Shape<T>*> m_shapes;
+    std::vector<Shape<T>*> m_lights;
+    bool m_built = false;
+};
+
+} // namespace drt
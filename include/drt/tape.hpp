@@ -0,0 +1,205 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace drt {
+
+class Tape;
+
+namespace internal {
+
+class TapeNode {
+public:
+    virtual void propagate() = 0;
+
+protected:
+    ~TapeNode() = default;
+
+    bool scheduled() const
+    {
+        return m_pending;
+    }
+
+private:
+    friend class drt::Tape;
+
+    std::size_t m_index;
+    bool m_pending = false;
+};
+
+} // namespace internal
+
+// Per-thread arena holding the nodes recorded by autograd operations. Nodes
+// are bump-allocated in contiguous chunks and released all at once by
+// `clear`, which is expected to be called once per sample (or per pixel).
+// Any non-variable `Vector<T, N, true>` recorded since the last call to
+// `clear` is invalidated by it.
+//
+// Since nodes are recorded in creation order the tape is also a topological
+// order of the graph, so `backward` visits each pending node exactly once by
+// walking it in reverse instead of recursing through the graph.
+class Tape {
+public:
+    Tape() = default;
+
+    Tape(const Tape&) = delete;
+
+    Tape& operator=(const Tape&) = delete;
+
+    ~Tape()
+    {
+        clear();
+        for (auto& chunk : m_chunks)
+            ::operator delete(chunk.data, std::align_val_t(chunk_align));
+    }
+
+    static Tape& local()
+    {
+        static thread_local Tape tape;
+        return tape;
+    }
+
+    template <typename Node, typename... Args>
+    Node *emplace(Args&&... args)
+    {
+        static_assert(std::is_base_of_v<internal::TapeNode, Node>,
+                      "recorded nodes must derive from `TapeNode`");
+        static_assert(alignof(Node) <= chunk_align,
+                      "over-aligned node type cannot be recorded");
+        void *ptr = allocate(sizeof(Node), alignof(Node));
+        Node *node = new (ptr) Node(std::forward<Args>(args)...);
+        if constexpr (!std::is_trivially_destructible_v<Node>)
+            m_dtors.push_back({node, [](void *p) {
+                static_cast<Node*>(p)->~Node();
+            }, m_nodes.size()});
+        internal::TapeNode *base = node;
+        base->m_index = m_nodes.size();
+        m_nodes.push_back(base);
+        return node;
+    }
+
+    std::size_t size() const
+    {
+        return m_nodes.size();
+    }
+
+    // Marks a node as having a non-zero adjoint waiting to be propagated.
+    void schedule(internal::TapeNode *node)
+    {
+        node->m_pending = true;
+        m_lowest = std::min(m_lowest, node->m_index);
+    }
+
+    // Propagates every pending adjoint recorded up to (and including) `root`
+    // to its operands. A call made while propagating a node (e.g. by a custom
+    // backward function) only walks the nodes recorded after that node, such
+    // as those of a function evaluated in the backward pass: older pending
+    // nodes, `root` included, are left to the outer walk, which reaches them
+    // afterwards and has yet to collect all their adjoints.
+    void backward(internal::TapeNode *root)
+    {
+        bool nested = m_walking;
+        std::size_t outer = m_position;
+        std::size_t end = nested ? outer + 1 : 0;
+        m_walking = true;
+        for (std::size_t i = root->m_index + 1;
+             i-- > std::max(m_lowest, end); ) {
+            internal::TapeNode *node = m_nodes[i];
+            if (!node->m_pending)
+                continue;
+            node->m_pending = false;
+            m_position = i;
+            node->propagate();
+        }
+        m_position = outer;
+        if (!nested) {
+            m_walking = false;
+            m_lowest = none;
+        }
+    }
+
+    // Releases every node recorded after the first `size` ones.
+    void rewind(std::size_t size)
+    {
+        if (size >= m_nodes.size())
+            return;
+        while (!m_dtors.empty() && m_dtors.back().index >= size) {
+            m_dtors.back().destroy(m_dtors.back().ptr);
+            m_dtors.pop_back();
+        }
+        auto *first = reinterpret_cast<unsigned char*>(
+            dynamic_cast<void*>(m_nodes[size]));
+        for (m_chunk = 0; m_chunk < m_chunks.size(); ++m_chunk) {
+            const Chunk& chunk = m_chunks[m_chunk];
+            if (first >= chunk.data && first < chunk.data + chunk.size)
+                break;
+        }
+        m_offset = first - m_chunks[m_chunk].data;
+        m_nodes.resize(size);
+        m_lowest = none;
+    }
+
+    void clear()
+    {
+        for (auto it = m_dtors.rbegin(); it != m_dtors.rend(); ++it)
+            it->destroy(it->ptr);
+        m_dtors.clear();
+        m_nodes.clear();
+        m_lowest = none;
+        m_walking = false;
+        m_chunk = 0;
+        m_offset = 0;
+    }
+
+private:
+    static constexpr std::size_t chunk_size = 64 * 1024;
+    static constexpr std::size_t chunk_align = 64;
+    static constexpr std::size_t none = std::numeric_limits<std::size_t>::max();
+
+    struct Chunk {
+        unsigned char *data;
+        std::size_t size;
+    };
+
+    struct Dtor {
+        void *ptr;
+        void (*destroy)(void *);
+        std::size_t index;
+    };
+
+    void *allocate(std::size_t size, std::size_t align)
+    {
+        for (; m_chunk < m_chunks.size(); ++m_chunk, m_offset = 0) {
+            const Chunk& chunk = m_chunks[m_chunk];
+            std::size_t offset = (m_offset + align - 1) & ~(align - 1);
+            if (offset + size <= chunk.size) {
+                m_offset = offset + size;
+                return chunk.data + offset;
+            }
+        }
+        std::size_t n = std::max(chunk_size, size);
+        void *data = ::operator new(n, std::align_val_t(chunk_align));
+        m_chunks.push_back({static_cast<unsigned char*>(data), n});
+        m_offset = size;
+        return data;
+    }
+
+    std::vector<Chunk> m_chunks;
+    std::vector<Dtor> m_dtors;
+    std::vector<internal::TapeNode*> m_nodes;
+    std::size_t m_lowest = none;
+    // Whether `backward` is running, and the index of the node it is
+    // propagating
+    bool m_walking = false;
+    std::size_t m_position = 0;
+    std::size_t m_chunk = 0;
+    std::size_t m_offset = 0;
+};
+
+} // namespace drt
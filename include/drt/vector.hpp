@@ -3,29 +3,83 @@
 #include <cstddef>
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <initializer_list>
 #include <iostream>
 #include <memory>
-#include <numeric>
+#include <stdexcept>
 #include <typeinfo>
 #include <type_traits>
+#include "gradient.hpp"
+#include "simd.hpp"
+#include "tape.hpp"
 
 namespace drt {
 
 template <typename T, std::size_t N, bool Autograd = false>
 class Vector;
 
+// Base class of every vector-valued expression, including vectors themselves.
+// Arithmetic between expressions is evaluated lazily: operators only build a
+// description of the computation, which is evaluated component-wise in a
+// single loop once it is assigned to a vector. When the expression involves
+// vectors with autograd enabled, the whole expression is recorded as a single
+// node whose backward function differentiates through it in one step.
+template <typename E, typename T, std::size_t N>
+class VectorExpr {
+public:
+    const E& derived() const
+    {
+        return static_cast<const E&>(*this);
+    }
+};
+
+namespace internal {
+
+template <typename T, std::size_t N>
+struct Constant;
+
+template <typename T, std::size_t N>
+struct Operand;
+
+template <typename T, std::size_t N>
+inline Constant<T, N> capture(const Vector<T, N>& v);
+
 template <typename T, std::size_t N>
-class Vector<T, N> {
+inline Operand<T, N> capture(const Vector<T, N, true>& v);
+
+template <typename E>
+inline const E& capture(const E& e);
+
+template <typename E>
+using capture_t = std::decay_t<decltype(capture(std::declval<const E&>()))>;
+
+template <typename T, std::size_t N>
+struct Uniform;
+
+struct Assign;
+struct Add;
+struct Sub;
+struct Mul;
+struct Div;
+
+} // namespace internal
+
+template <typename T, std::size_t N>
+class Vector<T, N> : public VectorExpr<Vector<T, N>, T, N> {
 public:
-    using iterator = typename std::array<T, N>::iterator;
-    using const_iterator = typename std::array<T, N>::const_iterator;
+    using iterator = T*;
+    using const_iterator = const T*;
 
-    Vector() = default;
+    Vector()
+    {
+        clear_padding();
+    }
 
     explicit Vector(T value)
     {
         m_data.fill(value);
+        clear_padding();
     }
 
     Vector(std::initializer_list<T> init)
@@ -34,6 +88,14 @@ public:
             throw std::runtime_error(
                 "incorrect number of initializers for `Vector`");
         std::copy(init.begin(), init.end(), begin());
+        clear_padding();
+    }
+
+    template <typename E, typename = std::enable_if_t<
+        !internal::capture_t<E>::autograd>>
+    Vector(const VectorExpr<E, T, N>& expr)
+    {
+        assign(internal::capture(expr.derived()), internal::Assign());
     }
 
     T& operator[](std::size_t pos)
@@ -46,24 +108,34 @@ public:
         return m_data[pos];
     }
 
+    T *data()
+    {
+        return m_data.data();
+    }
+
+    const T *data() const
+    {
+        return m_data.data();
+    }
+
     iterator begin()
     {
-        return m_data.begin();
+        return m_data.data();
     }
 
     const_iterator begin() const
     {
-        return m_data.begin();
+        return m_data.data();
     }
 
     iterator end()
     {
-        return m_data.end();
+        return m_data.data() + N;
     }
 
     const_iterator end() const
     {
-        return m_data.end();
+        return m_data.data() + N;
     }
 
     constexpr std::size_t size() const
@@ -71,151 +143,213 @@ public:
         return N;
     }
 
-    Vector& operator+=(const Vector& rhs)
+    template <typename E>
+    Vector& operator+=(const VectorExpr<E, T, N>& rhs)
     {
-        std::transform(begin(), end(), rhs.begin(), begin(),
-            [](const T& x, const T& y) { return x + y; });
-        return *this;
+        return assign(internal::capture(rhs.derived()), internal::Add());
     }
 
-    Vector& operator-=(const Vector& rhs)
+    template <typename E>
+    Vector& operator-=(const VectorExpr<E, T, N>& rhs)
     {
-        std::transform(begin(), end(), rhs.begin(), begin(),
-            [](T x, T y) { return x - y; });
-        return *this;
+        return assign(internal::capture(rhs.derived()), internal::Sub());
     }
 
-    Vector& operator*=(const Vector& rhs)
+    template <typename E>
+    Vector& operator*=(const VectorExpr<E, T, N>& rhs)
     {
-        std::transform(begin(), end(), rhs.begin(), begin(),
-            [](T x, T y) { return x * y; });
-        return *this;
+        return assign(internal::capture(rhs.derived()), internal::Mul());
     }
 
     Vector& operator*=(T s)
     {
-        std::transform(begin(), end(), begin(),
-            [=](T x) { return x * s; });
-        return *this;
+        return *this *= internal::Uniform<T, N>(s);
     }
 
-    Vector& operator/=(const Vector& rhs)
+    template <typename E>
+    Vector& operator/=(const VectorExpr<E, T, N>& rhs)
     {
-        std::transform(begin(), end(), rhs.begin(), begin(),
-            [](T x, T y) { return x / y; });
-        return *this;
+        return assign(internal::capture(rhs.derived()), internal::Div());
     }
 
     Vector& operator/=(T s)
     {
-        std::transform(begin(), end(), begin(),
-            [=](T x) { return x / s; });
-        return *this;
+        return *this /= internal::Uniform<T, N>(s);
     }
 
 private:
-    std::array<T, N> m_data;
+    static constexpr std::size_t width = internal::simd::width<T, N>;
+
+    void clear_padding()
+    {
+        for (std::size_t i = N; i < width; ++i)
+            m_data[i] = T(0);
+    }
+
+    template <typename E, typename Op>
+    Vector& assign(const E& e, Op)
+    {
+        static_assert(!E::autograd);
+        if constexpr (internal::simd::enabled<T, N>) {
+            using Packet = internal::simd::Packet<T>;
+            Op::apply(Packet::load(data()), e.packet()).store(data());
+        } else {
+            for (std::size_t i = 0; i < N; ++i)
+                m_data[i] = Op::apply(m_data[i], e.eval(i));
+        }
+        return *this;
+    }
+
+    alignas(internal::simd::align<T, N>) std::array<T, width> m_data;
 };
 
 namespace internal {
 
 template <typename T, std::size_t N>
-class AutogradNode : public Vector<T, N> {
+class AutogradNode {
 public:
-    using Vector<T, N>::Vector;
+    virtual void accumulate(const Vector<T, N>& grad) = 0;
 
-    AutogradNode(const Vector<T, N>& v)
-      : Vector<T, N>(v)
-    { }
+    virtual void backward(const Vector<T, N>& grad) = 0;
 
-    virtual ~AutogradNode()
-    { }
+protected:
+    ~AutogradNode() = default;
+};
 
-    virtual Vector<T, N>& grad()
+template <typename T, std::size_t N>
+class VariableNode final
+  : public AutogradNode<T, N>
+  , public std::enable_shared_from_this<VariableNode<T, N>> {
+public:
+    VariableNode(const Vector<T, N>& v)
+      : m_value(v), m_grad(T(0)), m_id(next_id())
     {
-        throw std::runtime_error("Vector has no gradient (not a variable)");
+        if constexpr (std::atomic<T>::is_always_lock_free)
+            for (auto& x : m_shared)
+                x.store(T(0), std::memory_order_relaxed);
     }
 
-    virtual const Vector<T, N>& grad() const
+    std::size_t id() const
     {
-        throw std::runtime_error("Vector has no gradient (not a variable)");
+        return m_id;
     }
 
-    virtual bool requires_grad() const = 0;
-
-    virtual void backward(const Vector<T, N>& grad) const = 0;
-};
-
-template <typename T, std::size_t N>
-class ConstantNode : public AutogradNode<T, N> {
-public:
-    ConstantNode(const Vector<T, N>& v)
-      : AutogradNode<T, N>(v)
-    { }
-
-    bool requires_grad() const override
+    Vector<T, N>& value()
     {
-        return false;
+        return m_value;
     }
 
-    void backward(const Vector<T, N>& grad) const override
-    { }
-};
-
-template <typename T, std::size_t N>
-class VariableNode : public AutogradNode<T, N> {
-public:
-    using AutogradNode<T, N>::AutogradNode;
+    const Vector<T, N>& value() const
+    {
+        return m_value;
+    }
 
-    Vector<T, N>& grad() override
+    Vector<T, N>& grad()
     {
         return m_grad;
     }
 
-    const Vector<T, N>& grad() const override
+    const Vector<T, N>& grad() const
     {
         return m_grad;
     }
 
-    bool requires_grad() const override
+    void accumulate(const Vector<T, N>& grad) override
     {
-        return true;
+        if (auto buffer = GradientBuffer<T, N>::current())
+            buffer->add(*this, grad);
+        else
+            m_grad += grad;
+    }
+
+    void backward(const Vector<T, N>& grad) override
+    {
+        accumulate(grad);
+    }
+
+    void add_atomic(const Vector<T, N>& grad)
+    {
+        if constexpr (std::atomic<T>::is_always_lock_free) {
+            for (std::size_t i = 0; i < N; ++i) {
+                T old = m_shared[i].load(std::memory_order_relaxed);
+                while (!m_shared[i].compare_exchange_weak(
+                    old, old + grad[i], std::memory_order_relaxed))
+                    ;
+            }
+        } else {
+            throw std::runtime_error(
+                "atomic gradients require a lock-free scalar type");
+        }
     }
 
-    void backward(const Vector<T, N>& grad) const override
+    void flush_atomic()
     {
-        m_grad += grad;
+        if constexpr (std::atomic<T>::is_always_lock_free)
+            for (std::size_t i = 0; i < N; ++i)
+                m_grad[i] += m_shared[i].exchange(T(0), std::memory_order_relaxed);
     }
 
 private:
-    mutable Vector<T, N> m_grad;
+    static std::size_t next_id()
+    {
+        static std::atomic<std::size_t> id(0);
+        return id.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Vector<T, N> m_value;
+    Vector<T, N> m_grad;
+    std::array<std::atomic<T>, N> m_shared;
+    std::size_t m_id;
 };
 
 template <typename T, std::size_t N, typename Backward>
-class BackwardNode : public AutogradNode<T, N> {
+class BackwardNode final : public AutogradNode<T, N>, public TapeNode {
 public:
-    BackwardNode(const Vector<T, N>& v, const Backward& backward)
-      : AutogradNode<T, N>(v), m_backward(backward)
+    BackwardNode(const Backward& backward)
+      : m_backward(backward)
     { }
 
-    bool requires_grad() const override
+    void accumulate(const Vector<T, N>& grad) override
+    {
+        if (scheduled()) {
+            m_adjoint += grad;
+        } else {
+            m_adjoint = grad;
+            Tape::local().schedule(this);
+        }
+    }
+
+    void backward(const Vector<T, N>& grad) override
     {
-        return true;
+        accumulate(grad);
+        Tape::local().backward(this);
     }
 
-    void backward(const Vector<T, N>& grad) const override
+    void propagate() override
     {
+        Vector<T, N> grad = m_adjoint;
         m_backward(grad);
     }
 
 private:
+    Vector<T, N> m_adjoint;
     typename std::decay_t<Backward> m_backward;
 };
 
+template <typename T, std::size_t N, typename E>
+struct ExprBackward {
+    void operator()(const Vector<T, N>& grad) const
+    {
+        expr.accumulate(grad);
+    }
+
+    E expr;
+};
+
 } // namespace internal
 
 template <typename T, std::size_t N>
-class Vector<T, N, true> {
+class Vector<T, N, true> : public VectorExpr<Vector<T, N, true>, T, N> {
 public:
     explicit Vector(T value, bool requires_grad = false)
       : Vector(Vector<T, N>(value), requires_grad)
@@ -226,26 +360,45 @@ public:
     { }
 
     Vector(const Vector<T, N>& v, bool requires_grad = false)
+      : m_value(v)
     {
-        if (requires_grad)
-            m_ptr = std::make_shared<internal::VariableNode<T, N>>(v);
-        else
-            m_ptr = std::make_shared<internal::ConstantNode<T, N>>(v);
+        if (requires_grad) {
+            m_var = std::make_shared<internal::VariableNode<T, N>>(v);
+            m_node = m_var.get();
+        }
     }
 
     template <typename Backward>
     Vector(const Vector<T, N>& v, const Backward& backward)
-      : m_ptr(new internal::BackwardNode<T, N, Backward>(v, backward))
+      : m_value(v)
+      , m_node(Tape::local().emplace<
+            internal::BackwardNode<T, N, Backward>>(backward))
     { }
 
+    template <typename E>
+    Vector(const VectorExpr<E, T, N>& expr)
+    {
+        auto e = internal::capture(expr.derived());
+        if constexpr (internal::simd::enabled<T, N>)
+            e.packet().store(m_value.data());
+        else
+            for (std::size_t i = 0; i < N; ++i)
+                m_value[i] = e.eval(i);
+        if (e.requires_grad()) {
+            using Backward = internal::ExprBackward<T, N, decltype(e)>;
+            m_node = Tape::local().emplace<
+                internal::BackwardNode<T, N, Backward>>(Backward{e});
+        }
+    }
+
     T& operator[](std::size_t pos)
     {
-        return (*m_ptr)[pos];
+        return detach()[pos];
     }
 
     const T& operator[](std::size_t pos) const
     {
-        return (*m_ptr)[pos];
+        return detach()[pos];
     }
 
     constexpr std::size_t size() const
@@ -255,45 +408,61 @@ public:
 
     Vector<T, N>& detach()
     {
-        return *m_ptr;
+        return m_var ? m_var->value() : m_value;
     }
 
     const Vector<T, N>& detach() const
     {
-        return *m_ptr;
+        return m_var ? m_var->value() : m_value;
     }
 
     Vector<T, N>& grad()
     {
-        return m_ptr->grad();
+        if (!m_var)
+            throw std::runtime_error("Vector has no gradient (not a variable)");
+        return m_var->grad();
     }
 
     const Vector<T, N>& grad() const
     {
-        return m_ptr->grad();
+        if (!m_var)
+            throw std::runtime_error("Vector has no gradient (not a variable)");
+        return m_var->grad();
     }
 
     bool requires_grad() const
     {
-        return m_ptr->requires_grad();
+        return m_node != nullptr;
+    }
+
+    // Identifies the variable, e.g. in a `GradientBuffer`
+    std::size_t id() const
+    {
+        if (!m_var)
+            throw std::runtime_error("Vector has no id (not a variable)");
+        return m_var->id();
     }
 
     void backward(const Vector<T, N>& grad) const
     {
-        m_ptr->backward(grad);
+        if (m_node)
+            m_node->backward(grad);
     }
 
-    Vector<T, N, true>& operator+=(const Vector<T, N, true>& rhs)
+    template <typename E>
+    Vector<T, N, true>& operator+=(const VectorExpr<E, T, N>& rhs)
     {
         return *this = *this + rhs;
     }
 
-    Vector<T, N, true>& operator-=(const Vector<T, N, true>& rhs)
+    template <typename E>
+    Vector<T, N, true>& operator-=(const VectorExpr<E, T, N>& rhs)
     {
         return *this = *this - rhs;
     }
 
-    Vector<T, N, true>& operator*=(const Vector<T, N, true>& rhs)
+    template <typename E>
+    Vector<T, N, true>& operator*=(const VectorExpr<E, T, N>& rhs)
     {
         return *this = *this * rhs;
     }
@@ -303,7 +472,8 @@ public:
         return *this = *this * s;
     }
 
-    Vector<T, N, true>& operator/=(const Vector<T, N, true>& rhs)
+    template <typename E>
+    Vector<T, N, true>& operator/=(const VectorExpr<E, T, N>& rhs)
     {
         return *this = *this / rhs;
     }
@@ -314,60 +484,12 @@ public:
     }
 
 private:
-    std::shared_ptr<internal::AutogradNode<T, N>> m_ptr;
-};
-
-template <typename T, std::size_t N, bool Ag,
-          typename = typename std::enable_if_t<std::is_convertible_v<int, T>>>
-inline Vector<T, N, Ag> operator-(const Vector<T, N, Ag>& v)
-{
-    return -1 * v;
-}
-
-template <typename T, std::size_t N>
-inline Vector<T, N> operator+(Vector<T, N> lhs, const Vector<T, N>& rhs)
-{
-    return lhs += rhs;
-}
-
-template <typename T, std::size_t N>
-inline Vector<T, N> operator-(Vector<T, N> lhs, const Vector<T, N>& rhs)
-{
-    return lhs -= rhs;
-}
-
-template <typename T, std::size_t N>
-inline Vector<T, N> operator*(Vector<T, N> lhs, const Vector<T, N>& rhs)
-{
-    return lhs *= rhs;
-}
+    friend struct internal::Operand<T, N>;
 
-template <typename T, std::size_t N, typename S,
-          typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
-inline Vector<T, N> operator*(Vector<T, N> v, S s)
-{
-    return v *= s;
-}
-
-template <typename T, std::size_t N, typename S,
-          typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
-inline Vector<T, N> operator*(S s, Vector<T, N> v)
-{
-    return v *= s;
-}
-
-template <typename T, std::size_t N>
-inline Vector<T, N> operator/(Vector<T, N> lhs, const Vector<T, N>& rhs)
-{
-    return lhs /= rhs;
-}
-
-template <typename T, std::size_t N, typename S,
-          typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
-inline Vector<T, N> operator/(Vector<T, N> v, S s)
-{
-    return v /= s;
-}
+    Vector<T, N> m_value;
+    internal::AutogradNode<T, N> *m_node = nullptr;
+    std::shared_ptr<internal::VariableNode<T, N>> m_var;
+};
 
 template <typename T, std::size_t N>
 inline Vector<T, N>& detach(Vector<T, N>& v)
@@ -418,189 +540,389 @@ inline void backward(Vector<T, N, true>& v, const Vector<T, N>& grad)
 namespace internal {
 
 template <typename T, std::size_t N>
-struct AddBackward {
-    void operator()(const Vector<T, N>& grad) const
+struct Constant : public VectorExpr<Constant<T, N>, T, N> {
+    static constexpr bool autograd = false;
+
+    Constant(const Vector<T, N>& v)
+      : value(v)
+    { }
+
+    T eval(std::size_t i) const
     {
-        lhs.backward(grad);
-        rhs.backward(grad);
+        return value[i];
     }
 
-    Vector<T, N, true> lhs, rhs;
-};
+    simd::Packet<T> packet() const
+    {
+        return simd::Packet<T>::load(value.data());
+    }
 
-template <typename T, std::size_t N>
-struct SubBackward {
-    void operator()(const Vector<T, N>& grad) const
+    bool requires_grad() const
     {
-        lhs.backward(grad);
-        rhs.backward(-grad);
+        return false;
     }
 
-    Vector<T, N, true> lhs, rhs;
+    void accumulate(const Vector<T, N>& grad) const
+    { }
+
+    Vector<T, N> value;
 };
 
 template <typename T, std::size_t N>
-struct MulBackward {
-    void operator()(const Vector<T, N>& grad) const
+struct Operand : public VectorExpr<Operand<T, N>, T, N> {
+    static constexpr bool autograd = true;
+
+    Operand(const Vector<T, N, true>& v)
+      : value(v.detach()), node(v.m_node)
+    { }
+
+    T eval(std::size_t i) const
+    {
+        return value[i];
+    }
+
+    simd::Packet<T> packet() const
+    {
+        return simd::Packet<T>::load(value.data());
+    }
+
+    bool requires_grad() const
+    {
+        return node != nullptr;
+    }
+
+    void accumulate(const Vector<T, N>& grad) const
     {
-        lhs.backward(rhs.detach() * grad);
-        rhs.backward(lhs.detach() * grad);
+        if (node)
+            node->accumulate(grad);
     }
 
-    Vector<T, N, true> lhs, rhs;
+    Vector<T, N> value;
+    AutogradNode<T, N> *node;
 };
 
 template <typename T, std::size_t N>
-struct ScalarMulBackward {
-    void operator()(const Vector<T, N>& grad) const
+inline Constant<T, N> capture(const Vector<T, N>& v)
+{
+    return v;
+}
+
+template <typename T, std::size_t N>
+inline Operand<T, N> capture(const Vector<T, N, true>& v)
+{
+    return v;
+}
+
+template <typename E>
+inline const E& capture(const E& e)
+{
+    return e;
+}
+
+template <typename T, std::size_t N>
+struct Uniform : public VectorExpr<Uniform<T, N>, T, N> {
+    static constexpr bool autograd = false;
+
+    Uniform(const T& s)
+      : s(s)
+    { }
+
+    T eval(std::size_t i) const
+    {
+        return s;
+    }
+
+    simd::Packet<T> packet() const
     {
-        v.backward(s * grad);
+        return simd::Packet<T>(s);
     }
 
+    bool requires_grad() const
+    {
+        return false;
+    }
+
+    void accumulate(const Vector<T, N>& grad) const
+    { }
+
     T s;
-    Vector<T, N, true> v;
 };
 
-template <typename T, std::size_t N>
-struct DivBackward {
-    void operator()(const Vector<T, N>& grad) const
+struct Assign {
+    template <typename T>
+    static T apply(const T& a, const T& b) { return b; }
+};
+
+struct Add {
+    template <typename T>
+    static T apply(const T& a, const T& b) { return a + b; }
+
+    template <typename T>
+    static T lhs_grad(const T& g, const T& a, const T& b) { return g; }
+
+    template <typename T>
+    static T rhs_grad(const T& g, const T& a, const T& b) { return g; }
+};
+
+struct Sub {
+    template <typename T>
+    static T apply(const T& a, const T& b) { return a - b; }
+
+    template <typename T>
+    static T lhs_grad(const T& g, const T& a, const T& b) { return g; }
+
+    template <typename T>
+    static T rhs_grad(const T& g, const T& a, const T& b) { return -g; }
+};
+
+struct Mul {
+    template <typename T>
+    static T apply(const T& a, const T& b) { return a * b; }
+
+    template <typename T>
+    static T lhs_grad(const T& g, const T& a, const T& b) { return b * g; }
+
+    template <typename T>
+    static T rhs_grad(const T& g, const T& a, const T& b) { return a * g; }
+};
+
+struct Div {
+    template <typename T>
+    static T apply(const T& a, const T& b) { return a / b; }
+
+    template <typename T>
+    static T lhs_grad(const T& g, const T& a, const T& b) { return g / b; }
+
+    template <typename T>
+    static T rhs_grad(const T& g, const T& a, const T& b) { return -a * g / (b * b); }
+};
+
+template <typename T, std::size_t N, typename Op, typename L, typename R>
+struct Binary : public VectorExpr<Binary<T, N, Op, L, R>, T, N> {
+    static constexpr bool autograd = L::autograd || R::autograd;
+
+    Binary(const L& lhs, const R& rhs)
+      : lhs(lhs), rhs(rhs)
+    { }
+
+    T eval(std::size_t i) const
+    {
+        return Op::apply(lhs.eval(i), rhs.eval(i));
+    }
+
+    simd::Packet<T> packet() const
+    {
+        return Op::apply(lhs.packet(), rhs.packet());
+    }
+
+    bool requires_grad() const
+    {
+        return lhs.requires_grad() || rhs.requires_grad();
+    }
+
+    void accumulate(const Vector<T, N>& grad) const
     {
-        lhs.backward(grad / rhs.detach());
-        rhs.backward(-lhs.detach() * grad / (rhs.detach() * rhs.detach()));
+        if (L::autograd && lhs.requires_grad()) {
+            Vector<T, N> g;
+            for (std::size_t i = 0; i < N; ++i)
+                g[i] = Op::lhs_grad(grad[i], lhs.eval(i), rhs.eval(i));
+            lhs.accumulate(g);
+        }
+        if (R::autograd && rhs.requires_grad()) {
+            Vector<T, N> g;
+            for (std::size_t i = 0; i < N; ++i)
+                g[i] = Op::rhs_grad(grad[i], lhs.eval(i), rhs.eval(i));
+            rhs.accumulate(g);
+        }
     }
 
-    Vector<T, N, true> lhs, rhs;
+    L lhs;
+    R rhs;
 };
 
-template <typename T, std::size_t N>
-struct ScalarDivBackward {
-    void operator()(const Vector<T, N>& grad) const
+template <typename T, std::size_t N, typename Op, typename E>
+struct Scalar : public VectorExpr<Scalar<T, N, Op, E>, T, N> {
+    static constexpr bool autograd = E::autograd;
+
+    Scalar(const E& v, const T& s)
+      : v(v), s(s)
+    { }
+
+    T eval(std::size_t i) const
+    {
+        return Op::apply(v.eval(i), s);
+    }
+
+    simd::Packet<T> packet() const
+    {
+        return Op::apply(v.packet(), simd::Packet<T>(s));
+    }
+
+    bool requires_grad() const
+    {
+        return v.requires_grad();
+    }
+
+    void accumulate(const Vector<T, N>& grad) const
     {
-        v.backward(grad / s);
+        if (E::autograd && v.requires_grad()) {
+            Vector<T, N> g;
+            for (std::size_t i = 0; i < N; ++i)
+                g[i] = Op::lhs_grad(grad[i], v.eval(i), s);
+            v.accumulate(g);
+        }
     }
 
-    Vector<T, N, true> v;
+    E v;
     T s;
 };
 
+template <typename Op, typename L, typename R, typename T, std::size_t N>
+inline auto make_binary(const VectorExpr<L, T, N>& lhs,
+                        const VectorExpr<R, T, N>& rhs)
+{
+    return Binary<T, N, Op, capture_t<L>, capture_t<R>>(
+        capture(lhs.derived()), capture(rhs.derived()));
+}
+
+template <typename Op, typename E, typename T, std::size_t N>
+inline auto make_scalar(const VectorExpr<E, T, N>& v, const T& s)
+{
+    return Scalar<T, N, Op, capture_t<E>>(capture(v.derived()), s);
+}
+
+template <typename T, typename S>
+using enable_if_scalar_t = std::enable_if_t<std::is_convertible_v<S, T>>;
+
 } // namespace internal
 
-template <typename T, std::size_t N, bool Ag1, bool Ag2,
-          typename = typename std::enable_if_t<Ag1 || Ag2>>
-inline Vector<T, N, true> operator+(const Vector<T, N, Ag1>& lhs,
-                                    const Vector<T, N, Ag2>& rhs)
+template <typename E, typename T, std::size_t N>
+inline auto operator-(const VectorExpr<E, T, N>& v)
 {
-    auto r = detach(lhs) + detach(rhs);
-    if (!requires_grad(lhs) && !requires_grad(rhs))
-        return r;
-    return Vector<T, N, true>(r, internal::AddBackward<T, N>{lhs, rhs});
+    return internal::make_scalar<internal::Mul>(v, T(-1));
 }
 
-template <typename T, std::size_t N, bool Ag1, bool Ag2,
-          typename = typename std::enable_if_t<Ag1 || Ag2>>
-inline Vector<T, N, true> operator-(const Vector<T, N, Ag1>& lhs,
-                                    const Vector<T, N, Ag2>& rhs)
+template <typename L, typename R, typename T, std::size_t N>
+inline auto operator+(const VectorExpr<L, T, N>& lhs,
+                      const VectorExpr<R, T, N>& rhs)
 {
-    auto r = detach(lhs) - detach(rhs);
-    if (!requires_grad(lhs) && !requires_grad(rhs))
-        return r;
-    return Vector<T, N, true>(r, internal::SubBackward<T, N>{lhs, rhs});
+    return internal::make_binary<internal::Add>(lhs, rhs);
 }
 
-template <typename T, std::size_t N, bool Ag1, bool Ag2,
-          typename = typename std::enable_if_t<Ag1 || Ag2>>
-inline Vector<T, N, true> operator*(const Vector<T, N, Ag1>& lhs,
-                                    const Vector<T, N, Ag2>& rhs)
+template <typename L, typename R, typename T, std::size_t N>
+inline auto operator-(const VectorExpr<L, T, N>& lhs,
+                      const VectorExpr<R, T, N>& rhs)
 {
-    auto r = detach(lhs) * detach(rhs);
-    if (!requires_grad(lhs) && !requires_grad(rhs))
-        return r;
-    return Vector<T, N, true>(r, internal::MulBackward<T, N>{lhs, rhs});
+    return internal::make_binary<internal::Sub>(lhs, rhs);
 }
 
-template <typename T, std::size_t N, typename S,
-          typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
-inline Vector<T, N, true> operator*(Vector<T, N, true> v, S s)
+template <typename L, typename R, typename T, std::size_t N>
+inline auto operator*(const VectorExpr<L, T, N>& lhs,
+                      const VectorExpr<R, T, N>& rhs)
 {
-    return s * v;
+    return internal::make_binary<internal::Mul>(lhs, rhs);
 }
 
-template <typename T, std::size_t N, typename S,
-          typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
-inline Vector<T, N, true> operator*(S s, Vector<T, N, true> v)
+template <typename E, typename T, std::size_t N, typename S,
+          typename = internal::enable_if_scalar_t<T, S>>
+inline auto operator*(const VectorExpr<E, T, N>& v, S s)
 {
-    auto r = s * v.detach();
-    if (!v.requires_grad())
-        return r;
-    return Vector<T, N, true>(r, internal::ScalarMulBackward<T, N>{s, v});
+    return internal::make_scalar<internal::Mul>(v, T(s));
 }
 
-template <typename T, std::size_t N, bool Ag1, bool Ag2,
-          typename = typename std::enable_if_t<Ag1 || Ag2>>
-inline Vector<T, N, true> operator/(const Vector<T, N, Ag1>& lhs,
-                                    const Vector<T, N, Ag2>& rhs)
+template <typename E, typename T, std::size_t N, typename S,
+          typename = internal::enable_if_scalar_t<T, S>>
+inline auto operator*(S s, const VectorExpr<E, T, N>& v)
 {
-    auto r = detach(lhs) / detach(rhs);
-    if (!requires_grad(lhs) && !requires_grad(rhs))
-        return r;
-    return Vector<T, N, true>(r, internal::DivBackward<T, N>{lhs, rhs});
+    return internal::make_scalar<internal::Mul>(v, T(s));
 }
 
-template <typename T, std::size_t N, typename S,
-          typename = typename std::enable_if_t<std::is_convertible_v<S, T>>>
-inline Vector<T, N, true> operator/(Vector<T, N, true> v, S s)
+template <typename L, typename R, typename T, std::size_t N>
+inline auto operator/(const VectorExpr<L, T, N>& lhs,
+                      const VectorExpr<R, T, N>& rhs)
 {
-    auto r = v.detach() / s;
-    if (!v.requires_grad())
-        return r;
-    return Vector<T, N, true>(r, internal::ScalarDivBackward<T, N>{v, s});
+    return internal::make_binary<internal::Div>(lhs, rhs);
 }
 
-template <typename T, std::size_t N, bool Ag>
-inline std::ostream& operator<<(std::ostream& os, const Vector<T, N, Ag>& v)
+template <typename E, typename T, std::size_t N, typename S,
+          typename = internal::enable_if_scalar_t<T, S>>
+inline auto operator/(const VectorExpr<E, T, N>& v, S s)
 {
+    return internal::make_scalar<internal::Div>(v, T(s));
+}
+
+template <typename E, typename T, std::size_t N>
+inline std::ostream& operator<<(std::ostream& os, const VectorExpr<E, T, N>& v)
+{
+    auto e = internal::capture(v.derived());
     os << "Vector<" << typeid(T).name() << ", " << N;
-    if (Ag)
+    if (decltype(e)::autograd)
         os << ", true";
     os << ">{";
-    for (std::size_t i = 0; i < v.size()-1; ++i)
-        os << v[i] << ", ";
-    if (v.size() > 0)
-        os << v[v.size()-1];
+    for (std::size_t i = 0; i + 1 < N; ++i)
+        os << e.eval(i) << ", ";
+    if (N > 0)
+        os << e.eval(N-1);
     return os << "}";
 }
 
-template <typename T, std::size_t N>
-inline T dot(const Vector<T, N>& lhs, const Vector<T, N>& rhs)
+template <typename L, typename R, typename T, std::size_t N>
+inline T dot(const VectorExpr<L, T, N>& lhs, const VectorExpr<R, T, N>& rhs)
 {
-    Vector<T, N> tmp = lhs * rhs;
-    return std::accumulate(tmp.begin(), tmp.end(), T());
+    auto l = internal::capture(lhs.derived());
+    auto r = internal::capture(rhs.derived());
+    static_assert(!decltype(l)::autograd && !decltype(r)::autograd,
+                  "`dot` is not differentiable; use `detach` first");
+    T result = T();
+    if constexpr (internal::simd::enabled<T, N>) {
+        alignas(internal::simd::align<T, N>) T p[4];
+        (l.packet() * r.packet()).store(p);
+        for (std::size_t i = 0; i < N; ++i)
+            result += p[i];
+    } else {
+        for (std::size_t i = 0; i < N; ++i)
+            result += l.eval(i) * r.eval(i);
+    }
+    return result;
 }
 
-template <typename T, std::size_t N>
-inline T norm(const Vector<T, N>& v)
+template <typename E, typename T, std::size_t N>
+inline T norm(const VectorExpr<E, T, N>& v)
 {
+    using std::sqrt;
     return sqrt(dot(v, v));
 }
 
-template <typename T, std::size_t N>
-inline Vector<T, N> normalize(const Vector<T, N>& v)
+template <typename E, typename T, std::size_t N>
+inline Vector<T, N> normalize(const VectorExpr<E, T, N>& v)
 {
-    return v / norm(v);
+    Vector<T, N> r = v;
+    return r / norm(r);
 }
 
-template <typename T>
-inline Vector<T, 3> cross(const Vector<T, 3>& lhs, const Vector<T, 3>& rhs)
+template <typename L, typename R, typename T>
+inline Vector<T, 3> cross(const VectorExpr<L, T, 3>& lhs,
+                          const VectorExpr<R, T, 3>& rhs)
 {
+    Vector<T, 3> a = lhs;
+    Vector<T, 3> b = rhs;
     Vector<T, 3> r;
-    r[0] = lhs[1]*rhs[2] - lhs[2]*rhs[1];
-    r[1] = lhs[2]*rhs[0] - lhs[0]*rhs[2];
-    r[2] = lhs[0]*rhs[1] - lhs[1]*rhs[0];
+    if constexpr (internal::simd::enabled<T, 3>) {
+        using Packet = internal::simd::Packet<T>;
+        Packet pa = Packet::load(a.data());
+        Packet pb = Packet::load(b.data());
+        (pa.yzx()*pb.zxy() - pa.zxy()*pb.yzx()).store(r.data());
+    } else {
+        r[0] = a[1]*b[2] - a[2]*b[1];
+        r[1] = a[2]*b[0] - a[0]*b[2];
+        r[2] = a[0]*b[1] - a[1]*b[0];
+    }
     return r;
 }
 
-template <typename T, std::size_t N>
-inline Vector<T, N> reflect(const Vector<T, N>& v, const Vector<T, N>& n)
+template <typename L, typename R, typename T, std::size_t N>
+inline Vector<T, N> reflect(const VectorExpr<L, T, N>& v,
+                            const VectorExpr<R, T, N>& n)
 {
     return -v + 2*dot(n, v)*n;
 }
@@ -0,0 +1,358 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "camera.hpp"
+#include "pathtracer.hpp"
+#include "random.hpp"
+#include "scene.hpp"
+#include "tape.hpp"
+#include "vector.hpp"
+
+namespace drt {
+
+// Queue of rays (along with the state of their paths) stored as a structure
+// of arrays.
+template <typename T>
+class RayQueue {
+public:
+    std::size_t size() const
+    {
+        return m_pixel.size();
+    }
+
+    void clear()
+    {
+        for (std::size_t i = 0; i < 3; ++i) {
+            m_orig[i].clear();
+            m_dir[i].clear();
+            m_throughput[i].clear();
+        }
+        m_pixel.clear();
+        m_pdf.clear();
+        m_sampler.clear();
+    }
+
+    void reserve(std::size_t n)
+    {
+        for (std::size_t i = 0; i < 3; ++i) {
+            m_orig[i].reserve(n);
+            m_dir[i].reserve(n);
+            m_throughput[i].reserve(n);
+        }
+        m_pixel.reserve(n);
+        m_pdf.reserve(n);
+        m_sampler.reserve(n);
+    }
+
+    // Adds a ray whose radiance, times `throughput`, goes to pixel `pixel`.
+    // `pdf` is the pdf with which a BxDF sampled the ray, or zero if lights
+    // were not sampled at its origin (e.g. for camera rays). The rest of
+    // the path draws its random numbers from `sampler`.
+    void push(const Vector<T, 3>& orig,
+              const Vector<T, 3>& dir,
+              const Vector<T, 3>& throughput,
+              std::uint32_t pixel,
+              double pdf,
+              const Sampler& sampler)
+    {
+        for (std::size_t i = 0; i < 3; ++i) {
+            m_orig[i].push_back(orig[i]);
+            m_dir[i].push_back(dir[i]);
+            m_throughput[i].push_back(throughput[i]);
+        }
+        m_pixel.push_back(pixel);
+        m_pdf.push_back(pdf);
+        m_sampler.push_back(sampler);
+    }
+
+    Vector<T, 3> orig(std::size_t i) const
+    {
+        return Vector<T, 3>{m_orig[0][i], m_orig[1][i], m_orig[2][i]};
+    }
+
+    Vector<T, 3> dir(std::size_t i) const
+    {
+        return Vector<T, 3>{m_dir[0][i], m_dir[1][i], m_dir[2][i]};
+    }
+
+    Vector<T, 3> throughput(std::size_t i) const
+    {
+        return Vector<T, 3>{
+            m_throughput[0][i], m_throughput[1][i], m_throughput[2][i]};
+    }
+
+    void scale_throughput(std::size_t i, double s)
+    {
+        for (std::size_t c = 0; c < 3; ++c)
+            m_throughput[c][i] *= s;
+    }
+
+    std::uint32_t pixel(std::size_t i) const
+    {
+        return m_pixel[i];
+    }
+
+    double pdf(std::size_t i) const
+    {
+        return m_pdf[i];
+    }
+
+    Sampler& sampler(std::size_t i)
+    {
+        return m_sampler[i];
+    }
+
+    const Sampler& sampler(std::size_t i) const
+    {
+        return m_sampler[i];
+    }
+
+    // Moves ray `from` to slot `to` (`to <= from`), for in-place compaction.
+    void move(std::size_t from, std::size_t to)
+    {
+        for (std::size_t c = 0; c < 3; ++c) {
+            m_orig[c][to] = m_orig[c][from];
+            m_dir[c][to] = m_dir[c][from];
+            m_throughput[c][to] = m_throughput[c][from];
+        }
+        m_pixel[to] = m_pixel[from];
+        m_pdf[to] = m_pdf[from];
+        m_sampler[to] = m_sampler[from];
+    }
+
+    void resize(std::size_t n)
+    {
+        for (std::size_t c = 0; c < 3; ++c) {
+            m_orig[c].resize(n);
+            m_dir[c].resize(n);
+            m_throughput[c].resize(n);
+        }
+        m_pixel.resize(n);
+        m_pdf.resize(n);
+        m_sampler.resize(n);
+    }
+
+private:
+    std::array<std::vector<T>, 3> m_orig;
+    std::array<std::vector<T>, 3> m_dir;
+    std::array<std::vector<T>, 3> m_throughput;
+    std::vector<std::uint32_t> m_pixel;
+    std::vector<double> m_pdf;
+    std::vector<Sampler> m_sampler;
+};
+
+// Path tracer processing whole queues of rays at once, one bounce at a time,
+// as a sequence of stages (Russian roulette, intersection, emission, light
+// and BxDF sampling) each running over every active ray. Between bounces,
+// rays are sorted by material so the sampling stage runs coherently. The
+// estimates match those of `Pathtracer`, but only radiance (including
+// derivatives when `T` is a dual number) is computed: nothing is recorded
+// for backpropagation. Every ray carries the sampler of its path, so given
+// the same samplers both tracers draw the same random numbers.
+template <typename T, typename SceneT = Scene<T>>
+class WavefrontTracer {
+public:
+    WavefrontTracer(double absorb,
+                    std::size_t min_bounces,
+                    bool sample_lights = true,
+                    std::size_t queue_size = std::size_t(1) << 16)
+      : m_absorb(absorb)
+      , m_min_bounces(min_bounces)
+      , m_sample_lights(sample_lights)
+      , m_queue_size(queue_size)
+    { }
+
+    // Renders `count` individual samples, storing the estimate of
+    // `samples[j]` (its radiance over the pdf of its camera ray) in
+    // `values[j]`. Every sample draws from a copy of `sampler` started with
+    // `start(pixel, index)`.
+    void render(const SceneT& scene,
+                const Camera<T>& cam,
+                const Sampler& sampler,
+                const PixelSample *samples,
+                std::size_t count,
+                Vector<T, 3> *values)
+    {
+        std::fill(values, values + count, Vector<T, 3>(0));
+        for (std::size_t begin = 0; begin < count; begin += m_queue_size) {
+            std::size_t end = std::min(count, begin + m_queue_size);
+            m_queue.clear();
+            m_queue.reserve(end - begin);
+            for (std::size_t j = begin; j < end; ++j) {
+                std::size_t pixel = samples[j].pixel;
+                Sampler path = sampler;
+                path.start(pixel, samples[j].index);
+                auto [dir, pdf] = cam.sample(pixel % cam.width(),
+                                             pixel / cam.width(), path);
+                // Rays go to the slot of their sample rather than their pixel
+                Vector<T, 3> weight(T(1 / pdf));
+                m_queue.push(
+                    cam.eye(), dir, weight, std::uint32_t(j), 0, path);
+            }
+            trace(scene, m_queue, values);
+        }
+    }
+
+    // Traces every ray of the queue (which is consumed), adding its
+    // radiance times its throughput to the pixel of `image` it belongs to.
+    void trace(const SceneT& scene, RayQueue<T>& queue, Vector<T, 3> *image)
+    {
+        for (std::size_t depth = 0; queue.size() > 0; ++depth) {
+            roulette(queue, depth);
+            intersect(scene, queue);
+            shade(scene, queue, image);
+            sort_by_material();
+            sample(scene, queue, image, depth);
+            std::swap(queue, m_next);
+        }
+    }
+
+private:
+    // Absorbs rays after the minimum number of bounces, compensating the
+    // throughput of the surviving ones.
+    void roulette(RayQueue<T>& queue, std::size_t depth)
+    {
+        if (depth < m_min_bounces)
+            return;
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < queue.size(); ++i) {
+            Sampler& sampler = queue.sampler(i);
+            internal::seek(sampler, depth, internal::roulette_dimension);
+            if (sampler.uniform() < m_absorb)
+                continue;
+            queue.move(i, n);
+            queue.scale_throughput(n++, 1 / (1 - m_absorb));
+        }
+        queue.resize(n);
+    }
+
+    void intersect(const SceneT& scene, const RayQueue<T>& queue)
+    {
+        std::size_t n = queue.size();
+        m_shape.resize(n);
+        m_prim.resize(n);
+        m_t.resize(n);
+        for (std::size_t i = 0; i < n; ++i)
+            m_shape[i] = scene.intersect(
+                queue.orig(i), queue.dir(i), m_t[i], m_prim[i]);
+    }
+
+    // Adds the emission of the surfaces which were hit, and computes the
+    // hit points and normals of the rays which go on scattering.
+    void shade(const SceneT& scene,
+               const RayQueue<T>& queue,
+               Vector<T, 3> *image)
+    {
+        std::size_t n = queue.size();
+        m_point.resize(n);
+        m_normal.resize(n);
+        std::size_t mark = Tape::local().size();
+        for (std::size_t i = 0; i < n; ++i) {
+            Shape<T> *shape = m_shape[i];
+            if (!shape)
+                continue;
+            Vector<T, 3> dir = queue.dir(i);
+            m_point[i] = queue.orig(i) + m_t[i]*dir;
+            m_normal[i] = scene.normal(shape, m_point[i], m_prim[i]);
+            if (dot(m_normal[i], dir) > 0)
+                m_normal[i] = -m_normal[i];
+            if (shape->emitter()) {
+                // Rays leave their vertex with an offset (see `sample`)
+                Vector<T, 3> from = queue.orig(i) - 1e-3*dir;
+                double mis = internal::emission_weight<T>(
+                    scene, shape, from, m_point[i], m_normal[i], queue.pdf(i));
+                image[queue.pixel(i)] += queue.throughput(i)
+                    * shape->emitter()->emission().detach() * mis;
+            }
+            Tape::local().rewind(mark);
+        }
+    }
+
+    // Orders the rays still alive by BxDF, so that each BxDF samples all of
+    // its rays in a row. BxDFs are numbered in order of first appearance
+    // (rather than by address) and rays are counting-sorted, which keeps the
+    // order, and thus the rounding of the image sums, deterministic.
+    void sort_by_material()
+    {
+        constexpr std::uint32_t none = ~std::uint32_t(0);
+        std::size_t n = m_shape.size();
+        m_ids.clear();
+        m_offsets.clear();
+        m_key.resize(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            BxDF<T> *bxdf = m_shape[i] ? m_shape[i]->bxdf() : nullptr;
+            if (!bxdf) {
+                m_key[i] = none;
+                continue;
+            }
+            auto [it, inserted] = m_ids.emplace(bxdf, m_offsets.size());
+            if (inserted)
+                m_offsets.push_back(0);
+            m_key[i] = it->second;
+            ++m_offsets[it->second];
+        }
+        std::size_t total = 0;
+        for (auto& offset : m_offsets)
+            total += std::exchange(offset, total);
+        m_order.resize(total);
+        for (std::size_t i = 0; i < n; ++i)
+            if (m_key[i] != none)
+                m_order[m_offsets[m_key[i]]++] = std::uint32_t(i);
+    }
+
+    void sample(const SceneT& scene,
+                const RayQueue<T>& queue,
+                Vector<T, 3> *image,
+                std::size_t depth)
+    {
+        m_next.clear();
+        m_next.reserve(m_order.size());
+        std::size_t mark = Tape::local().size();
+        for (std::uint32_t i : m_order) {
+            BxDF<T> *bxdf = m_shape[i]->bxdf();
+            Sampler sampler = queue.sampler(i);
+            Vector<T, 3> dir_in = -queue.dir(i);
+            bool sample_lights = m_sample_lights && !bxdf->delta();
+            internal::seek(sampler, depth, internal::light_dimension);
+            if (sample_lights)
+                image[queue.pixel(i)] += queue.throughput(i)
+                    * internal::sample_light<T>(scene, bxdf, m_point[i],
+                        m_normal[i], dir_in, sampler).detach();
+            internal::seek(sampler, depth, internal::bxdf_dimension);
+            auto [dir_out, pdf] = bxdf->sample(m_normal[i], dir_in, sampler);
+            Vector<T, 3> brdf_value = (*bxdf)(
+                m_normal[i], dir_in, dir_out).detach();
+            T cos_theta = dot(m_normal[i], dir_out);
+            Vector<T, 3> throughput = queue.throughput(i) * brdf_value
+                                      * cos_theta / pdf;
+            m_next.push(m_point[i] + 1e-3*dir_out, dir_out, throughput,
+                        queue.pixel(i), sample_lights ? pdf : 0, sampler);
+            Tape::local().rewind(mark);
+        }
+    }
+
+    double m_absorb;
+    std::size_t m_min_bounces;
+    bool m_sample_lights;
+    std::size_t m_queue_size;
+
+    RayQueue<T> m_queue;
+    RayQueue<T> m_next;
+    std::vector<Shape<T>*> m_shape;
+    std::vector<std::size_t> m_prim;
+    std::vector<double> m_t;
+    std::vector<Vector<T, 3>> m_point;
+    std::vector<Vector<T, 3>> m_normal;
+    std::unordered_map<BxDF<T>*, std::uint32_t> m_ids;
+    std::vector<std::size_t> m_offsets;
+    std::vector<std::uint32_t> m_key;
+    std::vector<std::uint32_t> m_order;
+};
+
+} // namespace drt
@@ -1,6 +1,10 @@
 #pragma once
 
 #include <cstddef>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
 #include <tclap/CmdLine.h>
 
 namespace drt {
@@ -9,9 +13,27 @@ struct Args {
     std::size_t width;
     std::size_t height;
     std::size_t samples;
+    bool adaptive;
+    std::size_t min_samples;
+    double target_error;
+    std::size_t pass_samples;
+    std::string checkpoint;
+    double time_budget;
+    std::size_t threads;
+    std::size_t processes;
+    std::size_t shard;
+    std::size_t shards;
+    std::string framebuffer;
     std::size_t min_bounces;
     double absorb_prob;
+    std::size_t seed;
+    std::string sampler;
     std::string output;
+    std::string mesh;
+    std::string adjoint;
+    bool forward_grad;
+    bool wavefront;
+    bool static_scene;
 };
 
 inline bool parse_args(int argc, const char *const *argv, Args *args)
@@ -41,6 +63,91 @@ inline bool parse_args(int argc, const char *const *argv, Args *args)
         "integer"
     );
     cmd.add(samples_arg);
+    TCLAP::SwitchArg adaptive_arg(
+        "a", "adaptive",
+        "Spread samples among pixels by their estimated error (with an "
+        "average of --samples per pixel, and writing the number of samples "
+        "of each pixel next to the output)",
+        false
+    );
+    cmd.add(adaptive_arg);
+    TCLAP::ValueArg<std::size_t> min_samples_arg(
+        "", "min-samples",
+        "Min. number of samples per pixel with --adaptive",
+        false,
+        16,
+        "integer"
+    );
+    cmd.add(min_samples_arg);
+    TCLAP::ValueArg<double> target_error_arg(
+        "", "target-error",
+        "Relative error at which --adaptive stops refining a pixel",
+        false,
+        0,
+        "number"
+    );
+    cmd.add(target_error_arg);
+    TCLAP::ValueArg<std::size_t> pass_samples_arg(
+        "", "pass-samples",
+        "Number of samples per pixel of each progressive pass",
+        false,
+        16,
+        "integer"
+    );
+    cmd.add(pass_samples_arg);
+    TCLAP::ValueArg<std::string> checkpoint_arg(
+        "c", "checkpoint",
+        "File saving the render after each pass, from which it resumes if "
+        "the file exists",
+        false,
+        "",
+        "string"
+    );
+    cmd.add(checkpoint_arg);
+    TCLAP::ValueArg<double> time_budget_arg(
+        "t", "time-budget",
+        "Max. rendering time in seconds (the image then has fewer samples, "
+        "as given next to the output)",
+        false,
+        0,
+        "number"
+    );
+    cmd.add(time_budget_arg);
+    TCLAP::ValueArg<std::size_t> threads_arg(
+        "j", "threads",
+        "Number of rendering threads (0 for one per hardware thread)",
+        false,
+        0,
+        "integer"
+    );
+    cmd.add(threads_arg);
+    TCLAP::ValueArg<std::size_t> processes_arg(
+        "", "processes",
+        "Number of local processes sharing the frame, each claiming tiles "
+        "in turn",
+        false,
+        1,
+        "integer"
+    );
+    cmd.add(processes_arg);
+    TCLAP::ValueArg<std::string> shard_arg(
+        "", "shard",
+        "Only render shard i of N (every Nth tile) into the shared "
+        "framebuffer; the last shard to finish writes the output",
+        false,
+        "",
+        "i/N"
+    );
+    cmd.add(shard_arg);
+    TCLAP::ValueArg<std::string> framebuffer_arg(
+        "", "framebuffer",
+        "Framebuffer (or gradient, with --adjoint) file shared by the "
+        "shards (the output path followed by .fb by default)",
+        false,
+        "",
+        "string"
+    );
+    cmd.add(framebuffer_arg);
     TCLAP::ValueArg<std::size_t> min_bounces_arg(
         "b", "min-bounces",
         "Min. number of light bounces",
@@ -57,6 +164,25 @@ inline bool parse_args(int argc, const char *const *argv, Args *args)
         "number"
     );
     cmd.add(absorb_prob_arg);
+    TCLAP::ValueArg<std::size_t> seed_arg(
+        "", "seed",
+        "Seed of the random number sequences",
+        false,
+        0,
+        "integer"
+    );
+    cmd.add(seed_arg);
+    std::vector<std::string> samplers {
+        "independent", "halton", "sobol", "blue-noise"};
+    TCLAP::ValuesConstraint<std::string> sampler_constraint(samplers);
+    TCLAP::ValueArg<std::string> sampler_arg(
+        "", "sampler",
+        "Sequence of the random numbers of each pixel",
+        false,
+        "independent",
+        &sampler_constraint
+    );
+    cmd.add(sampler_arg);
     TCLAP::ValueArg<std::string> output_arg(
         "o", "output",
         "Output path",
@@ -65,17 +191,97 @@ inline bool parse_args(int argc, const char *const *argv, Args *args)
         "string"
     );
     cmd.add(output_arg);
+    TCLAP::ValueArg<std::string> mesh_arg(
+        "m", "mesh",
+        "Triangle mesh to add to the scene (.obj, .ply or .drtm)",
+        false,
+        "",
+        "string"
+    );
+    cmd.add(mesh_arg);
+    TCLAP::ValueArg<std::string> adjoint_arg(
+        "", "adjoint",
+        "Derivatives of a loss w.r.t. the pixels of the image (EXR): "
+        "instead of the image, write the gradient of the loss w.r.t. the "
+        "scene parameters to the output, as text (processes and shards "
+        "each handle a shard of the tiles)",
+        false,
+        "",
+        "string"
+    );
+    cmd.add(adjoint_arg);
+    TCLAP::SwitchArg forward_grad_arg(
+        "g", "forward-grad",
+        "Also write the derivatives w.r.t. the scene parameters "
+        "(computed with forward-mode differentiation)",
+        false
+    );
+    cmd.add(forward_grad_arg);
+    TCLAP::SwitchArg wavefront_arg(
+        "w", "wavefront",
+        "Trace rays in batches, one bounce at a time",
+        false
+    );
+    cmd.add(wavefront_arg);
+    TCLAP::SwitchArg static_scene_arg(
+        "s", "static-scene",
+        "Store shapes by type, so ray queries avoid virtual calls",
+        false
+    );
+    cmd.add(static_scene_arg);
     try {
         cmd.parse(argc, argv);
         args->width = width_arg.getValue();
         args->height = height_arg.getValue();
         args->samples = samples_arg.getValue();
+        args->adaptive = adaptive_arg.getValue();
+        args->min_samples = min_samples_arg.getValue();
+        args->target_error = target_error_arg.getValue();
+        args->pass_samples = pass_samples_arg.getValue();
+        args->checkpoint = checkpoint_arg.getValue();
+        args->time_budget = time_budget_arg.getValue();
+        args->threads = threads_arg.getValue();
+        args->processes = processes_arg.getValue();
+        args->framebuffer = framebuffer_arg.getValue();
         args->min_bounces = min_bounces_arg.getValue();
         args->absorb_prob = absorb_prob_arg.getValue();
+        args->seed = seed_arg.getValue();
+        args->sampler = sampler_arg.getValue();
         args->output = output_arg.getValue();
+        args->mesh = mesh_arg.getValue();
+        args->adjoint = adjoint_arg.getValue();
+        args->forward_grad = forward_grad_arg.getValue();
+        args->wavefront = wavefront_arg.getValue();
+        args->static_scene = static_scene_arg.getValue();
     } catch (const TCLAP::ArgException& e) {
         return false;
     }
+
+    args->shard = 0;
+    args->shards = 0;
+    const std::string& shard = shard_arg.getValue();
+    if (!shard.empty()) {
+        char slash;
+        std::istringstream in(shard);
+        if (!(in >> args->shard >> slash >> args->shards) || !in.eof()
+            || slash != '/' || args->shard >= args->shards) {
+            std::cerr << "Invalid shard: " << shard << std::endl;
+            return false;
+        }
+    }
+    if ((args->shards > 0 || args->processes > 1)
+        && (args->adaptive || !args->checkpoint.empty())) {
+        std::cerr << "Sharded renders support neither --adaptive nor "
+                     "--checkpoint" << std::endl;
+        return false;
+    }
+    if (!args->adjoint.empty()
+        && (args->forward_grad || args->wavefront || args->adaptive
+            || !args->checkpoint.empty() || args->time_budget > 0)) {
+        std::cerr << "--adjoint is only supported by plain path tracing "
+                     "(without time budget)" << std::endl;
+        return false;
+    }
     return true;
 }
 
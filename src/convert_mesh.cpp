@@ -0,0 +1,25 @@
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <string>
+#include "drt/mesh_io.hpp"
+
+using namespace drt;
+
+// Converts a mesh (.obj, .ply or .drtm) to the native format, whose BVH and
+// area CDF are stored with the mesh so that it loads without processing.
+int main(int argc, const char *argv[])
+{
+    if (argc != 3) {
+        std::fprintf(stderr, "Usage: %s <input mesh> <output.drtm>\n",
+                     argv[0]);
+        return EXIT_FAILURE;
+    }
+    try {
+        save_mesh(argv[2], load_mesh(argv[1]));
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include "drt/adjoint.hpp"
+#include "drt/camera.hpp"
+#include "drt/optimizer.hpp"
+#include "drt/parallel.hpp"
+#include "drt/pathtracer.hpp"
+#include "drt/scene.hpp"
+#include "drt/shape.hpp"
+#include "drt/static_scene.hpp"
+#include "drt/vector.hpp"
+#include "optimize_args.hpp"
+#include "read.hpp"
+#include "test_scene.hpp"
+#include "write.hpp"
+
+using namespace drt;
+
+std::unique_ptr<Optimizer> make_optimizer(const OptimizeArgs& args)
+{
+    if (args.optimizer == "sgd")
+        return std::make_unique<SGD>(args.rate, args.momentum);
+    return std::make_unique<Adam>(args.rate);
+}
+
+// Fits the parameters of `test` so that renders of `scene` match `target`.
+// Every iteration renders the image, then the gradient of its loss from the
+// derivative of the loss w.r.t. every pixel, with independent samples (so
+// that it is unbiased). The scene, threads and buffers are set up once, as
+// only parameter values change.
+template <typename SceneT>
+void optimize(const OptimizeArgs& args,
+              TestScene<double>& test,
+              const SceneT& scene,
+              const Camera<double>& cam,
+              const std::vector<Vector<double, 3>>& target)
+{
+    std::size_t n = cam.width() * cam.height();
+    std::size_t spp = args.samples;
+
+    ParameterSet<double, 3> params;
+    test.add_parameters(params);
+    std::unique_ptr<Optimizer> optimizer = make_optimizer(args);
+    std::vector<double> values(params.size());
+    std::vector<double> grads(params.size());
+
+    ThreadPool pool(args.threads);
+    AdjointRenderer<double, SceneT> renderer(
+        pool, scene, cam,
+        Pathtracer<double, SceneT>(args.absorb_prob, args.min_bounces),
+        Sampler(args.seed));
+    std::vector<Vector<double, 3>> image(n);
+    std::vector<Vector<double, 3>> adjoint(n);
+
+    Loss loss = parse_loss(args.loss);
+    for (std::size_t it = 0; it < args.iterations; ++it) {
+        auto start = std::chrono::steady_clock::now();
+        renderer.render(2*it*spp, spp, image.data());
+        double value = image_loss(
+            loss, image.data(), target.data(), n, adjoint.data());
+        std::fill(grads.begin(), grads.end(), 0);
+        renderer.backward((2*it + 1)*spp, spp, adjoint.data(), params,
+                          grads.data());
+
+        params.get(values.data());
+        optimizer->step(values.data(), grads.data(), values.size());
+        params.set(values.data());
+
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        printf("Iteration %zu: loss %g (%.3f s)\n", it + 1, value,
+               elapsed.count());
+        fflush(stdout);
+    }
+
+    params.get(values.data());
+    for (std::size_t i = 0; i < num_params; ++i)
+        printf("%s: %g %g %g\n", test.parameter_names[i], values[3*i],
+               values[3*i + 1], values[3*i + 2]);
+
+    if (!args.output.empty()) {
+        renderer.render(2*args.iterations*spp, spp, image.data());
+        write_exr(args.output.c_str(), image.data(), cam.width(),
+                  cam.height());
+    }
+}
+
+int main(int argc, const char *argv[])
+{
+    OptimizeArgs args;
+    if (!parse_optimize_args(argc, argv, &args)) {
+        return EXIT_FAILURE;
+    }
+
+    std::size_t width, height;
+    std::vector<Vector<double, 3>> target = read_exr<double>(
+        args.target.c_str(), width, height);
+
+    // Start from grey walls
+    TestSceneParams initial;
+    initial.red = initial.green = Vector<double, 3>(0.5);
+    TestScene<double> test(args.mesh, initial);
+
+    Camera<double> cam(width, height);
+    cam.look_at(Vector<double, 3>{0, 0, 0}, Vector<double, 3>{0, 0, 1});
+
+    if (args.static_scene) {
+        StaticScene<double, Sphere<double>, Plane<double>,
+                    TriangleMesh<double>> scene;
+        test.add_shapes([&](const auto& shape) { scene.push_back(shape); });
+        scene.build();
+        optimize(args, test, scene, cam, target);
+    } else {
+        Scene<double> scene;
+        test.add_shapes([&](auto& shape) { scene.push_back(&shape); });
+        scene.build();
+        optimize(args, test, scene, cam, target);
+    }
+
+    return EXIT_SUCCESS;
+}
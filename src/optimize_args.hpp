@@ -0,0 +1,170 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <tclap/CmdLine.h>
+
+namespace drt {
+
+struct OptimizeArgs {
+    std::string target;
+    std::size_t samples;
+    std::size_t iterations;
+    std::string loss;
+    std::string optimizer;
+    double rate;
+    double momentum;
+    std::size_t threads;
+    std::size_t min_bounces;
+    double absorb_prob;
+    std::size_t seed;
+    std::string output;
+    std::string mesh;
+    bool static_scene;
+};
+
+inline bool parse_optimize_args(int argc,
+                                const char *const *argv,
+                                OptimizeArgs *args)
+{
+    TCLAP::CmdLine cmd("Fits the materials and light of the test scene to a "
+                       "target image", ' ', "0.1");
+    TCLAP::ValueArg<std::string> target_arg(
+        "i", "target",
+        "Target image (e.g. rendered by render, whose size it sets)",
+        true,
+        "",
+        "string"
+    );
+    cmd.add(target_arg);
+    TCLAP::ValueArg<std::size_t> samples_arg(
+        "n", "samples",
+        "Number of samples per pixel of each iteration (for both the image "
+        "and its gradient)",
+        false,
+        4,
+        "integer"
+    );
+    cmd.add(samples_arg);
+    TCLAP::ValueArg<std::size_t> iterations_arg(
+        "k", "iterations",
+        "Number of optimization steps",
+        false,
+        100,
+        "integer"
+    );
+    cmd.add(iterations_arg);
+    std::vector<std::string> losses {"l1", "l2"};
+    TCLAP::ValuesConstraint<std::string> loss_constraint(losses);
+    TCLAP::ValueArg<std::string> loss_arg(
+        "l", "loss",
+        "Image loss, averaged over pixels",
+        false,
+        "l2",
+        &loss_constraint
+    );
+    cmd.add(loss_arg);
+    std::vector<std::string> optimizers {"adam", "sgd"};
+    TCLAP::ValuesConstraint<std::string> optimizer_constraint(optimizers);
+    TCLAP::ValueArg<std::string> optimizer_arg(
+        "", "optimizer",
+        "Optimization method",
+        false,
+        "adam",
+        &optimizer_constraint
+    );
+    cmd.add(optimizer_arg);
+    TCLAP::ValueArg<double> rate_arg(
+        "r", "rate",
+        "Learning rate",
+        false,
+        0.01,
+        "number"
+    );
+    cmd.add(rate_arg);
+    TCLAP::ValueArg<double> momentum_arg(
+        "", "momentum",
+        "Momentum of --optimizer sgd",
+        false,
+        0.9,
+        "number"
+    );
+    cmd.add(momentum_arg);
+    TCLAP::ValueArg<std::size_t> threads_arg(
+        "j", "threads",
+        "Number of rendering threads (0 for one per hardware thread)",
+        false,
+        0,
+        "integer"
+    );
+    cmd.add(threads_arg);
+    TCLAP::ValueArg<std::size_t> min_bounces_arg(
+        "b", "min-bounces",
+        "Min. number of light bounces",
+        false,
+        1,
+        "integer"
+    );
+    cmd.add(min_bounces_arg);
+    TCLAP::ValueArg<double> absorb_prob_arg(
+        "p", "absorb-prob",
+        "Ray absorbption prob. per bounce (after min. bounces)",
+        false,
+        0.5,
+        "number"
+    );
+    cmd.add(absorb_prob_arg);
+    TCLAP::ValueArg<std::size_t> seed_arg(
+        "", "seed",
+        "Seed of the random number sequences",
+        false,
+        0,
+        "integer"
+    );
+    cmd.add(seed_arg);
+    TCLAP::ValueArg<std::string> output_arg(
+        "o", "output",
+        "Path of the image rendered with the final parameters",
+        false,
+        "",
+        "string"
+    );
+    cmd.add(output_arg);
+    TCLAP::ValueArg<std::string> mesh_arg(
+        "m", "mesh",
+        "Triangle mesh to add to the scene (.obj, .ply or .drtm)",
+        false,
+        "",
+        "string"
+    );
+    cmd.add(mesh_arg);
+    TCLAP::SwitchArg static_scene_arg(
+        "s", "static-scene",
+        "Store shapes by type, so ray queries avoid virtual calls",
+        false
+    );
+    cmd.add(static_scene_arg);
+    try {
+        cmd.parse(argc, argv);
+        args->target = target_arg.getValue();
+        args->samples = samples_arg.getValue();
+        args->iterations = iterations_arg.getValue();
+        args->loss = loss_arg.getValue();
+        args->optimizer = optimizer_arg.getValue();
+        args->rate = rate_arg.getValue();
+        args->momentum = momentum_arg.getValue();
+        args->threads = threads_arg.getValue();
+        args->min_bounces = min_bounces_arg.getValue();
+        args->absorb_prob = absorb_prob_arg.getValue();
+        args->seed = seed_arg.getValue();
+        args->output = output_arg.getValue();
+        args->mesh = mesh_arg.getValue();
+        args->static_scene = static_scene_arg.getValue();
+    } catch (const TCLAP::ArgException& e) {
+        return false;
+    }
+    return true;
+}
+
+}
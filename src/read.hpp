@@ -0,0 +1,34 @@
+#pragma once
+
+#include <ImfRgba.h>
+#include <ImfRgbaFile.h>
+#include <cstddef>
+#include <vector>
+#include "drt/vector.hpp"
+
+namespace drt {
+
+// Reads the RGB channels of an EXR image, storing its size in `width` and
+// `height`.
+template <typename T>
+inline std::vector<Vector<T, 3>> read_exr(const char *fname,
+                                          std::size_t& width,
+                                          std::size_t& height)
+{
+    Imf::RgbaInputFile file(fname);
+    const auto& window = file.dataWindow();
+    width = window.max.x - window.min.x + 1;
+    height = window.max.y - window.min.y + 1;
+    std::vector<Imf::Rgba> pixels(width * height);
+    file.setFrameBuffer(pixels.data() - window.min.x
+                        - window.min.y * std::ptrdiff_t(width), 1, width);
+    file.readPixels(window.min.y, window.max.y);
+
+    std::vector<Vector<T, 3>> data(width * height);
+    for (std::size_t i = 0; i < width * height; ++i)
+        data[i] = Vector<T, 3>{T(float(pixels[i].r)), T(float(pixels[i].g)),
+                               T(float(pixels[i].b))};
+    return data;
+}
+
+} // namespace drt
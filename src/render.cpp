@@ -1,93 +1,476 @@
 #include <stdio.h>
-#include "drt/bxdf.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <thread>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "drt/adaptive.hpp"
+#include "drt/adjoint.hpp"
 #include "drt/camera.hpp"
+#include "drt/checkpoint.hpp"
 #include "drt/dual.hpp"
-#include "drt/emitter.hpp"
-#include "drt/integrate.hpp"
+#include "drt/framebuffer.hpp"
+#include "drt/parallel.hpp"
 #include "drt/pathtracer.hpp"
+#include "drt/scene.hpp"
+#include "drt/sequence.hpp"
 #include "drt/shape.hpp"
+#include "drt/static_scene.hpp"
+#include "drt/tape.hpp"
 #include "drt/vector.hpp"
+#include "drt/wavefront.hpp"
 #include "args.hpp"
+#include "read.hpp"
+#include "test_scene.hpp"
 #include "write.hpp"
 
 using namespace drt;
 
-int main(int argc, const char *argv[])
+// Returns the sequence named `name`, or null for independent samples.
+std::unique_ptr<Sequence> make_sequence(const std::string& name,
+                                        std::size_t width)
 {
-    Args args;
-    if (!parse_args(argc, argv, &args)) {
-        return EXIT_FAILURE;
+    if (name == "halton")
+        return std::make_unique<HaltonSequence>();
+    if (name == "sobol")
+        return std::make_unique<SobolSequence>();
+    if (name == "blue-noise")
+        return std::make_unique<BlueNoiseSequence>(width);
+    return nullptr;
+}
+
+// Identifies the renders whose samples can be accumulated together (in the
+// same checkpoint or shared framebuffer).
+std::uint64_t render_key(const Args& args)
+{
+    std::uint64_t key = internal::hash(args.width, args.height);
+    for (std::uint64_t value : {std::uint64_t(args.seed),
+                                std::uint64_t(args.min_bounces),
+                                std::hash<double>()(args.absorb_prob),
+                                std::hash<std::string>()(args.sampler),
+                                std::hash<std::string>()(args.mesh)})
+        key = internal::hash(key, value);
+    return key;
+}
+
+std::string framebuffer_path(const Args& args)
+{
+    return args.framebuffer.empty() ? args.output + ".fb" : args.framebuffer;
+}
+
+// Forks `processes - 1` worker processes, adding their ids to `workers`.
+// Returns the index of the calling process among all, 0 in the parent.
+std::size_t fork_processes(std::size_t processes, std::vector<pid_t>& workers)
+{
+    for (std::size_t i = 1; i < processes; ++i) {
+        pid_t pid = ::fork();
+        if (pid < 0)
+            throw std::runtime_error("cannot fork");
+        if (pid == 0)
+            return i;
+        workers.push_back(pid);
+    }
+    return 0;
+}
+
+void wait_processes(const std::vector<pid_t>& workers)
+{
+    for (pid_t pid : workers) {
+        int status;
+        if (::waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0)
+            throw std::runtime_error("a rendering process failed");
+    }
+}
+
+// Number of threads per process: the hardware threads are split between
+// local processes unless set
+std::size_t process_threads(const Args& args)
+{
+    if (args.threads == 0 && args.processes > 1)
+        return std::max<std::size_t>(
+            std::thread::hardware_concurrency() / args.processes, 1);
+    return args.threads;
+}
+
+// Renders the scene with the engine selected by `args`, storing the number
+// of samples taken by every pixel in `spp`. When the frame is split into
+// shards, returns an empty image in all processes but the last to finish.
+template <typename T, typename SceneT>
+std::vector<Vector<T, 3>> render_image(const Args& args,
+                                       const SceneT& scene,
+                                       const Camera<T>& cam,
+                                       std::vector<std::size_t>& spp)
+{
+    std::size_t width = cam.width();
+    std::size_t n = width * cam.height();
+    std::vector<Vector<T, 3>> radiance(n, Vector<T, 3>(0));
+    spp.assign(n, 0);
+
+    // With several processes, each renders whole tiles into a framebuffer
+    // shared by all. Local processes are forked before any thread starts.
+    std::size_t processes = args.shards > 0 ? args.shards : args.processes;
+    std::unique_ptr<SharedFramebuffer<T>> framebuffer;
+    std::vector<pid_t> workers;
+    bool worker = false;
+    if (args.shards > 0) {
+        framebuffer = std::make_unique<SharedFramebuffer<T>>(
+            framebuffer_path(args), n,
+            internal::hash(render_key(args), args.shards));
+    } else if (args.processes > 1) {
+        framebuffer = std::make_unique<SharedFramebuffer<T>>(n);
+        worker = fork_processes(args.processes, workers) != 0;
+    }
+
+    std::unique_ptr<Sequence> sequence = make_sequence(args.sampler, width);
+    Sampler sampler(args.seed, sequence.get());
+    // Every thread draws from its own copy of the sampler, and traces
+    // wavefronts with its own queues
+    ThreadPool pool(process_threads(args));
+    std::vector<Sampler> samplers(pool.size(), sampler);
+    std::vector<WavefrontTracer<T, SceneT>> wavefronts(
+        pool.size(),
+        WavefrontTracer<T, SceneT>(args.absorb_prob, args.min_bounces));
+    Pathtracer<T, SceneT> tracer(args.absorb_prob, args.min_bounces);
+    std::size_t budget = args.samples * n / std::max<std::size_t>(processes, 1);
+    std::atomic<std::size_t> done(0);
+    // Stores the estimate of `samples[j]` in `values[j]`, on thread `thread`
+    auto render = [&](std::size_t thread,
+                      const PixelSample *samples,
+                      std::size_t count,
+                      Vector<T, 3> *values) {
+        Sampler& sampler = samplers[thread];
+        if (args.wavefront) {
+            wavefronts[thread].render(
+                scene, cam, sampler, samples, count, values);
+        } else {
+            for (std::size_t j = 0; j < count; ++j) {
+                std::size_t pixel = samples[j].pixel;
+                sampler.start(pixel, samples[j].index);
+                auto [dir, pdf] = cam.sample(
+                    pixel % width, pixel / width, sampler);
+                Vector<T, 3, true> sample = tracer.trace(
+                    scene, cam.eye(), dir, sampler);
+                values[j] = sample.detach() / pdf;
+                Tape::local().clear();
+            }
+        }
+        done += count;
+        if (thread == 0 && !worker) {
+            printf("% 5.2f%%\r", std::min(100., 100. * done / budget));
+            fflush(stdout);
+        }
+    };
+
+    std::vector<Tile> tiles = make_tiles(width, cam.height());
+    std::vector<std::vector<PixelSample>> tile_samples(pool.size());
+    std::vector<std::vector<Vector<T, 3>>> tile_values(pool.size());
+    // Gives up to `pass_samples` more samples (and at most `args.samples` in
+    // all) to the pixels of `tile`, adding them to `sums` and `counts`
+    auto render_tile = [&](std::size_t thread,
+                           const Tile& tile,
+                           std::size_t pass_samples,
+                           Vector<T, 3> *sums,
+                           std::uint32_t *counts) {
+        std::vector<PixelSample>& samples = tile_samples[thread];
+        std::vector<Vector<T, 3>>& values = tile_values[thread];
+        samples.clear();
+        for (std::size_t y = tile.y_begin; y < tile.y_end; ++y) {
+            for (std::size_t x = tile.x_begin; x < tile.x_end; ++x) {
+                std::size_t p = y*width + x;
+                std::size_t end = std::min<std::size_t>(
+                    counts[p] + pass_samples, args.samples);
+                for (std::size_t k = counts[p]; k < end; ++k)
+                    samples.push_back({std::uint32_t(p), std::uint32_t(k)});
+            }
+        }
+        values.resize(samples.size());
+        render(thread, samples.data(), samples.size(), values.data());
+        // Tiles do not overlap, so threads never share pixels
+        for (std::size_t j = 0; j < samples.size(); ++j) {
+            sums[samples[j].pixel] += values[j];
+            ++counts[samples[j].pixel];
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    auto out_of_time = [&]() {
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        return args.time_budget > 0 && elapsed.count() >= args.time_budget;
+    };
+
+    if (args.adaptive) {
+        AdaptiveSettings settings;
+        settings.min_samples = args.min_samples;
+        settings.samples = args.samples;
+        settings.target_error = args.target_error;
+        PixelEstimates<T> estimates(n);
+        // Splits each chunk of samples into a few blocks per thread
+        auto render_chunk = [&](const PixelSample *samples,
+                                std::size_t count,
+                                Vector<T, 3> *values) {
+            std::size_t blocks = 4 * pool.size();
+            std::size_t block = std::max((count + blocks - 1) / blocks,
+                                         std::size_t(1));
+            pool.run((count + block - 1) / block,
+                     [&](std::size_t thread, std::size_t i) {
+                         std::size_t begin = i * block;
+                         render(thread, samples + begin,
+                                std::min(block, count - begin),
+                                values + begin);
+                     });
+        };
+        render_adaptive(settings, estimates, render_chunk);
+        for (std::size_t i = 0; i < n; ++i) {
+            radiance[i] = estimates.mean(i);
+            spp[i] = estimates.samples(i);
+        }
+    } else if (framebuffer) {
+        // Processes take either the tiles of their shard, or tiles claimed
+        // one at a time from the counter of the framebuffer
+        Vector<T, 3> *sums = framebuffer->sums();
+        std::uint32_t *counts = framebuffer->samples();
+        // Shards out of time are not done: running them again completes
+        // their tiles
+        std::atomic<bool> skipped(false);
+        if (args.shards > 0) {
+            std::vector<Tile> shard;
+            for (std::size_t i = args.shard; i < tiles.size(); i += args.shards)
+                shard.push_back(tiles[i]);
+            pool.run(shard.size(), [&](std::size_t thread, std::size_t i) {
+                if (out_of_time())
+                    skipped = true;
+                else
+                    render_tile(thread, shard[i], args.samples, sums, counts);
+            });
+        } else {
+            pool.run(pool.size(), [&](std::size_t thread, std::size_t) {
+                std::size_t i;
+                while (!out_of_time() && framebuffer->claim(tiles.size(), i))
+                    render_tile(thread, tiles[i], args.samples, sums, counts);
+            });
+        }
+        if (worker)
+            ::_exit(0);
+        wait_processes(workers);
+        if (args.shards > 0 && skipped) {
+            printf("\nShard %zu/%zu out of time\n", args.shard, args.shards);
+            return {};
+        }
+        if (args.shards > 0 && !framebuffer->finish(args.shard, args.shards)) {
+            printf("\nShard %zu/%zu done\n", args.shard, args.shards);
+            return {};
+        }
+        for (std::size_t i = 0; i < n; ++i) {
+            if (counts[i] > 0)
+                radiance[i] = sums[i] / double(counts[i]);
+            spp[i] = counts[i];
+        }
+        if (args.shards > 0)
+            std::remove(framebuffer_path(args).c_str());
+    } else {
+        // Render in passes, each giving up to `pass_samples` more samples to
+        // every pixel. Samples keep their index whatever the passes, so the
+        // image only depends on the number of samples of each pixel.
+        std::vector<Vector<T, 3>> sums(n, Vector<T, 3>(0));
+        std::vector<std::uint32_t> counts(n, 0);
+        std::unique_ptr<Checkpoint<T>> checkpoint;
+        if (!args.checkpoint.empty()) {
+            checkpoint = std::make_unique<Checkpoint<T>>(
+                args.checkpoint, n, render_key(args));
+            if (checkpoint->load(sums.data(), counts.data()))
+                printf("Resuming from %s\n", args.checkpoint.c_str());
+        }
+        for (std::uint32_t count : counts)
+            done += std::min<std::size_t>(count, args.samples);
+
+        std::size_t pass_samples = std::max<std::size_t>(args.pass_samples, 1);
+        while (done < budget && !out_of_time()) {
+            pool.run(tiles.size(), [&](std::size_t thread, std::size_t i) {
+                // Skipping tiles leaves pixels with consistent sums and
+                // counts, which later passes simply complete
+                if (!out_of_time())
+                    render_tile(thread, tiles[i], pass_samples,
+                                sums.data(), counts.data());
+            });
+            if (checkpoint)
+                checkpoint->save(sums.data(), counts.data());
+        }
+        for (std::size_t i = 0; i < n; ++i) {
+            if (counts[i] > 0)
+                radiance[i] = sums[i] / double(counts[i]);
+            spp[i] = counts[i];
+        }
+    }
+    printf("\n");
+
+    return radiance;
+}
+
+// Writes the gradient w.r.t. the parameters of `test` of a loss whose
+// derivatives w.r.t. the pixels of the image rendered with `args` are in
+// `args.adjoint`. The gradient is estimated from the samples following
+// those of the image, so that it is unbiased. With several processes, each
+// computes the gradient of a shard of the tiles in its own slice of shared
+// gradients, summed by the last to finish, which alone writes the output.
+template <typename T, typename SceneT>
+void render_gradient(const Args& args,
+                     TestScene<T>& test,
+                     const SceneT& scene,
+                     const Camera<T>& cam)
+{
+    std::size_t width, height;
+    std::vector<Vector<T, 3>> adjoint = read_exr<T>(
+        args.adjoint.c_str(), width, height);
+    if (width != cam.width() || height != cam.height())
+        throw std::runtime_error(args.adjoint + " is not of the image size");
+
+    ParameterSet<T, 3> params;
+    test.add_parameters(params);
+    std::vector<T> grads(params.size(), 0);
+
+    std::size_t processes = args.shards > 0 ? args.shards : args.processes;
+    std::unique_ptr<SharedGradients<T>> shared;
+    std::vector<pid_t> workers;
+    std::size_t process = 0;
+    if (args.shards > 0) {
+        std::uint64_t key = internal::hash(
+            render_key(args), std::hash<std::string>()(args.adjoint));
+        shared = std::make_unique<SharedGradients<T>>(
+            framebuffer_path(args), grads.size(), args.shards, key);
+        process = args.shard;
+    } else if (args.processes > 1) {
+        shared = std::make_unique<SharedGradients<T>>(
+            grads.size(), args.processes);
+        process = fork_processes(args.processes, workers);
+    }
+
+    std::unique_ptr<Sequence> sequence = make_sequence(args.sampler, width);
+    ThreadPool pool(process_threads(args));
+    AdjointRenderer<T, SceneT> renderer(
+        pool, scene, cam,
+        Pathtracer<T, SceneT>(args.absorb_prob, args.min_bounces),
+        Sampler(args.seed, sequence.get()), process,
+        std::max<std::size_t>(processes, 1));
+    renderer.backward(args.samples, args.samples, adjoint.data(), params,
+                      grads.data());
+
+    if (shared) {
+        shared->store(process, grads.data());
+        if (args.shards > 0) {
+            if (!shared->finish(process)) {
+                printf("Shard %zu/%zu done\n", args.shard, args.shards);
+                return;
+            }
+        } else {
+            if (process != 0)
+                ::_exit(0);
+            wait_processes(workers);
+        }
+        shared->sum(grads.data());
+        if (args.shards > 0)
+            std::remove(framebuffer_path(args).c_str());
     }
 
-    using T = double;
-    // using T = Dual<double>;
-
-    // Configure scene parameters
-    Vector<T, 3, true> red(Vector<T, 3>{0.5, 0, 0}, true);
-    Vector<T, 3, true> green(Vector<T, 3>{0, 0.5, 0}, true);
-    Vector<T, 3, true> white(Vector<T, 3>{0.5, 0.5, 0.5}, true);
-    Vector<T, 3, true> emission(Vector<T, 3>(1), true);
-
-    // Configure scene materials
-    auto diffuse_red = std::make_shared<DiffuseBxDF<T>>(red);
-    auto diffuse_green = std::make_shared<DiffuseBxDF<T>>(green);
-    auto diffuse_white = std::make_shared<DiffuseBxDF<T>>(white);
-    auto specular_white = std::make_shared<SpecularBxDF<T>>(white, 30);
-    auto emitter = std::make_shared<AreaEmitter<T>>(emission);
-
-    // Configure scene shapes
-    Sphere<T> sphere_front(Vector<T, 3>{0., 0., 3.}, 1., diffuse_white);
-    Sphere<T> sphere_back(Vector<T, 3>{-1., 1., 4.5}, 1., diffuse_white);
-    Plane<T> left_plane(Vector<T, 3>{-1., 0., 0.}, -3., diffuse_red);
-    Plane<T> right_plane(Vector<T, 3>{1., 0., 0.1}, -3., diffuse_green);
-    Plane<T> back_plane(Vector<T, 3>{0., 0., -1.}, -6., diffuse_white);
-    Plane<T> front_plane(Vector<T, 3>{0, 0, 1}, 0, diffuse_white);
-    Plane<T> ground_plane(Vector<T, 3>{0., 1., 0.}, -3., diffuse_white);
-    Plane<T> ceiling_plane(Vector<T, 3>{0., -1., 0.}, -3., diffuse_white);
-    Sphere<T> light(Vector<T, 3>{0., 3., 3.}, 1., nullptr, emitter);
-
-    // Build test scene
-    Scene<T> scene;
-    scene.push_back(&sphere_front);
-    scene.push_back(&sphere_back);
-    scene.push_back(&left_plane);
-    scene.push_back(&right_plane);
-    scene.push_back(&back_plane);
-    scene.push_back(&front_plane);
-    scene.push_back(&ground_plane);
-    scene.push_back(&ceiling_plane);
-    scene.push_back(&light);
+    std::ofstream out(args.output);
+    for (std::size_t i = 0; i < num_params; ++i)
+        out << test.parameter_names[i] << ' ' << grads[3*i] << ' '
+            << grads[3*i + 1] << ' ' << grads[3*i + 2] << '\n';
+    if (!out)
+        throw std::runtime_error("cannot write " + args.output);
+}
+
+template <typename T>
+void render(const Args& args)
+{
+    constexpr bool forward = !std::is_floating_point_v<T>;
+
+    // Configure scene parameters, materials and shapes
+    TestScene<T> test(args.mesh);
 
     // Configure camera position and resolution
     std::size_t width = args.width;
     std::size_t height = args.height;
     Camera<T> cam(width, height);
     cam.look_at(Vector<T, 3>{0, 0, 0}, Vector<T, 3>{0, 0, 1});
-    Vector<double, 3> *img = new Vector<double, 3>[width * height];
-
-    // Configure path tracer sampling
-    Pathtracer<T> tracer(args.absorb_prob, args.min_bounces);
-
-    // Render test scene
-    for (std::size_t y = 0; y < cam.height(); ++y) {
-        for (std::size_t x = 0; x < cam.width(); ++x) {
-            Vector<T, 3> pixel_radiance(0);
-            for (std::size_t i = 0; i < args.samples; ++i) {
-                auto [dir, pdf] = cam.sample(x, y);
-                Vector<T, 3, true> radiance = tracer.trace(scene, cam.eye(), dir);
-                pixel_radiance += radiance.detach() / pdf;
-		// Uncomment to compute gradients
-                // radiance.backward(Vec3(1));
+
+    // Build and render test scene
+    std::vector<Vector<T, 3>> radiance;
+    std::vector<std::size_t> spp;
+    auto render_scene = [&](const auto& scene) {
+        if constexpr (!forward) {
+            if (!args.adjoint.empty()) {
+                render_gradient(args, test, scene, cam);
+                return;
             }
-            img[y*width + x] = pixel_radiance / args.samples;
         }
-        printf("% 5.2f%%\r", 100. * (y+1) / cam.height());
-        fflush(stdout);
+        radiance = render_image(args, scene, cam, spp);
+    };
+    if (args.static_scene) {
+        StaticScene<T, Sphere<T>, Plane<T>, TriangleMesh<T>> scene;
+        test.add_shapes([&](const auto& shape) { scene.push_back(shape); });
+        scene.build();
+        render_scene(scene);
+    } else {
+        Scene<T> scene;
+        test.add_shapes([&](auto& shape) { scene.push_back(&shape); });
+        scene.build();
+        render_scene(scene);
+    }
+    if (radiance.empty())
+        return;
+
+    std::vector<Vector<double, 3>> img(width * height);
+    std::vector<Vector<double, 3>> tangents[num_params];
+    if (forward)
+        for (auto& tangent : tangents)
+            tangent.resize(width * height);
+    for (std::size_t i = 0; i < width * height; ++i) {
+        for (std::size_t c = 0; c < 3; ++c) {
+            img[i][c] = real(radiance[i][c]);
+            if constexpr (forward)
+                for (std::size_t k = 0; k < num_params; ++k)
+                    tangents[k][i][c] = radiance[i][c].dual(k);
+        }
+    }
+
+    // Write radiance (and derivatives, and samples per pixel) to file
+    write_exr(args.output.c_str(), img.data(), width, height);
+    std::string stem = args.output;
+    if (stem.size() > 4 && stem.compare(stem.size() - 4, 4, ".exr") == 0)
+        stem.resize(stem.size() - 4);
+    if (forward) {
+        for (std::size_t k = 0; k < num_params; ++k) {
+            std::string fname = stem + "_d" + std::to_string(k) + ".exr";
+            write_exr(fname.c_str(), tangents[k].data(), width, height);
+        }
+    }
+    if (args.adaptive || args.time_budget > 0) {
+        std::vector<Vector<double, 3>> spp_map(width * height);
+        for (std::size_t i = 0; i < width * height; ++i)
+            spp_map[i] = Vector<double, 3>(double(spp[i]));
+        std::string fname = stem + "_spp.exr";
+        write_exr(fname.c_str(), spp_map.data(), width, height);
+    }
+}
+
+int main(int argc, const char *argv[])
+{
+    Args args;
+    if (!parse_args(argc, argv, &args)) {
+        return EXIT_FAILURE;
     }
-    printf("\n");
 
-    // Write radiance to file
-    write_exr(args.output.c_str(), img, width, height);
+    // With forward-mode differentiation a single render also yields the
+    // derivatives of the image w.r.t. every scene parameter.
+    if (args.forward_grad)
+        render<Dual<double, num_params>>(args);
+    else
+        render<double>(args);
 
     return 0;
 }
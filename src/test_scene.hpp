@@ -0,0 +1,128 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <type_traits>
+#include "drt/bxdf.hpp"
+#include "drt/emitter.hpp"
+#include "drt/mesh_io.hpp"
+#include "drt/optimizer.hpp"
+#include "drt/shape.hpp"
+#include "drt/vector.hpp"
+
+namespace drt {
+
+// Scene parameters for which forward-mode derivatives can be computed.
+constexpr std::size_t num_params = 4;
+
+// Returns a parameter vector whose derivative along `(1, 1, 1)` is tracked
+// in tangent `index` when rendering with dual numbers.
+template <typename T>
+Vector<T, 3> parameter(const Vector<double, 3>& value, std::size_t index)
+{
+    Vector<T, 3> v;
+    for (std::size_t i = 0; i < 3; ++i) {
+        v[i] = value[i];
+        if constexpr (!std::is_floating_point_v<T>)
+            v[i].dual(index) = 1;
+    }
+    return v;
+}
+
+// Values of the parameters of the test scene: the albedos of its walls and
+// spheres, and the emission of its light.
+struct TestSceneParams {
+    Vector<double, 3> red {0.5, 0, 0};
+    Vector<double, 3> green {0, 0.5, 0};
+    Vector<double, 3> white {0.5, 0.5, 0.5};
+    Vector<double, 3> emission {1, 1, 1};
+};
+
+// Box with a red and a green wall holding two white spheres, lit by a
+// spherical light, with an optional mesh (loaded from `mesh_path`). Shapes
+// refer to the parameters, which can be changed between renders.
+template <typename T>
+struct TestScene {
+    explicit TestScene(const std::string& mesh_path = "",
+                       const TestSceneParams& params = TestSceneParams())
+      : red(parameter<T>(params.red, 0), true)
+      , green(parameter<T>(params.green, 1), true)
+      , white(parameter<T>(params.white, 2), true)
+      , emission(parameter<T>(params.emission, 3), true)
+      , diffuse_red(std::make_shared<DiffuseBxDF<T>>(red))
+      , diffuse_green(std::make_shared<DiffuseBxDF<T>>(green))
+      , diffuse_white(std::make_shared<DiffuseBxDF<T>>(white))
+      , specular_white(std::make_shared<SpecularBxDF<T>>(white, 30))
+      , emitter(std::make_shared<AreaEmitter<T>>(emission))
+      , sphere_front(Vector<T, 3>{0., 0., 3.}, 1., diffuse_white)
+      , sphere_back(Vector<T, 3>{-1., 1., 4.5}, 1., diffuse_white)
+      , left_plane(Vector<T, 3>{-1., 0., 0.}, -3., diffuse_red)
+      , right_plane(Vector<T, 3>{1., 0., 0.1}, -3., diffuse_green)
+      , back_plane(Vector<T, 3>{0., 0., -1.}, -6., diffuse_white)
+      , front_plane(Vector<T, 3>{0, 0, 1}, 0, diffuse_white)
+      , ground_plane(Vector<T, 3>{0., 1., 0.}, -3., diffuse_white)
+      , ceiling_plane(Vector<T, 3>{0., -1., 0.}, -3., diffuse_white)
+      , light(Vector<T, 3>{0., 3., 3.}, 1., nullptr, emitter)
+    {
+        if (!mesh_path.empty())
+            mesh = std::make_unique<TriangleMesh<T>>(load_mesh(mesh_path),
+                                                     diffuse_white);
+    }
+
+    TestScene(const TestScene&) = delete;
+
+    TestScene& operator=(const TestScene&) = delete;
+
+    // Adds the shapes to a scene (of either kind) using `add`
+    template <typename Add>
+    void add_shapes(Add&& add)
+    {
+        add(sphere_front);
+        add(sphere_back);
+        add(left_plane);
+        add(right_plane);
+        add(back_plane);
+        add(front_plane);
+        add(ground_plane);
+        add(ceiling_plane);
+        add(light);
+        if (mesh)
+            add(*mesh);
+    }
+
+    // Registers the parameters, named as in `parameter_names`
+    void add_parameters(ParameterSet<T, 3>& params)
+    {
+        params.add(red, 0, 1);
+        params.add(green, 0, 1);
+        params.add(white, 0, 1);
+        params.add(emission, 0);
+    }
+
+    static constexpr const char *parameter_names[num_params] = {
+        "red", "green", "white", "emission"};
+
+    Vector<T, 3, true> red;
+    Vector<T, 3, true> green;
+    Vector<T, 3, true> white;
+    Vector<T, 3, true> emission;
+
+    std::shared_ptr<DiffuseBxDF<T>> diffuse_red;
+    std::shared_ptr<DiffuseBxDF<T>> diffuse_green;
+    std::shared_ptr<DiffuseBxDF<T>> diffuse_white;
+    std::shared_ptr<SpecularBxDF<T>> specular_white;
+    std::shared_ptr<AreaEmitter<T>> emitter;
+
+    Sphere<T> sphere_front;
+    Sphere<T> sphere_back;
+    Plane<T> left_plane;
+    Plane<T> right_plane;
+    Plane<T> back_plane;
+    Plane<T> front_plane;
+    Plane<T> ground_plane;
+    Plane<T> ceiling_plane;
+    Sphere<T> light;
+    std::unique_ptr<TriangleMesh<T>> mesh;
+};
+
+} // namespace drt
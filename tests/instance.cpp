@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+#include "drt/instance.hpp"
+#include "drt/mesh.hpp"
+#include "drt/shape.hpp"
+#include "drt/vector.hpp"
+
+using namespace drt;
+
+using Vec3 = Vector<double, 3>;
+
+namespace {
+
+int failures = 0;
+
+void check(const char *name, double value, double expected, double tol)
+{
+    double scale = std::max(1., std::abs(expected));
+    if (!(std::abs(value - expected) <= tol * scale)) {
+        std::printf("%s: got %g, expected %g\n", name, value, expected);
+        ++failures;
+    }
+}
+
+void check(const char *name, const Vec3& value, const Vec3& expected,
+           double tol)
+{
+    for (std::size_t i = 0; i < 3; ++i)
+        check(name, value[i], expected[i], tol);
+}
+
+// Similarity moving the unit sphere (and the octahedron below) somewhere
+// in front of the rays
+Transform<double> placement()
+{
+    return Transform<double>::translate(Vec3{1, 2, 5})
+           * Transform<double>::rotate(normalize(Vec3{1, 1, 0}), 0.7)
+           * Transform<double>::scale(Vec3(2));
+}
+
+// Checks that rays from `orig` towards points around `target` see the
+// same hits (distance, normal and light pdf) on both shapes.
+void compare(const char *name,
+             const Shape<double>& direct,
+             const Shape<double>& instance,
+             const Vec3& orig,
+             const Vec3& target,
+             double tol)
+{
+    for (double x : {-1.5, -0.5, 0., 0.7, 1.9}) {
+        for (double y : {-1.3, 0., 0.4, 1.6}) {
+            Vec3 dir = normalize(target + Vec3{x, y, 0.3*x*y} - orig);
+            double t_direct = 0, t_instance = 0;
+            std::size_t prim_direct, prim_instance;
+            bool hit = direct.intersect(orig, dir, t_direct, prim_direct);
+            if (hit != instance.intersect(orig, dir, t_instance,
+                                          prim_instance)) {
+                std::printf("%s: hits differ\n", name);
+                ++failures;
+                continue;
+            }
+            if (!hit)
+                continue;
+            check(name, t_instance, t_direct, tol);
+            Vec3 point = orig + dir * t_direct;
+            check(name, instance.normal(point, prim_instance),
+                  direct.normal(point, prim_direct), tol);
+            check(name, instance.pdf_surface(orig, point),
+                  direct.pdf_surface(orig, point), tol);
+        }
+    }
+}
+
+void instanced_sphere()
+{
+    auto unit = std::make_shared<Sphere<double>>(Vec3(0), 1.);
+    Instance<double> instance(unit, placement());
+    Sphere<double> direct(Vec3{1, 2, 5}, 2.);
+    check("sphere area", instance.area(), direct.area(), 1e-12);
+    compare("sphere, outside", direct, instance, Vec3(0), Vec3{1, 2, 5},
+            1e-9);
+    compare("sphere, inside", direct, instance, Vec3{1.5, 2, 4.5},
+            Vec3{1, 2, 5}, 1e-9);
+}
+
+// Mesh of `vertices` and `triangles`, owning its arrays
+MeshData make_mesh(const std::vector<Vec3>& vertices,
+                   const std::vector<std::array<std::uint32_t, 3>>& triangles)
+{
+    struct Arrays {
+        std::vector<float> position[3];
+        std::vector<std::uint32_t> index[3];
+    };
+    auto arrays = std::make_shared<Arrays>();
+    for (const Vec3& v : vertices)
+        for (std::size_t i = 0; i < 3; ++i)
+            arrays->position[i].push_back(float(v[i]));
+    for (const auto& tri : triangles)
+        for (std::size_t i = 0; i < 3; ++i)
+            arrays->index[i].push_back(tri[i]);
+    MeshData data;
+    data.num_vertices = vertices.size();
+    data.num_triangles = triangles.size();
+    for (std::size_t i = 0; i < 3; ++i) {
+        data.position[i] = arrays->position[i].data();
+        data.index[i] = arrays->index[i].data();
+    }
+    data.storage = arrays;
+    return data;
+}
+
+void instanced_mesh()
+{
+    std::vector<Vec3> vertices = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0},
+                                  {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+    std::vector<std::array<std::uint32_t, 3>> triangles = {
+        {0, 2, 4}, {2, 1, 4}, {1, 3, 4}, {3, 0, 4},
+        {2, 0, 5}, {1, 2, 5}, {3, 1, 5}, {0, 3, 5}};
+    Transform<double> transform = placement();
+    std::vector<Vec3> placed;
+    for (const Vec3& v : vertices)
+        placed.push_back(transform.point(v));
+
+    auto octahedron = std::make_shared<TriangleMesh<double>>(
+        make_mesh(vertices, triangles));
+    Instance<double> instance(octahedron, transform);
+    TriangleMesh<double> direct(make_mesh(placed, triangles));
+    // Placed vertices are rounded to floats
+    check("mesh area", instance.area(), direct.area(), 1e-6);
+    compare("mesh", direct, instance, Vec3(0), Vec3{1, 2, 5}, 1e-5);
+}
+
+} // namespace
+
+int main()
+{
+    instanced_sphere();
+    instanced_mesh();
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,69 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include "drt/tape.hpp"
+#include "drt/vector.hpp"
+
+using namespace drt;
+
+using Vec3 = Vector<double, 3, true>;
+
+namespace {
+
+int failures = 0;
+
+void check(const char *name, const Vector<double, 3>& value, double expected)
+{
+    for (std::size_t i = 0; i < 3; ++i) {
+        if (std::abs(value[i] - expected) > 1e-12) {
+            std::printf("%s: got %g, expected %g\n", name, value[i],
+                        expected);
+            ++failures;
+            return;
+        }
+    }
+}
+
+// A custom backward function calling `backward` on an older node must not
+// end the outer walk before the pending nodes below it.
+void nested_backward_of_older_node()
+{
+    Vec3 p(Vector<double, 3>(1), true);
+    Vec3 a = p * 2.;
+    Vec3 x = p * 3.;
+    Vec3 z(a.detach(), [a](const Vector<double, 3>& g) { a.backward(g); });
+    Vec3 w = x + z;
+    w.backward(Vector<double, 3>(1));
+    check("nested, older node", p.grad(), 5);
+
+    // No adjoint is left pending for a later call
+    p.grad() = Vector<double, 3>(0);
+    x.backward(Vector<double, 3>(1));
+    check("nested, later call", p.grad(), 3);
+    Tape::local().clear();
+}
+
+// A custom backward function evaluating (and backpropagating) a new
+// function of the parameters, as `integrate` does when unbiased.
+void nested_backward_of_newer_node()
+{
+    Vec3 p(Vector<double, 3>(1), true);
+    Vec3 x = p * 3.;
+    Vec3 z(Vector<double, 3>(0), [p](const Vector<double, 3>& g) {
+        Vec3 y = p * 2.;
+        y.backward(g);
+    });
+    Vec3 w = x + z;
+    w.backward(Vector<double, 3>(1));
+    check("nested, newer node", p.grad(), 5);
+    Tape::local().clear();
+}
+
+} // namespace
+
+int main()
+{
+    nested_backward_of_older_node();
+    nested_backward_of_newer_node();
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}